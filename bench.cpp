@@ -0,0 +1,435 @@
+#include "src/Protocol.h"
+#include "src/TLS.h"
+#include "src/Server.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#include <openssl/x509.h>
+
+// Microbenchmarks for the hot paths. Prints one JSON object per line so runs can be diffed between versions:
+//   bin/bench [filter]
+// Only benchmarks whose name contains filter are run.
+//   bin/bench --replay capture.bin
+// Replays a capture (see CaptureWriter) as fast as possible against a server that echoes everything.
+
+namespace {
+	const char *g_Filter = nullptr;
+	volatile uint64_t g_Sink = 0;
+	
+	using Clock = std::chrono::steady_clock;
+	
+	bool IsSelected(const std::string &name){
+		return g_Filter == nullptr || name.find(g_Filter) != std::string::npos;
+	}
+	
+	void Report(const std::string &name, size_t bytesPerOp, uint64_t iterations, double elapsed){
+		double nsPerOp = elapsed * 1e9 / iterations;
+		printf("{\"name\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.3f", name.c_str(), (unsigned long long) iterations, nsPerOp);
+		if(bytesPerOp > 0){
+			printf(",\"bytes_per_op\":%zu,\"mb_per_s\":%.2f", bytesPerOp, bytesPerOp * iterations / elapsed / 1e6);
+		}
+		printf("}\n");
+		fflush(stdout);
+	}
+	
+	template<typename F>
+	void Bench(const std::string &name, size_t bytesPerOp, const F &f){
+		if(!IsSelected(name)) return;
+		
+		// Keep growing the iteration count until a run takes long enough to be meaningful
+		uint64_t iterations = 1;
+		double elapsed;
+		for(;;){
+			auto start = Clock::now();
+			for(uint64_t i = 0; i < iterations; ++i) f();
+			elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+			
+			if(elapsed >= 0.25 || iterations >= (uint64_t(1) << 32)) break;
+			iterations *= elapsed < 0.025 ? 10 : 2;
+		}
+		
+		Report(name, bytesPerOp, iterations, elapsed);
+	}
+	
+	// For things that can't be repeated forever, f is called with every index in [0, iterations)
+	template<typename F>
+	void BenchFixed(const std::string &name, size_t bytesPerOp, uint64_t iterations, const F &f){
+		if(!IsSelected(name)) return;
+		
+		auto start = Clock::now();
+		for(uint64_t i = 0; i < iterations; ++i) f(i);
+		double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+		
+		Report(name, bytesPerOp, iterations, elapsed);
+	}
+	
+	void BenchFrames(){
+		for(size_t len : { (size_t) 16, (size_t) 1024, (size_t) 65536 }){
+			char buf[14];
+			const char maskKey[4] = { 1, 2, 3, 4 };
+			ws28::detail::WriteDataFrameHeader(2, len, buf, maskKey);
+			
+			Bench("frame_header_parse/" + std::to_string(len), 0, [&](){
+				uint64_t frameLength;
+				const char *key;
+				g_Sink += ws28::detail::ParseDataFrameHeader(buf, sizeof(buf), frameLength, key) + frameLength;
+			});
+			
+			Bench("frame_header_write/" + std::to_string(len), 0, [&](){
+				ws28::detail::WriteDataFrameHeader(2, len, buf);
+				g_Sink += buf[1];
+			});
+		}
+		
+		for(size_t len : { (size_t) 16, (size_t) 1024, (size_t) 65536 }){
+			std::vector<char> data(len, 'x');
+			const char maskKey[4] = { 1, 2, 3, 4 };
+			
+			Bench("unmask/" + std::to_string(len), len, [&](){
+				ws28::detail::Mask(data.data(), data.data(), len, maskKey);
+				g_Sink += data[0];
+			});
+		}
+	}
+	
+	void BenchUTF8(){
+		std::string ascii(4096, 'a');
+		
+		// Mix of 1, 2, 3 and 4 byte sequences
+		std::string mixed;
+		while(mixed.size() < 4096) mixed += "a\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80";
+		
+		Bench("utf8/ascii/4096", ascii.size(), [&](){
+			g_Sink += ws28::detail::IsValidUTF8(ascii.data(), ascii.size());
+		});
+		
+		Bench("utf8/mixed/" + std::to_string(mixed.size()), mixed.size(), [&](){
+			g_Sink += ws28::detail::IsValidUTF8(mixed.data(), mixed.size());
+		});
+	}
+	
+	void BenchHandshake(){
+		// What Chrome sends, minus the request line
+		const std::string headers =
+			"Host: example.com:3000\r\n"
+			"Connection: Upgrade\r\n"
+			"Pragma: no-cache\r\n"
+			"Cache-Control: no-cache\r\n"
+			"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+			"Upgrade: websocket\r\n"
+			"Origin: https://example.com\r\n"
+			"Sec-WebSocket-Version: 13\r\n"
+			"Accept-Encoding: gzip, deflate, br\r\n"
+			"Accept-Language: en-US,en;q=0.9\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+			"Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n"
+			"\r\n";
+		
+		std::vector<char> buf(headers.size());
+		
+		Bench("http_headers_parse", headers.size(), [&](){
+			// Parsing lower cases keys in place, so start from a fresh copy every time
+			memcpy(buf.data(), headers.data(), headers.size());
+			
+			ws28::RequestHeaders parsed;
+			g_Sink += ws28::detail::ParseHTTPHeaders(std::string_view(buf.data(), buf.size()), parsed);
+		});
+		
+		Bench("handshake_accept_key", 0, [&](){
+			g_Sink += ws28::detail::ComputeAcceptKey("dGhlIHNhbXBsZSBub25jZQ==").size();
+		});
+	}
+	
+	// Self signed P-256 certificate, so we don't need any files around
+	bool SetupCertificate(SSL_CTX *ctx){
+		EVP_PKEY *pkey = nullptr;
+		EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+		if(pctx == nullptr) return false;
+		
+		bool ok = EVP_PKEY_keygen_init(pctx) > 0
+			&& EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1) > 0
+			&& EVP_PKEY_keygen(pctx, &pkey) > 0;
+		EVP_PKEY_CTX_free(pctx);
+		if(!ok) return false;
+		
+		X509 *cert = X509_new();
+		X509_set_version(cert, 2);
+		ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+		X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+		X509_gmtime_adj(X509_getm_notAfter(cert), 60 * 60);
+		X509_set_pubkey(cert, pkey);
+		
+		X509_NAME *name = X509_get_subject_name(cert);
+		X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*) "localhost", -1, -1, 0);
+		X509_set_issuer_name(cert, name);
+		X509_sign(cert, pkey, EVP_sha256());
+		
+		ok = SSL_CTX_use_certificate(ctx, cert) > 0 && SSL_CTX_use_PrivateKey(ctx, pkey) > 0;
+		
+		X509_free(cert);
+		EVP_PKEY_free(pkey);
+		return ok;
+	}
+	
+	bool Handshake(ws28::TLS &server, ws28::TLS &client){
+		std::vector<char> ignored;
+		for(int i = 0; i < 16 && !(server.IsHandshakeFinished() && client.IsHandshakeFinished()); ++i){
+			client.ForEachPendingWrite([&](const char *data, size_t len){
+				server.ReceivedData(data, len, ignored);
+			});
+			
+			server.ForEachPendingWrite([&](const char *data, size_t len){
+				client.ReceivedData(data, len, ignored);
+			});
+		}
+		
+		return server.IsHandshakeFinished() && client.IsHandshakeFinished();
+	}
+	
+	void BenchTLS(){
+		ws28::TLS::InitSSL();
+		
+		SSL_CTX *serverCtx = SSL_CTX_new(TLS_server_method());
+		SSL_CTX *clientCtx = SSL_CTX_new(TLS_client_method());
+		if(!SetupCertificate(serverCtx)){
+			fprintf(stderr, "Couldn't create a certificate, skipping TLS benchmarks\n");
+			return;
+		}
+		
+		for(size_t len : { (size_t) 1024, (size_t) 16384 }){
+			ws28::TLS server{serverCtx};
+			ws28::TLS client{clientCtx, false, "localhost"};
+			
+			if(!Handshake(server, client)){
+				fprintf(stderr, "TLS handshake failed, skipping TLS benchmarks\n");
+				break;
+			}
+			
+			std::vector<char> plaintext(len, 'x');
+			
+			Bench("tls_encrypt/" + std::to_string(len), len, [&](){
+				client.Write(plaintext.data(), plaintext.size());
+				client.ForEachPendingWrite([](const char *data, size_t len){ g_Sink += len; });
+			});
+			
+			// Records can't be replayed, so decryption goes through a fixed amount of records encrypted beforehand.
+			// The connection is out of sync after tls_encrypt, so this uses a new pair
+			if(!IsSelected("tls_decrypt/" + std::to_string(len))) continue;
+			
+			ws28::TLS server2{serverCtx};
+			ws28::TLS client2{clientCtx, false, "localhost"};
+			if(!Handshake(server2, client2)) break;
+			
+			std::vector<char> ciphertext;
+			std::vector<std::pair<size_t, size_t>> records;
+			for(size_t i = 0; i < (64 * 1024 * 1024) / len; ++i){
+				size_t start = ciphertext.size();
+				client2.Write(plaintext.data(), plaintext.size());
+				client2.ForEachPendingWrite([&](const char *data, size_t len){
+					ciphertext.insert(ciphertext.end(), data, data + len);
+				});
+				records.emplace_back(start, ciphertext.size() - start);
+			}
+			
+			std::vector<char> decrypted;
+			BenchFixed("tls_decrypt/" + std::to_string(len), len, records.size(), [&](uint64_t i){
+				auto &p = records[i];
+				decrypted.clear();
+				server2.ReceivedData(ciphertext.data() + p.first, p.second, decrypted);
+				g_Sink += decrypted.size();
+			});
+		}
+		
+		SSL_CTX_free(serverCtx);
+		SSL_CTX_free(clientCtx);
+	}
+	
+	// The whole server over a MemoryTransport: frames go in, get parsed, and are echoed back without any syscalls
+	void BenchServer(){
+		SSL_CTX *serverCtx = SSL_CTX_new(TLS_server_method());
+		SSL_CTX *clientCtx = SSL_CTX_new(TLS_client_method());
+		if(!SetupCertificate(serverCtx)){
+			fprintf(stderr, "Couldn't create a certificate, skipping server benchmarks\n");
+			return;
+		}
+		
+		ws28::Server server{uv_default_loop(), serverCtx};
+		server.SetMaxMessageSize(1024 * 1024);
+		server.SetClientDataCallback([](ws28::Client *client, char *data, size_t len, int opcode){
+			client->Send(data, len, opcode);
+		});
+		
+		const std::string handshake =
+			"GET / HTTP/1.1\r\n"
+			"Host: localhost\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+			"Sec-WebSocket-Version: 13\r\n"
+			"\r\n";
+		
+		for(int variant = 0; variant < 4; ++variant){
+			bool secure = (variant & 1) != 0;
+			bool allocated = (variant & 2) != 0;
+			
+			// The same echo, through AllocateMessage instead of Send
+			if(allocated){
+				server.SetClientDataCallback([](ws28::Client *client, char *data, size_t len, int opcode){
+					memcpy(client->AllocateMessage(len), data, len);
+					client->SendAllocated(opcode);
+				});
+			}
+			
+			for(size_t len : { (size_t) 16, (size_t) 1024, (size_t) 16384 }){
+				std::string name = std::string(allocated ? "server_echo_allocated/" : "server_echo/") + (secure ? "tls/" : "plain/") + std::to_string(len);
+				if(!IsSelected(name)) continue;
+				
+				ws28::MemoryTransport transport;
+				if(server.AddClient(&transport) == nullptr) break;
+				
+				std::vector<char> frame(ws28::detail::GetDataFrameHeaderSize(len, true) + len, 'x');
+				const char maskKey[4] = { 1, 2, 3, 4 };
+				ws28::detail::WriteDataFrameHeader(2, len, frame.data(), maskKey);
+				
+				if(!secure){
+					transport.Push(handshake.data(), handshake.size());
+					transport.GetOutput().clear();
+					
+					Bench(name, len, [&](){
+						transport.Push(frame.data(), frame.size());
+						g_Sink += transport.GetOutput().size();
+						transport.GetOutput().clear();
+					});
+				}else{
+					ws28::TLS client{clientCtx, false, "localhost"};
+					client.Write(handshake.data(), handshake.size());
+					
+					std::vector<char> ignored;
+					for(int i = 0; i < 16 && !client.IsHandshakeFinished(); ++i){
+						client.ForEachPendingWrite([&](const char *data, size_t len){
+							transport.Push(data, len);
+						});
+						
+						auto &output = transport.GetOutput();
+						client.ReceivedData(output.data(), output.size(), ignored);
+						output.clear();
+					}
+					
+					// Like tls_decrypt, records can't be replayed, so we go through a fixed amount of them
+					std::vector<char> ciphertext;
+					std::vector<std::pair<size_t, size_t>> records;
+					client.ForEachPendingWrite([&](const char *data, size_t len){
+						ciphertext.insert(ciphertext.end(), data, data + len);
+					});
+					records.emplace_back(0, ciphertext.size());
+					
+					for(size_t i = 0; i < std::min((size_t) 200000, (64 * 1024 * 1024) / len); ++i){
+						size_t start = ciphertext.size();
+						client.Write(frame.data(), frame.size());
+						client.ForEachPendingWrite([&](const char *data, size_t len){
+							ciphertext.insert(ciphertext.end(), data, data + len);
+						});
+						records.emplace_back(start, ciphertext.size() - start);
+					}
+					
+					// The first record finishes the handshake
+					transport.Push(ciphertext.data() + records[0].first, records[0].second);
+					transport.GetOutput().clear();
+					
+					BenchFixed(name, len, records.size() - 1, [&](uint64_t i){
+						auto &p = records[i + 1];
+						transport.Push(ciphertext.data() + p.first, p.second);
+						g_Sink += transport.GetOutput().size();
+						transport.GetOutput().clear();
+					});
+				}
+				
+				server.DestroyClients();
+				transport.RunCallbacks();
+			}
+		}
+		
+		SSL_CTX_free(serverCtx);
+		SSL_CTX_free(clientCtx);
+	}
+	
+	void BenchPublish(){
+		const size_t NUM_SUBSCRIBERS = 1000;
+		
+		std::string name = "publish/" + std::to_string(NUM_SUBSCRIBERS) + "/64";
+		if(!IsSelected(name)) return;
+		
+		ws28::Server server{uv_default_loop()};
+		
+		const std::string handshake =
+			"GET / HTTP/1.1\r\n"
+			"Host: localhost\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+			"Sec-WebSocket-Version: 13\r\n"
+			"\r\n";
+		
+		std::vector<std::unique_ptr<ws28::MemoryTransport>> transports;
+		for(size_t i = 0; i < NUM_SUBSCRIBERS; ++i){
+			transports.emplace_back(new ws28::MemoryTransport());
+			auto client = server.AddClient(transports.back().get());
+			if(client == nullptr) return;
+			
+			transports.back()->Push(handshake.data(), handshake.size());
+			server.Subscribe(client, "bench");
+		}
+		
+		std::vector<char> msg(64, 'x');
+		
+		// Bytes are per subscriber
+		Bench(name, msg.size(), [&](){
+			server.Publish("bench", msg.data(), msg.size());
+			for(auto &t : transports) t->GetOutput().clear();
+		});
+		
+		server.DestroyClients();
+		for(auto &t : transports) t->RunCallbacks();
+	}
+	
+	bool BenchReplay(const char *path){
+		ws28::Server server{uv_default_loop()};
+		server.SetClientDataCallback([](ws28::Client *client, char *data, size_t len, int opcode){
+			client->Send(data, len, opcode);
+		});
+		
+		ws28::CaptureReplay replay{&server};
+		if(!replay.Open(path)){
+			fprintf(stderr, "Couldn't open capture %s\n", path);
+			return false;
+		}
+		
+		auto start = Clock::now();
+		bool ok = replay.RunAll();
+		double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+		
+		if(!ok) fprintf(stderr, "Capture is malformed, stopped early\n");
+		
+		Report("replay/connections=" + std::to_string(replay.GetConnections()), replay.GetBytes(), 1, elapsed);
+		return ok;
+	}
+}
+
+int main(int argc, char **argv){
+	if(argc > 2 && strcmp(argv[1], "--replay") == 0) return BenchReplay(argv[2]) ? 0 : 1;
+	if(argc > 1) g_Filter = argv[1];
+	
+	BenchFrames();
+	BenchUTF8();
+	BenchHandshake();
+	BenchTLS();
+	BenchServer();
+	BenchPublish();
+	
+	return 0;
+}
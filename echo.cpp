@@ -21,6 +21,8 @@ int main(){
 	// Use the default settings. These are just here to pass tests
 	s.SetMaxMessageSize(256 * 1024 * 1024); // 256 MB
 	
+	s.SetMetricsPath("/metrics");
+	
 	
 	s.SetClientConnectedCallback([](ws28::Client *client, ws28::HTTPRequest &){
 		client->SetUserData((void*) ++userID);
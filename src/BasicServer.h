@@ -0,0 +1,151 @@
+#ifndef H_9C41D07B2E6F4A8B93A5E17C0B6D2F48
+#define H_9C41D07B2E6F4A8B93A5E17C0B6D2F48
+
+#include <type_traits>
+
+#include "Server.h"
+#include "ClientFrames.h"
+
+namespace ws28 {
+	namespace detail {
+		template<typename H, template<typename> class Op, typename = void>
+		struct HandlerHas : std::false_type {};
+		
+		template<typename H, template<typename> class Op>
+		struct HandlerHas<H, Op, std::void_t<Op<H>>> : std::true_type {};
+		
+		template<typename H> using CheckTCPConnectionOp = decltype(&H::CheckTCPConnection);
+		template<typename H> using CheckConnectionOp = decltype(&H::CheckConnection);
+		template<typename H> using CheckAlternativeConnectionOp = decltype(&H::CheckAlternativeConnection);
+		template<typename H> using ClientConnectedOp = decltype(&H::ClientConnected);
+		template<typename H> using ClientDisconnectedOp = decltype(&H::ClientDisconnected);
+		template<typename H> using ClientDataOp = decltype(&H::ClientData);
+		template<typename H> using ClientDataBatchOp = decltype(&H::ClientDataBatch);
+		template<typename H> using HTTPOp = decltype(&H::HTTP);
+		template<typename H> using HTTPBodyStartOp = decltype(&H::HTTPBodyStart);
+		template<typename H> using HTTPBodyDataOp = decltype(&H::HTTPBodyData);
+		template<typename H> using ConnectFailedOp = decltype(&H::ConnectFailed);
+	}
+	
+	// Compile time options for BasicServer, handlers inherit from this and override what they need
+	struct DefaultServerPolicy {
+		static constexpr bool Secure = false;              // Takes a SSL_CTX and accepts TLS connections too (only picks the constructor)
+		static constexpr bool AlternativeProtocol = false; // See Server::SetAllowAlternativeProtocol
+	};
+	
+	// A Server whose callbacks are member functions of a Handler it holds, named like their setters:
+	//
+	//   struct Echo : ws28::DefaultServerPolicy {
+	//       void ClientData(ws28::Client *client, char *data, size_t len, int opcode){ client->Send(data, len, opcode); }
+	//   };
+	//
+	//   ws28::BasicServer<Echo> server{loop};
+	//
+	// Only the callbacks Handler has are set, the rest keep the Server defaults. A callback with the wrong signature
+	// fails to compile here instead of being set at runtime. Frames are parsed by code instantiated for Handler, so
+	// ClientData is called directly (and can be inlined) instead of through a pointer for every message, and the
+	// alternative protocol isn't even compiled in unless the policy asks for it.
+	//
+	// CheckTCPConnection and ClientDisconnected have to be static: the first doesn't get a client or request to find
+	// the server from, and clients outlive the server (ClientDisconnected can be called after it's gone).
+	// Everything else is the same as Server, including the setters, except ClientData and ClientDataBatch which
+	// are picked at compile time and can't be changed, and SetAllowAlternativeProtocol which needs the policy
+	// (through a Server pointer, alternative protocol clients are still refused without it)
+	template<typename Handler>
+	class BasicServer : public Server {
+		template<template<typename> class Op> static constexpr bool Has = detail::HandlerHas<Handler, Op>::value;
+	public:
+		template<typename H = Handler, std::enable_if_t<!H::Secure, int> = 0>
+		explicit BasicServer(uv_loop_t *loop) : Server(loop){ Init(); }
+		
+		template<typename H = Handler, std::enable_if_t<H::Secure, int> = 0>
+		BasicServer(uv_loop_t *loop, SSL_CTX *ctx) : Server(loop, ctx){ Init(); }
+		
+		// Clients go before the handler does, Server would only get to them after
+		~BasicServer(){
+			StopListening();
+			DestroyClients();
+		}
+		
+		// The parser doesn't know the alternative protocol at all without the policy
+		void SetAllowAlternativeProtocol(bool v){
+			static_assert(Handler::AlternativeProtocol, "The alternative protocol needs the AlternativeProtocol policy");
+			Server::SetAllowAlternativeProtocol(v);
+		}
+		
+		inline Handler& GetHandler(){ return m_Handler; }
+		inline const Handler& GetHandler() const { return m_Handler; }
+	
+	private:
+		struct Dispatch {
+			static constexpr bool AlternativeProtocol = Handler::AlternativeProtocol;
+			
+			static constexpr bool WantsBatch(Server*){ return Has<detail::ClientDataBatchOp>; }
+			static void ClientData(Server *server, Client *client, char *data, size_t len, int opcode){
+				if constexpr(Has<detail::ClientDataOp>){
+					if(server->GetRecordLatencies()){
+						uint64_t start = uv_hrtime();
+						HandlerOf(server).ClientData(client, data, len, opcode);
+						Metrics::Local().Record(metrics::DataCallbackLatency, uv_hrtime() - start);
+					}else{
+						HandlerOf(server).ClientData(client, data, len, opcode);
+					}
+				}
+			}
+		};
+		
+		static Handler& HandlerOf(Server *server){ return static_cast<BasicServer*>(server)->m_Handler; }
+		
+		void Init(){
+			m_fnParseFrames = &Client::ParseFramesWith<Dispatch>;
+			m_bCanParseAlternativeProtocol = Dispatch::AlternativeProtocol;
+			
+			if constexpr(Has<detail::CheckTCPConnectionOp>){
+				static_assert(!std::is_member_function_pointer_v<detail::CheckTCPConnectionOp<Handler>>, "CheckTCPConnection has to be static");
+				SetCheckTCPConnectionCallback(&Handler::CheckTCPConnection);
+			}
+			if constexpr(Has<detail::ClientDisconnectedOp>){
+				static_assert(!std::is_member_function_pointer_v<detail::ClientDisconnectedOp<Handler>>, "ClientDisconnected has to be static");
+				SetClientDisconnectedCallback(&Handler::ClientDisconnected);
+			}
+			
+			if constexpr(Has<detail::CheckConnectionOp>){
+				SetCheckConnectionCallback([](Client *client, HTTPRequest &req) -> bool { return HandlerOf(req.server).CheckConnection(client, req); });
+			}
+			if constexpr(Has<detail::ClientConnectedOp>){
+				SetClientConnectedCallback([](Client *client, HTTPRequest &req){ HandlerOf(req.server).ClientConnected(client, req); });
+			}
+			if constexpr(Has<detail::ClientDataBatchOp>){
+				SetClientDataBatchCallback([](Client *client, DataMessage *messages, size_t count){ HandlerOf(client->GetServer()).ClientDataBatch(client, messages, count); });
+			}
+			if constexpr(Has<detail::HTTPOp>){
+				SetHTTPCallback([](HTTPRequest &req, HTTPResponse &res){ HandlerOf(req.server).HTTP(req, res); });
+			}
+			if constexpr(Has<detail::ConnectFailedOp>){
+				SetConnectFailedCallback([](Server *server, void *userData){ HandlerOf(server).ConnectFailed(server, userData); });
+			}
+			
+			static_assert(Has<detail::HTTPBodyStartOp> == Has<detail::HTTPBodyDataOp>, "HTTPBodyStart and HTTPBodyData go together");
+			if constexpr(Has<detail::HTTPBodyStartOp>){
+				SetHTTPBodyCallbacks(
+					[](HTTPRequest &req) -> size_t { return HandlerOf(req.server).HTTPBodyStart(req); },
+					[](HTTPRequest &req, const char *data, size_t len){ HandlerOf(req.server).HTTPBodyData(req, data, len); }
+				);
+			}
+			
+			if constexpr(Handler::AlternativeProtocol){
+				SetAllowAlternativeProtocol(true);
+				if constexpr(Has<detail::CheckAlternativeConnectionOp>){
+					SetCheckAlternativeConnectionCallback([](Client *client) -> bool { return HandlerOf(client->GetServer()).CheckAlternativeConnection(client); });
+				}
+			}else{
+				static_assert(!Has<detail::CheckAlternativeConnectionOp>, "CheckAlternativeConnection needs the AlternativeProtocol policy");
+			}
+		}
+		
+		Handler m_Handler;
+	};
+
+}
+
+#endif
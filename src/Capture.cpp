@@ -0,0 +1,291 @@
+#include "Capture.h"
+#include "Server.h"
+#include <cstring>
+#include <string>
+#include <algorithm>
+
+namespace ws28 {
+
+namespace {
+	const char CAPTURE_MAGIC[8] = { 'W', 'S', '2', '8', 'C', 'A', 'P', '1' };
+}
+
+bool CaptureWriter::Open(const char *path){
+	Close();
+	
+	m_pFile = fopen(path, "wb");
+	if(m_pFile == nullptr) return false;
+	
+	// Records are tiny, let stdio batch them
+	setvbuf(m_pFile, nullptr, _IOFBF, 64 * 1024);
+	
+	fwrite(CAPTURE_MAGIC, 1, sizeof(CAPTURE_MAGIC), m_pFile);
+	m_iLastTime = uv_hrtime() / 1000;
+	return true;
+}
+
+void CaptureWriter::Close(){
+	if(m_pFile == nullptr) return;
+	
+	fclose(m_pFile);
+	m_pFile = nullptr;
+}
+
+void CaptureWriter::WriteVarint(uint64_t v){
+	uint8_t buf[10];
+	size_t n = 0;
+	
+	do {
+		uint8_t b = v & 0x7F;
+		v >>= 7;
+		if(v != 0) b |= 0x80;
+		buf[n++] = b;
+	} while(v != 0);
+	
+	fwrite(buf, 1, n, m_pFile);
+}
+
+void CaptureWriter::WriteRecordHeader(detail::CaptureRecordType type, uint32_t id){
+	uint64_t now = uv_hrtime() / 1000;
+	
+	fputc(type, m_pFile);
+	WriteVarint(id);
+	WriteVarint(now - m_iLastTime);
+	
+	m_iLastTime = now;
+}
+
+uint32_t CaptureWriter::RecordOpen(const char *ip){
+	if(m_pFile == nullptr) return 0;
+	
+	uint32_t id = m_iNextID++;
+	if(m_iNextID == 0) m_iNextID = 1;
+	
+	size_t len = strlen(ip);
+	
+	WriteRecordHeader(detail::CaptureOpen, id);
+	WriteVarint(len);
+	fwrite(ip, 1, len, m_pFile);
+	
+	return id;
+}
+
+void CaptureWriter::RecordData(uint32_t id, const char *data, size_t len){
+	if(m_pFile == nullptr || id == 0) return;
+	
+	WriteRecordHeader(detail::CaptureData, id);
+	WriteVarint(len);
+	fwrite(data, 1, len, m_pFile);
+}
+
+void CaptureWriter::RecordClose(uint32_t id){
+	if(m_pFile == nullptr || id == 0) return;
+	
+	WriteRecordHeader(detail::CaptureClose, id);
+}
+
+
+
+CaptureReplay::CaptureReplay(Server *server) : m_pServer(server){
+
+}
+
+CaptureReplay::~CaptureReplay(){
+	Stop();
+	CloseAll();
+}
+
+bool CaptureReplay::Open(const char *path){
+	Stop();
+	CloseAll();
+	
+	m_Data.clear();
+	m_iOffset = 0;
+	m_iCaptureTime = 0;
+	
+	FILE *f = fopen(path, "rb");
+	if(f == nullptr) return false;
+	
+	char buf[64 * 1024];
+	size_t n;
+	while((n = fread(buf, 1, sizeof(buf), f)) > 0){
+		m_Data.insert(m_Data.end(), buf, buf + n);
+	}
+	
+	fclose(f);
+	
+	if(m_Data.size() < sizeof(CAPTURE_MAGIC) || memcmp(m_Data.data(), CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0){
+		m_Data.clear();
+		return false;
+	}
+	
+	m_iOffset = sizeof(CAPTURE_MAGIC);
+	return true;
+}
+
+bool CaptureReplay::ReadVarint(uint64_t &v){
+	v = 0;
+	
+	for(size_t shift = 0; shift < 64; shift += 7){
+		if(m_iOffset >= m_Data.size()) return false;
+		
+		uint8_t b = (uint8_t) m_Data[m_iOffset++];
+		v |= (uint64_t) (b & 0x7F) << shift;
+		if((b & 0x80) == 0) return true;
+	}
+	
+	return false;
+}
+
+bool CaptureReplay::PeekTime(uint64_t &time){
+	size_t offset = m_iOffset;
+	
+	uint64_t id, delta;
+	++m_iOffset; // Type
+	bool ok = ReadVarint(id) && ReadVarint(delta);
+	
+	m_iOffset = offset;
+	if(!ok) return false;
+	
+	time = m_iCaptureTime + delta;
+	return true;
+}
+
+bool CaptureReplay::Step(){
+	uint8_t type = (uint8_t) m_Data[m_iOffset++];
+	
+	uint64_t id, delta;
+	if(!ReadVarint(id) || !ReadVarint(delta)) return false;
+	if(id == 0 || id > UINT32_MAX) return false;
+	
+	m_iCaptureTime += delta;
+	
+	switch(type){
+	case detail::CaptureOpen: {
+		uint64_t len;
+		if(!ReadVarint(len) || len > m_Data.size() - m_iOffset || len >= 64) return false;
+		
+		std::string ip(m_Data.data() + m_iOffset, (size_t) len);
+		m_iOffset += (size_t) len;
+		
+		// An id can't be reused while it's open, so this would be a broken capture
+		if(m_Connections.count((uint32_t) id) != 0) return false;
+		
+		auto transport = std::make_unique<MemoryTransport>(ip.c_str());
+		m_pServer->AddClient(transport.get());
+		m_Connections.emplace((uint32_t) id, std::move(transport));
+		++m_iConnections;
+	break;
+	}
+	
+	case detail::CaptureData: {
+		uint64_t len;
+		if(!ReadVarint(len) || len > m_Data.size() - m_iOffset) return false;
+		
+		const char *data = m_Data.data() + m_iOffset;
+		m_iOffset += (size_t) len;
+		
+		// The server might have destroyed the client already, that's fine
+		auto it = m_Connections.find((uint32_t) id);
+		if(it != m_Connections.end()){
+			it->second->Push(data, (size_t) len);
+			it->second->GetOutput().clear();
+			m_iBytes += len;
+		}
+	break;
+	}
+	
+	case detail::CaptureClose: {
+		auto it = m_Connections.find((uint32_t) id);
+		if(it == m_Connections.end()) break;
+		
+		auto transport = std::move(it->second);
+		m_Connections.erase(it);
+		
+		transport->PushEOF();
+		if(!transport->IsReleased()) m_Closing.push_back(std::move(transport));
+		
+		m_Closing.erase(std::remove_if(m_Closing.begin(), m_Closing.end(), [](const std::unique_ptr<MemoryTransport> &t){
+			return t->IsReleased();
+		}), m_Closing.end());
+	break;
+	}
+	
+	default:
+		return false;
+	}
+	
+	return true;
+}
+
+void CaptureReplay::CloseAll(){
+	// Connections that were still open when the capture ended
+	for(auto &p : m_Connections) p.second->Reset();
+	for(auto &t : m_Closing) t->Reset();
+	
+	m_Connections.clear();
+	m_Closing.clear();
+}
+
+bool CaptureReplay::RunAll(){
+	while(!IsDone()){
+		if(!Step()){
+			m_iOffset = m_Data.size();
+			CloseAll();
+			return false;
+		}
+	}
+	
+	CloseAll();
+	return true;
+}
+
+void CaptureReplay::Start(double speed){
+	if(m_pTimer != nullptr) return;
+	
+	m_flSpeed = speed;
+	m_iStartTime = uv_hrtime();
+	m_iStartCaptureTime = m_iCaptureTime;
+	
+	m_pTimer = new uv_timer_t;
+	uv_timer_init(m_pServer->GetLoop(), m_pTimer);
+	m_pTimer->data = this;
+	uv_timer_start(m_pTimer, OnTimer, 0, 0);
+}
+
+void CaptureReplay::Stop(){
+	if(m_pTimer == nullptr) return;
+	
+	uv_close((uv_handle_t*) m_pTimer, [](uv_handle_t *h){ delete (uv_timer_t*) h; });
+	m_pTimer = nullptr;
+}
+
+void CaptureReplay::OnTimer(uv_timer_t *timer){
+	auto replay = (CaptureReplay*) timer->data;
+	uint64_t elapsed = (uv_hrtime() - replay->m_iStartTime) / 1000;
+	
+	for(size_t steps = 0; !replay->IsDone(); ++steps){
+		if(replay->m_flSpeed > 0){
+			uint64_t time;
+			if(!replay->PeekTime(time)) break;
+			
+			uint64_t due = (uint64_t) ((time - replay->m_iStartCaptureTime) / replay->m_flSpeed);
+			if(due > elapsed){
+				uv_timer_start(timer, OnTimer, (due - elapsed + 999) / 1000, 0);
+				return;
+			}
+		}else if(steps >= 1024){
+			// As fast as possible, but let the loop do other things too
+			uv_timer_start(timer, OnTimer, 0, 0);
+			return;
+		}
+		
+		if(!replay->Step()) break;
+	}
+	
+	replay->m_iOffset = replay->m_Data.size();
+	replay->CloseAll();
+	replay->Stop();
+}
+
+}
@@ -0,0 +1,116 @@
+#ifndef H_20B9E1FD11DB49F38B8A7EC67A1661C0
+#define H_20B9E1FD11DB49F38B8A7EC67A1661C0
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <uv.h>
+
+namespace ws28 {
+	class Server;
+	class MemoryTransport;
+	
+	// Captures are a compact binary log of what clients sent us, after TLS, so production traffic
+	// (fragmentation, message sizes, connection churn) can be replayed offline against a Server.
+	//
+	// The file starts with "WS28CAP1", then has one record after another:
+	//   u8 type, varint connection id, varint microseconds since the previous record, then
+	//   open:  varint ip length, ip
+	//   data:  varint length, bytes
+	//   close: nothing
+	// Varints are LEB128.
+	namespace detail {
+		enum CaptureRecordType : uint8_t {
+			CaptureOpen = 0,
+			CaptureData = 1,
+			CaptureClose = 2,
+		};
+	}
+	
+	// Set it on a Server with Server::SetCapture. Only accepted connections are captured,
+	// and only the ones that arrive while it's set
+	class CaptureWriter {
+	public:
+		CaptureWriter(){}
+		CaptureWriter(const CaptureWriter &other) = delete;
+		CaptureWriter& operator=(const CaptureWriter &other) = delete;
+		~CaptureWriter(){ Close(); }
+		
+		bool Open(const char *path);
+		void Close();
+		
+		inline bool IsOpen() const { return m_pFile != nullptr; }
+	
+	private:
+		// Returns the id of the new connection, 0 if we're not capturing
+		uint32_t RecordOpen(const char *ip);
+		void RecordData(uint32_t id, const char *data, size_t len);
+		void RecordClose(uint32_t id);
+		
+		void WriteRecordHeader(detail::CaptureRecordType type, uint32_t id);
+		void WriteVarint(uint64_t v);
+		
+		FILE *m_pFile = nullptr;
+		uint64_t m_iLastTime = 0;
+		uint32_t m_iNextID = 1;
+		
+		friend class Client;
+		friend class Server;
+	};
+	
+	// Feeds a capture to a server through MemoryTransports, recreating its connections.
+	// Whatever the server answers is thrown away
+	class CaptureReplay {
+	public:
+		CaptureReplay(Server *server);
+		CaptureReplay(const CaptureReplay &other) = delete;
+		CaptureReplay& operator=(const CaptureReplay &other) = delete;
+		~CaptureReplay();
+		
+		// Reads the whole file in memory
+		bool Open(const char *path);
+		
+		// Replays on the server's loop. speed 1 is real time, 2 twice as fast, 0 as fast as the loop goes
+		void Start(double speed = 1.0);
+		void Stop();
+		
+		// Replays everything right now, ignoring timestamps. Returns false if the capture is malformed
+		bool RunAll();
+		
+		inline bool IsDone() const { return m_iOffset >= m_Data.size(); }
+		
+		// Plaintext bytes and connections fed to the server so far
+		inline uint64_t GetBytes() const { return m_iBytes; }
+		inline uint64_t GetConnections() const { return m_iConnections; }
+	
+	private:
+		// Capture time of the record at m_iOffset, without processing it. Returns false if it's malformed
+		bool PeekTime(uint64_t &time);
+		bool Step();
+		bool ReadVarint(uint64_t &v);
+		void CloseAll();
+		static void OnTimer(uv_timer_t *timer);
+		
+		Server *m_pServer;
+		std::vector<char> m_Data;
+		size_t m_iOffset = 0;
+		uint64_t m_iCaptureTime = 0; // Microseconds since the start of the capture, up to the last record we processed
+		
+		std::unordered_map<uint32_t, std::unique_ptr<MemoryTransport>> m_Connections;
+		std::vector<std::unique_ptr<MemoryTransport>> m_Closing; // Got the EOF, but the client isn't reading
+		
+		uv_timer_t *m_pTimer = nullptr;
+		uint64_t m_iStartTime = 0;
+		uint64_t m_iStartCaptureTime = 0;
+		double m_flSpeed = 1.0;
+		
+		uint64_t m_iBytes = 0;
+		uint64_t m_iConnections = 0;
+	};
+
+}
+
+#endif
@@ -5,7 +5,7 @@
 #include <sstream>
 #include <cassert>
 
-#include <openssl/sha.h>
+#include <openssl/rand.h>
 
 namespace ws28 {
 	
@@ -78,6 +78,44 @@ namespace detail {
 		return hasMatch;
 	}
 	
+	// Digits only, we don't want to guess what "12, 12" or "+12" mean
+	bool ParseContentLength(std::string_view v, size_t &out){
+		if(v.empty() || v.size() > 18) return false;
+		
+		out = 0;
+		for(char c : v){
+			if(c < '0' || c > '9') return false;
+			out = out * 10 + (c - '0');
+		}
+		
+		return true;
+	}
+	
+	// The size of a chunk, ignoring extensions after it
+	bool ParseChunkSize(std::string_view line, size_t &out){
+		out = 0;
+		
+		size_t digits = 0;
+		for(; digits < line.size(); ++digits){
+			char c = line[digits];
+			size_t v;
+			
+			if(c >= '0' && c <= '9') v = c - '0';
+			else if(c >= 'a' && c <= 'f') v = c - 'a' + 10;
+			else if(c >= 'A' && c <= 'F') v = c - 'A' + 10;
+			else break;
+			
+			// Nobody sends chunks that large, it would just overflow
+			if(digits == 15) return false;
+			out = out * 16 + v;
+		}
+		
+		if(digits == 0) return false;
+		return digits == line.size() || line[digits] == ';' || line[digits] == ' ' || line[digits] == '\t';
+	}
+	
+	
+	const uint8_t ipv4Prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
 	
 	struct Corker {
 		Client &client;
@@ -87,144 +125,193 @@ namespace detail {
 	};
 }
 
-struct DataFrameHeader {
-	char *data;
-	
-	DataFrameHeader(char *data) : data(data){
-		
-	}
-	
-	void reset(){
-		data[0] = 0;
-		data[1] = 0;
-	}
-
-	void fin(bool v) { data[0] &= ~(1 << 7); data[0] |= v << 7; }
-	void rsv1(bool v) { data[0] &= ~(1 << 6); data[0] |= v << 6; }
-	void rsv2(bool v) { data[0] &= ~(1 << 5); data[0] |= v << 5; }
-	void rsv3(bool v) { data[0] &= ~(1 << 4); data[0] |= v << 4; }
-	void mask(bool v) { data[1] &= ~(1 << 7); data[1] |= v << 7; }
-	void opcode(uint8_t v) {
-		data[0] &= ~0x0F;
-		data[0] |= v & 0x0F;
-	}
-
-	void len(uint8_t v) {
-		data[1] &= ~0x7F;
-		data[1] |= v & 0x7F;
-	}
-
-	bool fin() { return (data[0] >> 7) & 1; }
-	bool rsv1() { return (data[0] >> 6) & 1; }
-	bool rsv2() { return (data[0] >> 5) & 1; }
-	bool rsv3() { return (data[0] >> 4) & 1; }
-	bool mask() { return (data[1] >> 7) & 1; }
+struct Client::OutgoingHandshake {
+	std::string key;
+	std::string path;
+};
 
-	uint8_t opcode() {
-		return data[0] & 0x0F;
-	}
+struct Client::HandshakeJob {
+	uv_work_t work;
+	Client *client;
+	TLS *running; // The client's, or ours if it went away
+	std::unique_ptr<TLS> tls;
+	std::vector<char> input;
+	std::vector<char> output;
+	std::vector<char> held;
+	bool ok = false;
+};
 
-	uint8_t len() {
-		return data[1] & 0x7F;
+struct Client::HTTPBody {
+	enum class State : uint8_t { Data, ChunkSize, ChunkEnd, Trailers };
+	
+	std::unique_ptr<char[]> headerBytes; // What the request points to, the receive buffer moves on without it
+	char ip[IP_STRING_SIZE];
+	RequestHeaders headers;
+	HTTPRequest req;
+	size_t limit = 0;
+	size_t received = 0; // Including the rest of the chunk we're in
+	size_t remaining = 0; // Of the body, or of the chunk we're in
+	bool chunked = false;
+	State state = State::Data;
+	
+	HTTPBody(std::string_view block, const HTTPRequest &from, Client *client) : headerBytes(new char[block.size()]), req{from.server, {}, {}, {}, headers, client}{
+		memcpy(headerBytes.get(), block.data(), block.size());
+		req.ip = client->FormatIP(ip);
+		
+		auto Rebase = [&](std::string_view v){
+			return std::string_view(headerBytes.get() + (v.data() - block.data()), v.size());
+		};
+		
+		req.method = Rebase(from.method);
+		req.path = Rebase(from.path);
+		from.headers.ForEach([&](std::string_view key, std::string_view value){
+			headers.Set(Rebase(key), Rebase(value));
+		});
 	}
 };
 
-Client::Client(Server *server, SocketHandle socket) : m_pServer(server), m_Socket(std::move(socket)){
-	m_Socket->data = this;
+Client::Client(Server *server, TransportHandle transport) : m_pServer(server), m_Transport(std::move(transport)){
+	m_Transport->m_pClient = this;
 	
-	// Default to true since that's what most people want
-	uv_tcp_nodelay(m_Socket.get(), true);
-	uv_tcp_keepalive(m_Socket.get(), true, 10000);
+	Metrics::Local().Add(metrics::Clients);
+	if(server->GetRecordLatencies()) m_iAcceptTime = uv_hrtime();
 	
-	{ // Put IP in m_IP
-		m_IP[0] = '\0';
+	{ // If we don't have one, Server::AddClient will destroy us
 		struct sockaddr_storage addr;
-		int addrLen = sizeof(addr);
-		uv_tcp_getpeername(m_Socket.get(), (sockaddr*) &addr, &addrLen);
-		
-		if(addr.ss_family == AF_INET){
-			int r = uv_ip4_name((sockaddr_in*) &addr, m_IP, sizeof(m_IP));
-			(void) r;
-			assert(r == 0);
-		}else if(addr.ss_family == AF_INET6){
-			int r = uv_ip6_name((sockaddr_in6*) &addr, m_IP, sizeof(m_IP));
-			(void) r;
-			assert(r == 0);
-			
-			// Remove this prefix if it exists, it means that we actually have a ipv4
-			static const char *ipv4Prefix = "::ffff:";
-			if(strncmp(m_IP, ipv4Prefix, strlen(ipv4Prefix)) == 0){
-				memmove(m_IP, m_IP + strlen(ipv4Prefix), strlen(m_IP) - strlen(ipv4Prefix) + 1);
-			}
-		}else{
-			// Server::OnConnection will destroy us
-		}
+		if(!m_Transport->GetPeerAddress(addr)) addr.ss_family = AF_UNSPEC;
+		SetAddress(addr);
 	}
 	
-	uv_read_start((uv_stream_t*) m_Socket.get(), [](uv_handle_t*, size_t suggested_size, uv_buf_t *buf){
-		buf->base = new char[suggested_size];
-		buf->len = suggested_size;
-	}, [](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf){
-		auto client = (Client*) stream->data;
-		
-		if(client != nullptr){
-			if(nread < 0){
-				client->Destroy();
-			}else if(nread > 0){
-				client->OnRawSocketData(buf->base, (size_t) nread);
-			}
-		}
-		
-		if(buf != nullptr) delete[] buf->base;
-	});
+	m_Transport->StartReading();
 }
 
 Client::~Client(){
-	assert(!m_Socket);
+	assert(!m_Transport);
+	
+	// The job's still using our TLS, it gets rid of it once it's done
+	if(m_pHandshakeJob != nullptr){
+		m_pHandshakeJob->client = nullptr;
+		m_pHandshakeJob->tls = std::move(m_pTLS);
+	}
+	
+	// Whatever didn't make it out before the transport went away
+	if(m_iQueuedBytes != 0) Metrics::Local().Sub(metrics::QueuedWriteBytes, m_iQueuedBytes);
 }
 
-void Client::Destroy(){
-	if(!m_Socket) return;
+void Client::Destroy(DestroyReason reason){
+	if(!m_Transport) return;
+	
+	// Whatever we parsed before this still gets delivered
+	FlushDataBatch();
+	if(!m_Transport) return;
+	
+	// The body isn't coming, whoever was collecting it can let go
+	if(m_pHTTPBody != nullptr){
+		auto body = std::move(m_pHTTPBody);
+		m_pServer->m_fnHTTPBodyData(body->req, nullptr, 0);
+		if(!m_Transport) return;
+	}
 	
 	Cork(false);
 	
-	m_Socket->data = nullptr;
+	// Nothing's going to send these
+	if(!m_WaitingMessages.empty()){
+		size_t len = 0;
+		for(auto &msg : m_WaitingMessages) len += msg.len;
+		std::vector<WaitingMessage>().swap(m_WaitingMessages);
+		
+		Metrics::Local().Sub(metrics::QueuedWriteBytes, len);
+		m_iQueuedBytes -= len;
+	}
+	
+	// What's queued has to go out before the shutdown, so it can't wait for the write in flight
+	if(!m_WriteQueue.empty()){
+		WriteChunks(m_WriteQueue, [](void *userData, int status){
+			// Cancelled writes mean the transport is going away, and the client might be gone already
+			if(status == UV_ECANCELED) return;
+			
+			auto client = (Client*) userData;
+			size_t len = 0;
+			for(auto &chunk : client->m_WriteQueue) len += chunk.len;
+			client->m_WriteQueue.clear();
+			
+			Metrics::Local().Sub(metrics::QueuedWriteBytes, len);
+			client->m_iQueuedBytes -= len;
+		});
+	}
+	
+	auto &metrics = Metrics::Local();
+	metrics.Sub(metrics::Clients);
+	metrics.Add(metrics::Destroys + (size_t) reason);
+	
+	m_Transport->m_pClient = nullptr;
+	
+	if(m_pResumeTimer != nullptr){
+		uv_close((uv_handle_t*) m_pResumeTimer, [](uv_handle_t *h){ delete (uv_timer_t*) h; });
+		m_pResumeTimer = nullptr;
+	}
 	
 	auto myself = m_pServer->NotifyClientPreDestroyed(this);
 	
-	struct ShutdownRequest : uv_shutdown_t {
-		SocketHandle socket;
+	// Outgoing connections that never completed the handshake don't get the disconnected callback
+	if(m_bIsOutgoing && !m_bHasCompletedHandshake){
+		m_pServer->NotifyConnectFailed(m_pUserData);
+	}
+	
+	struct ShutdownRequest {
+		TransportHandle transport;
 		std::unique_ptr<Client> client;
 		Server::ClientDisconnectedFn cb;
+		uv_timer_t linger; // Only started if the server has a linger timeout
 	};
 	
 	auto req = new ShutdownRequest();
-	req->socket = std::move(m_Socket);
+	req->transport = std::move(m_Transport);
 	req->client = std::move(myself);
 	req->cb = m_pServer->m_fnClientDisconnected;
 	
+	uint32_t lingerTimeout = m_pServer->m_iLingerTimeout;
+	uv_timer_init(m_pServer->GetLoop(), &req->linger);
+	req->linger.data = req;
+	
+	if(m_iCaptureID != 0 && m_pServer->m_pCapture != nullptr){
+		m_pServer->m_pCapture->RecordClose(m_iCaptureID);
+	}
+	
+	// Nothing reads these anymore, and the pool goes away with the server
+	ReturnBuffer(m_Buffer);
+	ReturnBuffer(m_FrameBuffer);
+	ReturnBuffer(m_OutgoingBatch);
+	m_pServer->m_iBufferedBytes -= m_iBufferedBytes;
+	m_iBufferedBytes = 0;
+	
 	m_pServer = nullptr;
 	
-	static auto cb = [](uv_shutdown_t* reqq, int){
-		auto req = (ShutdownRequest*) reqq;
+	metrics.Add(metrics::ClosingClients);
+	
+	req->transport->Shutdown([](void *userData){
+		auto req = (ShutdownRequest*) userData;
+		Metrics::Local().Sub(metrics::ClosingClients);
 		
 		if(req->cb && req->client->m_bHasCompletedHandshake){
 			req->cb(req->client.get());
 		}
 		
-		delete req;
-	};
+		req->client.reset();
+		req->transport.reset();
+		
+		// The timer is the last thing that needs us
+		uv_close((uv_handle_t*) &req->linger, [](uv_handle_t *h){
+			delete (ShutdownRequest*) h->data;
+		});
+	}, req);
 	
-	if(uv_shutdown(req, (uv_stream_t*) req->socket.get(), cb) != 0){
-		// Shutdown failed, but we have to delay the destruction to the next event loop
-		auto timer = new uv_timer_t;
-		uv_timer_init(req->socket->loop, timer);
-		timer->data = req;
-		uv_timer_start(timer, [](uv_timer_t *timer){
-			auto req = (ShutdownRequest*) timer->data;
-			cb(req, 0);
-			uv_close((uv_handle_t*) timer, [](uv_handle_t *h){ delete (uv_timer_t*) h;});
-		}, 0, 0);
+	// Otherwise a peer that never reads what's left keeps the socket and our writes around forever
+	if(lingerTimeout != 0){
+		uv_timer_start(&req->linger, [](uv_timer_t *timer){
+			Metrics::Local().Add(metrics::LingerTimeouts);
+			((ShutdownRequest*) timer->data)->transport->Abort();
+		}, lingerTimeout, 0);
 	}
 }
 
@@ -232,87 +319,188 @@ void Client::Destroy(){
 
 template<size_t N>
 void Client::WriteRaw(uv_buf_t bufs[N]){
-	if(!m_Socket) return;
+	if(!m_Transport) return;
 	
-	// Try to write without allocating memory first, if that doesn't work, we call WriteRawQueue
-	int written = uv_try_write((uv_stream_t*) m_Socket.get(), bufs, N);
-	if(written == UV_EAGAIN) written = 0;
-		
-	if(written >= 0){
-		size_t totalLength = 0;
+	// Anything new goes behind what's already queued
+	if(m_bWriteInFlight || !m_WriteQueue.empty()) return QueueWrite(bufs, N, 0);
+	
+	// Try to write without allocating memory first, if that doesn't work, we queue the rest
+	int written = m_Transport->TryWrite(bufs, N);
+	if(written == UV_EAGAIN){
+		Metrics::Local().Add(metrics::WriteEAGAIN);
+		written = 0;
+	}
+	
+	if(written < 0){
+		// Write error
+		Destroy(DestroyReason::WriteError);
+		return;
+	}
+	
+	size_t totalLength = 0;
+	for(size_t i = 0; i < N; ++i){
+		totalLength += bufs[i].len;
+	}
+	
+	if((size_t) written == totalLength) return; // Complete write
+	
+	Metrics::Local().Add(metrics::PartialWrites);
+	QueueWrite(bufs, N, (size_t) written);
+}
+
+void Client::QueueWrite(const uv_buf_t *bufs, size_t nbufs, size_t skip){
+	bool wasEmpty = m_WriteQueue.empty();
+	size_t total = 0;
+	
+	for(size_t i = 0; i < nbufs; ++i){
+		const char *data = bufs[i].base;
+		size_t len = bufs[i].len;
 		
-		for(size_t i = 0; i < N; ++i){
-			auto &buf = bufs[i];
-			totalLength += buf.len;
+		if(skip >= len){
+			skip -= len;
+			continue;
 		}
 		
-		size_t skipping = (size_t) written;
-		if(skipping == totalLength) return; // Complete write
-		
-		// Partial write
-		// Copy the remainder into a buffer to send to WriteRawQueue
+		data += skip;
+		len -= skip;
+		skip = 0;
+		total += len;
 		
-		auto cpy = std::make_unique<char[]>(totalLength);
-		size_t offset = 0;
-		
-		for(size_t i = 0; i < N; ++i){
-			auto &buf = bufs[i];
-			if(skipping >= buf.len){
-				skipping -= buf.len;
-				continue;
+		// Small sends fill up the last chunk, so a backed up socket doesn't cost an allocation per send
+		while(len > 0){
+			if(m_WriteQueue.empty() || m_WriteQueue.back().len == m_WriteQueue.back().capacity){
+				OutputChunk chunk;
+				chunk.capacity = std::max(len, (size_t) OUTPUT_CHUNK_SIZE);
+				chunk.data.reset(new char[chunk.capacity]);
+				chunk.len = 0;
+				m_WriteQueue.push_back(std::move(chunk));
 			}
 			
-			memcpy(cpy.get() + offset, buf.base + skipping, buf.len - skipping);
-			offset += buf.len - skipping;
-			skipping = 0;
+			auto &tail = m_WriteQueue.back();
+			size_t n = std::min(len, tail.capacity - tail.len);
+			memcpy(tail.data.get() + tail.len, data, n);
+			tail.len += n;
+			data += n;
+			len -= n;
 		}
-		
-		WriteRawQueue(std::move(cpy), offset);
-	}else{
-		// Write error
-		Destroy();
-		return;
 	}
+	
+	if(total == 0) return;
+	
+	if(wasEmpty && m_pServer != nullptr && m_pServer->GetRecordLatencies()) m_iWriteQueuedAt = uv_hrtime();
+	
+	Metrics::Local().Add(metrics::QueuedWriteBytes, total);
+	m_iQueuedBytes += total;
+	
+	if(!m_bWriteInFlight) FlushWriteQueue();
+	UpdateBufferedBytes();
 }
 
-void Client::WriteRawQueue(std::unique_ptr<char[]> data, size_t len){
-	if(!m_Socket) return;
+bool Client::WriteChunks(std::vector<OutputChunk> &chunks, Transport::WriteCallback cb){
+	// All of them in one write
+	uv_buf_t small[8];
+	std::vector<uv_buf_t> large;
+	uv_buf_t *bufs = small;
 	
-	struct CustomWriteRequest {
-		uv_write_t req;
-		Client *client;
-		std::unique_ptr<char[]> data;
-	};
+	if(chunks.size() > sizeof(small) / sizeof(small[0])){
+		large.resize(chunks.size());
+		bufs = large.data();
+	}
+	
+	for(size_t i = 0; i < chunks.size(); ++i){
+		bufs[i].base = chunks[i].data.get();
+		bufs[i].len = chunks[i].len;
+	}
+	
+	return m_Transport->Write(bufs, (unsigned int) chunks.size(), cb, this);
+}
+
+void Client::FlushWriteQueue(){
+	assert(!m_bWriteInFlight);
+	if(m_WriteQueue.empty() || !m_Transport) return;
+	
+	// Sends that come in while this is in flight start a new queue
+	m_Writing.swap(m_WriteQueue);
+	m_iWritingQueuedAt = m_iWriteQueuedAt;
+	m_iWriteQueuedAt = 0;
 	
-	uv_buf_t buf;
-	buf.base = data.get();
-	buf.len = len;
+	m_bWriteInFlight = true;
+	if(!WriteChunks(m_Writing, [](void *userData, int status){
+		// Cancelled writes mean the transport is going away, and the client might be gone already
+		if(status == UV_ECANCELED) return;
+		((Client*) userData)->OnWriteDone(status);
+	})){
+		m_bWriteInFlight = false;
+		Destroy(DestroyReason::WriteError);
+	}
+}
 
-	auto request = new CustomWriteRequest();
-	request->client = this;
-	request->data = std::move(data);
+void Client::OnWriteDone(int status){
+	m_bWriteInFlight = false;
+	
+	size_t len = 0;
+	for(auto &chunk : m_Writing) len += chunk.len;
+	m_Writing.clear();
+	
+	auto &metrics = Metrics::Local();
+	metrics.Sub(metrics::QueuedWriteBytes, len);
+	m_iQueuedBytes -= len;
+	
+	if(m_iWritingQueuedAt != 0){
+		metrics.Record(metrics::WriteQueueLatency, uv_hrtime() - m_iWritingQueuedAt);
+		m_iWritingQueuedAt = 0;
+	}
 	
-	if(uv_write(&request->req, (uv_stream_t*) m_Socket.get(), &buf, 1, [](uv_write_t* req, int status){
-		auto request = (CustomWriteRequest*) req;
+	if(status < 0) return Destroy(DestroyReason::WriteError);
+	
+	FlushWriteQueue();
+	if(!IsBackedUp()) SendWaitingMessages();
+	
+	UpdateBufferedBytes();
+}
 
-		if(status < 0){
-			request->client->Destroy();
+void Client::SendWaitingMessages(bool all){
+	if(m_WaitingMessages.empty()) return;
+	
+	for(uint8_t lane = 0; lane < (uint8_t) SendLane::Count; ++lane){
+		for(size_t i = 0; i < m_WaitingMessages.size();){
+			if((uint8_t) m_WaitingMessages[i].lane != lane){
+				++i;
+				continue;
+			}
+			
+			// The rest keeps waiting, it's sent once this is written
+			if(!all && IsBackedUp()) return;
+			
+			WaitingMessage msg = std::move(m_WaitingMessages[i]);
+			m_WaitingMessages.erase(m_WaitingMessages.begin() + i);
+			
+			Metrics::Local().Sub(metrics::QueuedWriteBytes, msg.len);
+			m_iQueuedBytes -= msg.len;
+			
+			// This can destroy us
+			Send(msg.data.get(), msg.len, msg.opcode);
+			if(!m_Transport) return;
 		}
-		
-		delete request;
-	}) != 0){
-		delete request;
-		Destroy();
 	}
+	
+	// Backed up clients are the exception, so don't keep the capacity around
+	std::vector<WaitingMessage>().swap(m_WaitingMessages);
 }
 
 template<size_t N>
 void Client::Write(uv_buf_t bufs[N]){
-	if(!m_Socket) return;
+	if(!m_Transport) return;
 	if(IsSecure()){
-		for(size_t i = 0; i < N; ++i){
-			if(!m_pTLS->Write(bufs[i].base, bufs[i].len)) return Destroy();
+		// Only a close before the handshake even finished can get here, and nobody would be able to read it
+		if(m_pHandshakeJob != nullptr) return;
+		
+		// Headers go in the same record as what follows them
+		for(size_t i = 0; i + 1 < N; ++i){
+			m_pTLS->Queue(bufs[i].base, bufs[i].len);
 		}
+		
+		if(!m_pTLS->Write(bufs[N - 1].base, bufs[N - 1].len)) return Destroy(DestroyReason::TLSError);
 		FlushTLS();
 	}else{
 		WriteRaw<N>(bufs);
@@ -330,95 +518,181 @@ void Client::Write(const char *data){
 	Write(data, strlen(data));
 }
 
-void Client::WriteDataFrameHeader(uint8_t opcode, size_t len, char *headerStart){
-	DataFrameHeader header{ headerStart };
-	
-	header.reset();
-	header.fin(true);
-	header.opcode(opcode);
-	header.mask(false);
-	header.rsv1(false);
-	header.rsv2(false);
-	header.rsv3(false);
-	if(len >= 126){
-		if(len > UINT16_MAX){
-			header.len(127);
-			*(uint8_t*)(headerStart + 2) = (len >> 56) & 0xFF;
-			*(uint8_t*)(headerStart + 3) = (len >> 48) & 0xFF;
-			*(uint8_t*)(headerStart + 4) = (len >> 40) & 0xFF;
-			*(uint8_t*)(headerStart + 5) = (len >> 32) & 0xFF;
-			*(uint8_t*)(headerStart + 6) = (len >> 24) & 0xFF;
-			*(uint8_t*)(headerStart + 7) = (len >> 16) & 0xFF;
-			*(uint8_t*)(headerStart + 8) = (len >> 8) & 0xFF;
-			*(uint8_t*)(headerStart + 9) = (len >> 0) & 0xFF;
-		}else{
-			header.len(126);
-			*(uint8_t*)(headerStart + 2) = (len >> 8) & 0xFF;
-			*(uint8_t*)(headerStart + 3) = (len >> 0) & 0xFF;
+void Client::OnRawSocketData(char *data, size_t len){
+	if(len == 0) return;
+	if(!m_Transport) return;
+	
+	if(m_bWaitingForProxyHeader){
+		// It usually comes whole in the first read, otherwise m_Buffer (unused until the handshake) holds it until it's complete
+		if(!m_Buffer.empty()){
+			m_Buffer.insert(m_Buffer.end(), data, data + len);
+			data = m_Buffer.data();
+			len = m_Buffer.size();
 		}
-	}else{
-		header.len(len);
-	}
-}
-
-
-size_t Client::GetDataFrameHeaderSize(size_t len){
-	if(len >= 126){
-		if(len > UINT16_MAX){
-			return 10;
-		}else{
-			return 4;
+		
+		struct sockaddr_storage addr;
+		int size = detail::ParseProxyHeader(data, len, addr);
+		if(size == 0){
+			if(m_Buffer.empty()){
+				TakeBuffer(m_Buffer);
+				m_Buffer.assign(data, data + len);
+			}
+			return;
 		}
-	}else{
-		return 2;
+		
+		if(size < 0 || (addr.ss_family != AF_UNSPEC && !SetRealAddress(addr))){
+			Metrics::Local().Add(metrics::HandshakesRejected);
+			return Destroy(DestroyReason::Rejected);
+		}
+		
+		m_bWaitingForProxyHeader = false;
+		
+		if(!m_Buffer.empty()){
+			// The handshake expects m_Buffer to start empty
+			std::vector<char> rest(m_Buffer.begin() + size, m_Buffer.end());
+			ReturnBuffer(m_Buffer);
+			return OnRawSocketData(rest.data(), rest.size());
+		}
+		
+		data += size;
+		len -= size;
+		if(len == 0) return;
 	}
-}
-
-void Client::OnRawSocketData(char *data, size_t len){
-	if(len == 0) return;
-	if(!m_Socket) return;
 	
 	if(m_bWaitingForFirstPacket){
 		m_bWaitingForFirstPacket = false;
 		
 		assert(!IsSecure());
 		
-		if(m_pServer->GetSSLContext() != nullptr && (data[0] == 0x16 || uint8_t(data[0]) == 0x80)){
-			if(m_pServer->m_fnCheckTCPConnection && !m_pServer->m_fnCheckTCPConnection(GetIP(), true)){
-				return Destroy();
-			}
-			
-			InitSecure();
-		}else{
-			if(m_pServer->m_fnCheckTCPConnection && !m_pServer->m_fnCheckTCPConnection(GetIP(), false)){
-				return Destroy();
+		bool secure = m_pServer->GetSSLContext() != nullptr && (data[0] == 0x16 || uint8_t(data[0]) == 0x80);
+		
+		if(m_pServer->m_fnCheckTCPConnection){
+			char ip[IP_STRING_SIZE];
+			if(!m_pServer->m_fnCheckTCPConnection(FormatIP(ip), secure)){
+				Metrics::Local().Add(metrics::HandshakesRejected);
+				return Destroy(DestroyReason::Rejected);
 			}
 		}
+		
+		if(secure) InitSecure();
 	}
 	
 	if(IsSecure()){
-		if(!m_pTLS->ReceivedData(data, len, [&](char *data, size_t len){
-			OnSocketData(data, len);
-		})){
-			return Destroy();
+		// A read that was already on its way when the job started, it goes to TLS once the job is done
+		if(m_pHandshakeJob != nullptr){
+			m_pHandshakeJob->held.insert(m_pHandshakeJob->held.end(), data, data + len);
+			return;
 		}
 		
-		FlushTLS();
+		bool wasHandshakeFinished = m_pTLS->IsHandshakeFinished();
+		if(!wasHandshakeFinished && !m_bIsOutgoing && m_pServer->m_bAsyncTLSHandshakes){
+			return StartHandshakeJob(data, len);
+		}
+		
+		// Decrypted straight into m_Buffer, after whatever's left from the last read, and parsed from there all at once
+		size_t offset = m_Buffer.size();
+		TakeBuffer(m_Buffer);
+		
+		if(!m_pTLS->ReceivedData(data, len, m_Buffer)){
+			return Destroy(DestroyReason::TLSError);
+		}
+		
+		if(!wasHandshakeFinished && m_pTLS->IsHandshakeFinished()){
+			Metrics::Local().Add(metrics::HandshakesTLS);
+		}
+		
+		OnDecryptedData(offset);
 	}else{
 		OnSocketData(data, len);
 	}
 }
 
-void Client::OnSocketData(char *data, size_t len){
-	if(m_pServer == nullptr) return;
+void Client::OnDecryptedData(size_t offset){
+	if(m_Buffer.size() != offset){
+		if(m_iCaptureID != 0 && m_pServer->m_pCapture != nullptr){
+			m_pServer->m_pCapture->RecordData(m_iCaptureID, m_Buffer.data() + offset, m_Buffer.size() - offset);
+		}
+		
+		// If we stopped reading, it's parsed once we resume
+		if(!m_bReadingPaused) OnSocketData(nullptr, 0);
+	}else if(m_Buffer.empty()){
+		ReturnBuffer(m_Buffer);
+	}
+	
+	if(!m_Transport) return;
+	FlushTLS();
+}
+
+void Client::StartHandshakeJob(const char *data, size_t len){
+	auto job = new HandshakeJob();
+	job->work.data = job;
+	job->client = this;
+	job->running = m_pTLS.get();
+	job->input.assign(data, data + len);
+	
+	m_pHandshakeJob = job;
+	m_Transport->StopReading();
+	Metrics::Local().Add(metrics::TLSHandshakeJobs);
 	
-	// This gives us an extra byte just in case
-	if(m_Buffer.size() + len + 1 >= m_pServer->m_iMaxMessageSize){
-		if(m_bHasCompletedHandshake){
-			Close(1009, "Message too large");
+	uv_queue_work(m_pServer->GetLoop(), &job->work, [](uv_work_t *req){
+		// This is another thread, only the TLS object is ours to touch (and nothing in Metrics::Local)
+		auto job = (HandshakeJob*) req->data;
+		job->ok = job->running->ReceivedData(job->input.data(), job->input.size(), job->output);
+	}, [](uv_work_t *req, int status){
+		auto job = (HandshakeJob*) req->data;
+		Metrics::Local().Sub(metrics::TLSHandshakeJobs);
+		
+		if(job->client == nullptr){
+			delete job;
+			return;
 		}
 		
-		Destroy();
+		job->client->OnHandshakeJobDone(job, status);
+	});
+}
+
+void Client::OnHandshakeJobDone(HandshakeJob *jobPtr, int status){
+	std::unique_ptr<HandshakeJob> job(jobPtr);
+	m_pHandshakeJob = nullptr;
+	
+	if(!m_Transport) return;
+	if(status != 0 || !job->ok) return Destroy(DestroyReason::TLSError);
+	
+	if(m_pTLS->IsHandshakeFinished()){
+		Metrics::Local().Add(metrics::HandshakesTLS);
+	}
+	
+	// The client might have sent its first request right behind the handshake
+	size_t offset = m_Buffer.size();
+	if(!job->output.empty()){
+		TakeBuffer(m_Buffer);
+		m_Buffer.insert(m_Buffer.end(), job->output.begin(), job->output.end());
+	}
+	
+	OnDecryptedData(offset);
+	if(!m_Transport) return;
+	
+	// This can start another job if the handshake isn't done
+	if(!job->held.empty()){
+		OnRawSocketData(job->held.data(), job->held.size());
+		if(!m_Transport) return;
+	}
+	
+	UpdateBufferedBytes();
+	if(m_Transport && m_pHandshakeJob == nullptr && !m_bReadingPaused) m_Transport->StartReading();
+}
+
+void Client::OnSocketData(char *data, size_t len){
+	if(m_pServer == nullptr) return;
+	
+	if(m_iCaptureID != 0 && m_pServer->m_pCapture != nullptr && len != 0){
+		m_pServer->m_pCapture->RecordData(m_iCaptureID, data, len);
+	}
+	
+	// Rate limited clients can have a read in flight when we stop reading, it's parsed once we resume
+	if(m_bReadingPaused){
+		TakeBuffer(m_Buffer);
+		m_Buffer.insert(m_Buffer.end(), data, data + len);
 		return;
 	}
 	
@@ -446,50 +720,106 @@ void Client::OnSocketData(char *data, size_t len){
 	};
 	
 	auto Bail = [&](){
+		FlushDataBatch();
+		
 		// Copy partial HTTP headers to our buffer
 		if(usingLocalBuffer){
 			if(!buffer.empty()){
 				assert(m_Buffer.empty());
+				TakeBuffer(m_Buffer);
 				m_Buffer.insert(m_Buffer.end(), buffer.data(), buffer.data() + buffer.size());
 			}
 		}else{
 			if(buffer.empty()){
-				m_Buffer.clear();
+				ReturnBuffer(m_Buffer);
 			}else if(buffer.size() != m_Buffer.size()){
 				memmove(m_Buffer.data(), buffer.data(), buffer.size());
 				m_Buffer.resize(buffer.size());
 			}
 		}
+		
+		// What's left is part of a single message (or of the HTTP request), so it has to fit in the max message size.
+		// Unless the rate limit stopped us, then it's whole messages waiting for their turn, and we don't read more until
+		// they're parsed. This gives us an extra byte just in case
+		if(m_Transport && !m_bReadingPaused && m_Buffer.size() + 1 >= m_pServer->m_iMaxMessageSize){
+			if(m_bHasCompletedHandshake){
+				Close(1009, "Message too large");
+			}
+			
+			Destroy(DestroyReason::TooLarge);
+		}
 	};
 	
-	if(!m_bHasCompletedHandshake && m_pServer->GetAllowAlternativeProtocol() && buffer[0] == 0x00){
+	if(m_pHTTPBody != nullptr){
+		// Nothing else can come after a body, since we close once it's answered
+		Consume(ProcessHTTPBody(buffer.data(), buffer.size()));
+		if(!m_Transport) return;
+		
+		return Bail();
+	}else if(!m_bHasCompletedHandshake && !m_bIsOutgoing && m_pServer->GetAllowAlternativeProtocol() && (buffer[0] == 0x00 || buffer[0] == 0x01)){
+		// Only clients we accept can pick it, a server we connect to has to answer with a proper 101
+		// v2 is followed by the flags the client wants
+		if(buffer[0] == 0x01 && buffer.size() < 2) return Bail();
+		
 		m_bHasCompletedHandshake = true;
 		m_bUsingAlternativeProtocol = true;
-		Consume(1);
+		
+		if(buffer[0] == 0x01){
+			m_bAlternativeV2 = true;
+			m_iAlternativeFlags = (uint8_t) buffer[1] & m_pServer->m_iAlternativeProtocolFlags;
+			Consume(2);
+		}else{
+			Consume(1);
+		}
 		
 		if(!m_pServer->m_fnCheckAlternativeConnection || m_pServer->m_fnCheckAlternativeConnection(this)){
-			Destroy();
+			Metrics::Local().Add(metrics::HandshakesRejected);
+			Destroy(DestroyReason::Rejected);
 			return;
 		}
 		
+		Metrics::Local().Add(metrics::HandshakesAlternative);
+		
+		// Tells the client we speak v2, and which of its flags we agreed to
+		if(m_bAlternativeV2){
+			char reply[2] = { 0x01, (char) m_iAlternativeFlags };
+			Write(reply, sizeof(reply));
+		}
+		
 		RequestHeaders headers;
+		char ip[IP_STRING_SIZE];
 		HTTPRequest req{
 			m_pServer,
 			"GET",
 			"/",
-			m_IP,
+			FormatIP(ip),
 			headers,
+			this,
 		};
 		
 		m_pServer->NotifyClientInit(this, req);
+	}else if(!m_bHasCompletedHandshake && m_bIsOutgoing){
+		auto endOfHeaders = buffer.find("\r\n\r\n");
+		if(endOfHeaders == std::string_view::npos) return Bail();
+		
+		if(!ProcessHandshakeResponse(buffer.substr(0, endOfHeaders + 4))){
+			Metrics::Local().Add(metrics::HandshakesRejected);
+			Destroy(DestroyReason::Rejected);
+			return;
+		}
+		
+		Consume(endOfHeaders + 4);
+		
+		// The server may send frames right after the response, so we keep going
 	}else if(!m_bHasCompletedHandshake){
 		// HTTP headers not done yet, wait
 		auto endOfHeaders = buffer.find("\r\n\r\n");
 		if(endOfHeaders == std::string_view::npos) return Bail();
 		
 		auto MalformedRequest = [&](){
+			Metrics::Local().Add(metrics::HandshakesRejected);
 			Write("HTTP/1.1 400 Bad Request\r\n\r\n");
-			Destroy();
+			Destroy(DestroyReason::Rejected);
 		};
 		
 		auto headersBuffer = buffer.substr(0, endOfHeaders+4); // Include \r\n\r\n
@@ -525,86 +855,94 @@ void Client::OnSocketData(char *data, size_t len){
 		}
 		
 		RequestHeaders headers;
+		if(!detail::ParseHTTPHeaders(headersBuffer, headers)) return MalformedRequest();
 		
-		for(;;) {
-			auto nextLine = headersBuffer.find("\r\n");
-			
-			// This means that we have finished parsing the headers
-			if(nextLine == 0) {
-				break;
+		// PROXY protocol already told us, and it can't be forged by the client
+		if(!m_pServer->m_RealIPHeader.empty() && !m_pServer->m_bProxyProtocol){
+			if(auto value = headers.Get(m_pServer->m_RealIPHeader)){
+				// Proxies append to X-Forwarded-For, so the last entry is the one ours added
+				auto ip = *value;
+				auto comma = ip.rfind(',');
+				if(comma != std::string_view::npos) ip = ip.substr(comma + 1);
+				while(!ip.empty() && (ip.front() == ' ' || ip.front() == '\t')) ip.remove_prefix(1);
+				while(!ip.empty() && (ip.back() == ' ' || ip.back() == '\t')) ip.remove_suffix(1);
+				
+				struct sockaddr_storage addr;
+				if(detail::ParseIPAddress(ip, addr) && !SetRealAddress(addr)){
+					Metrics::Local().Add(metrics::HandshakesRejected);
+					Destroy(DestroyReason::Rejected);
+					return;
+				}
 			}
-			
-			// This can't happen... right?
-			if(nextLine == std::string_view::npos) return MalformedRequest();
-			
-			auto colonPos = headersBuffer.find(':');
-			if(colonPos == std::string_view::npos || colonPos > nextLine) return MalformedRequest();
-			
-			auto key = headersBuffer.substr(0, colonPos);
-			
-			// Key to lower case
-			std::transform(key.begin(), key.end(), (char*) key.data(), [](char v) -> char {
-				if(v < 0 || v >= 127) return v;
-				return tolower(v);
-			});
-			
-			auto value = headersBuffer.substr(colonPos + 1, nextLine - (colonPos + 1));
-			
-			// Trim spaces
-			while(!key.empty() && key.front() == ' ') key.remove_prefix(1);
-			while(!key.empty() && key.back() == ' ') key.remove_suffix(1);
-			while(!value.empty() && value.front() == ' ') value.remove_prefix(1);
-			while(!value.empty() && value.back() == ' ') value.remove_suffix(1);
-			
-			headers.Set(key, value);
-			
-			headersBuffer = headersBuffer.substr(nextLine+2);
 		}
 		
+		char ip[IP_STRING_SIZE];
 		HTTPRequest req{
 			m_pServer,
 			method,
 			path,
-			m_IP,
+			FormatIP(ip),
 			headers,
+			this,
 		};
 		
-		{
-			if(auto upgrade = headers.Get("upgrade")){
-				if(!detail::equalsi(*upgrade, "websocket")){
-					return MalformedRequest();
-				}
+		if(auto upgrade = headers.Get("upgrade")){
+			if(!detail::equalsi(*upgrade, "websocket")){
+				return MalformedRequest();
+			}
+		}else{
+			bool chunked = false;
+			size_t contentLength = 0;
+			
+			if(auto transferEncoding = headers.Get("transfer-encoding")){
+				// Chunked is all we decode, and having both is how requests get smuggled past proxies
+				if(!detail::equalsi(*transferEncoding, "chunked") || headers.Get("content-length")) return MalformedRequest();
+				chunked = true;
 			}else{
+				bool valid = true;
+				size_t count = 0;
+				headers.ForEachValueOf("content-length", [&](std::string_view v){
+					valid = valid && ++count == 1 && detail::ParseContentLength(v, contentLength);
+				});
 				
-				HTTPResponse res;
-				
-				if(m_pServer->m_fnHTTPRequest) m_pServer->m_fnHTTPRequest(req, res);
-				
-				if(res.statusCode == 0) res.statusCode = 404;
-				if(res.statusCode < 200 || res.statusCode >= 1000) res.statusCode = 500;
-				
-				
-				const char *statusCodeText = "WS28"; // Too lazy to create a table of those
-				
-				std::stringstream ss;
-				ss << "HTTP/1.1 " << res.statusCode << " " << statusCodeText << "\r\n";
-				ss << "Connection: close\r\n";
-				ss << "Content-Length: " << res.body.size() << "\r\n";
-				
-				for(auto &p : res.headers){
-					ss << p.first << ": " << p.second << "\r\n";
-				}
-				
-				ss << "\r\n";
-				
-				ss << res.body;
-				
-				std::string str = ss.str();
-				Write(str.data(), str.size());
-				
-				Destroy();
+				if(!valid) return MalformedRequest();
+			}
+			
+			// Without body callbacks, bodies are ignored like they always were
+			if((!chunked && contentLength == 0) || !m_pServer->m_fnHTTPBodyStart || !m_pServer->m_fnHTTPBodyData){
+				return AnswerHTTPRequest(req);
+			}
+			
+			m_pHTTPBody = std::make_unique<HTTPBody>(buffer.substr(0, endOfHeaders + 4), req, this);
+			Consume(endOfHeaders + 4);
+			
+			auto &body = *m_pHTTPBody;
+			body.limit = m_pServer->m_fnHTTPBodyStart(body.req);
+			if(!m_Transport) return;
+			
+			if(body.limit == 0 || contentLength > body.limit){
+				Write("HTTP/1.1 413 Payload Too Large\r\n\r\n");
+				Destroy(DestroyReason::TooLarge);
 				return;
 			}
+			
+			if(chunked){
+				body.chunked = true;
+				body.state = HTTPBody::State::ChunkSize;
+			}else{
+				body.received = contentLength;
+				body.remaining = contentLength;
+			}
+			
+			// Clients that asked wait for this before sending the body
+			if(auto expect = headers.Get("expect")){
+				if(detail::equalsi(*expect, "100-continue")) Write("HTTP/1.1 100 Continue\r\n\r\n");
+			}
+			
+			Consume(ProcessHTTPBody(buffer.data(), buffer.size()));
+			if(!m_Transport) return;
+			
+			return Bail();
 		}
 		
 		// WebSocket upgrades must be GET
@@ -627,31 +965,15 @@ void Client::OnSocketData(char *data, size_t len){
 		auto websocketKey = headers.Get("sec-websocket-key");
 		if(!websocketKey) return MalformedRequest();
 		
-		std::string securityKey = std::string(*websocketKey);
-		
 		if(m_pServer->m_fnCheckConnection && !m_pServer->m_fnCheckConnection(this, req)){
+			Metrics::Local().Add(metrics::HandshakesRejected);
 			Write("HTTP/1.1 403 Forbidden\r\n\r\n");
-			Destroy();
+			Destroy(DestroyReason::Rejected);
 			return;
 		}
 		
 		
-		securityKey += "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-		unsigned char hash[20];
-#if OPENSSL_VERSION_NUMBER <= 0x030000000L
-		SHA_CTX sha1;
-		SHA1_Init(&sha1);
-		SHA1_Update(&sha1, securityKey.data(), securityKey.size());
-		SHA1_Final(hash, &sha1);
-#else
-		EVP_MD_CTX *sha1 = EVP_MD_CTX_new();
-		EVP_DigestInit_ex(sha1, EVP_sha1(), NULL);
-		EVP_DigestUpdate(sha1, securityKey.data(), securityKey.size());
-		EVP_DigestFinal_ex(sha1, hash, NULL);
-		EVP_MD_CTX_free(sha1);
-#endif
-		
-		auto solvedHash = base64_encode(hash, sizeof(hash));
+		auto solvedHash = detail::ComputeAcceptKey(*websocketKey);
 		
 		char buf[256]; // We can use up to 101 + 27 + 28 + 1 characters, and we round up just because
 		int bufLen = snprintf(buf, sizeof(buf),
@@ -668,126 +990,232 @@ void Client::OnSocketData(char *data, size_t len){
 		assert(bufLen >= 0 && (size_t) bufLen < sizeof(buf));
 		
 		Write(buf, bufLen);
-		if(!m_Socket) return; // if write failed, we're being destroyed
+		if(!m_Transport) return; // if write failed, we're being destroyed
 		
 		m_bHasCompletedHandshake = true;
+		Metrics::Local().Add(metrics::HandshakesWebSocket);
 		
 		m_pServer->NotifyClientInit(this, req);
 		
-		m_Buffer.clear();
+		ReturnBuffer(m_Buffer);
 		
 		return;
 	}
 	
 	detail::Corker corker{*this};
 	
-	for(;;){
-		if(!m_Socket) return; // No need to destroy even
-		
-		if(m_bUsingAlternativeProtocol){
-			if(buffer.size() < 4) return Bail();
-			uint32_t frameLength = ((uint32_t)(uint8_t) buffer[0]) | ((uint32_t)(uint8_t) buffer[1] << 8) | ((uint32_t)(uint8_t) buffer[2] << 16) | ((uint32_t)(uint8_t) buffer[3] << 24);
-			if(frameLength > m_pServer->m_iMaxMessageSize) return Close(1002, "Too large");
-			if(buffer.size() < 4 + frameLength) return Bail();
-			
-			ProcessDataFrame(2, (char*)buffer.data() + 4, frameLength);
-			Consume(4 + frameLength);
-		}else{ // Websockets
-			// Not enough to read the header
-			if(buffer.size() < 2) return Bail();
-			
-			DataFrameHeader header((char*) buffer.data());
-			
-			if(header.rsv1() || header.rsv2() || header.rsv3()) return Close(1002, "Reserved bit used");
-			
-			// Clients MUST mask their headers
-			if(!header.mask()) return Close(1002, "Clients must mask their payload");
-			assert(header.mask());
-			
-			char *curPosition = (char*) buffer.data() + 2;
-
-			size_t frameLength = header.len();
-			if(frameLength == 126){
-				if(buffer.size() < 4) return Bail();
-				frameLength = (*(uint8_t*)(curPosition) << 8) | (*(uint8_t*)(curPosition + 1));
-				curPosition += 2;
-			}else if(frameLength == 127){
-				if(buffer.size() < 10) return Bail();
+	// The rest is frames, parsed by code that knows where messages go (see ClientFrames.h)
+	if(!m_pServer->m_fnParseFrames(this, buffer)) return;
+	
+	Bail();
+}
 
-				frameLength = ((uint64_t)*(uint8_t*)(curPosition) << 56) | ((uint64_t)*(uint8_t*)(curPosition + 1) << 48)
-					| ((uint64_t)*(uint8_t*)(curPosition + 2) << 40) | ((uint64_t)*(uint8_t*)(curPosition + 3) << 32)
-					| (*(uint8_t*)(curPosition + 4) << 24) | (*(uint8_t*)(curPosition + 5) << 16)
-					| (*(uint8_t*)(curPosition + 6) << 8) | (*(uint8_t*)(curPosition + 7) << 0);
 
-				curPosition += 8;
-			}
+void Client::AnswerHTTPRequest(HTTPRequest &req){
+	HTTPResponse res;
+	
+	if(!m_pServer->m_MetricsPath.empty() && req.method == "GET" && req.path == m_pServer->m_MetricsPath){
+		res.header("Content-Type", "text/plain; version=0.0.4");
+		res.send(Metrics::FormatPrometheus());
+	}else if(m_pServer->m_fnHTTPRequest){
+		uint64_t start = m_pServer->GetRecordLatencies() ? uv_hrtime() : 0;
+		m_pServer->m_fnHTTPRequest(req, res);
+		if(start != 0) Metrics::Local().Record(metrics::HTTPCallbackLatency, uv_hrtime() - start);
+	}
+	
+	if(res.statusCode == 0) res.statusCode = 404;
+	if(res.statusCode < 200 || res.statusCode >= 1000) res.statusCode = 500;
+	
+	
+	const char *statusCodeText = "WS28"; // Too lazy to create a table of those
+	
+	std::stringstream ss;
+	ss << "HTTP/1.1 " << res.statusCode << " " << statusCodeText << "\r\n";
+	ss << "Connection: close\r\n";
+	ss << "Content-Length: " << res.body.size() << "\r\n";
+	
+	for(auto &p : res.headers){
+		ss << p.first << ": " << p.second << "\r\n";
+	}
+	
+	ss << "\r\n";
+	
+	ss << res.body;
+	
+	std::string str = ss.str();
+	Write(str.data(), str.size());
+	
+	Destroy(DestroyReason::HTTPRequest);
+}
 
-			auto amountLeft = buffer.size() - (curPosition - buffer.data());
-			const char *maskKey = nullptr;
+size_t Client::ProcessHTTPBody(const char *data, size_t len){
+	auto &body = *m_pHTTPBody;
+	auto fn = m_pServer->m_fnHTTPBodyData;
+	size_t offset = 0;
+	
+	auto Reject = [&](bool tooLarge){
+		if(tooLarge){
+			Write("HTTP/1.1 413 Payload Too Large\r\n\r\n");
+			Destroy(DestroyReason::TooLarge);
+		}else{
+			Write("HTTP/1.1 400 Bad Request\r\n\r\n");
+			Destroy(DestroyReason::Rejected);
+		}
+		
+		return offset;
+	};
+	
+	for(;;){
+		if(body.state == HTTPBody::State::Data){
+			size_t n = std::min(len - offset, body.remaining);
 			
-			{ // Read mask
-				if(amountLeft < 4) return Bail();
-				maskKey = curPosition;
-				curPosition += 4;
-				amountLeft -= 4;
+			if(n != 0){
+				body.remaining -= n;
+				fn(body.req, data + offset, n);
+				offset += n;
+				if(!m_Transport) return offset;
 			}
 			
-			if(frameLength > amountLeft) return Bail();
+			if(body.remaining != 0) return offset;
 			
-			{ // Unmask
-				for(size_t i = 0; i < (frameLength & ~3); i += 4){
-					curPosition[i + 0] ^= maskKey[0];
-					curPosition[i + 1] ^= maskKey[1];
-					curPosition[i + 2] ^= maskKey[2];
-					curPosition[i + 3] ^= maskKey[3];
-				}
-				
-				for(size_t i = frameLength & ~3; i < frameLength; ++i){
-					curPosition[i] ^= maskKey[i % 4];
-				} 
+			if(body.chunked){
+				body.state = HTTPBody::State::ChunkEnd;
+			}else{
+				FinishHTTPBody();
+				return offset;
 			}
+		}
+		
+		// Everything else in a chunked body is a line
+		if(offset == len) return offset;
+		
+		const char *start = data + offset;
+		auto lineEnd = (const char*) memchr(start, '\n', len - offset);
+		if(lineEnd == nullptr) return offset;
+		
+		std::string_view line(start, lineEnd - start);
+		if(line.empty() || line.back() != '\r') return Reject(false);
+		line.remove_suffix(1);
+		
+		offset += (lineEnd - start) + 1;
+		
+		if(body.state == HTTPBody::State::ChunkEnd){
+			if(!line.empty()) return Reject(false);
+			body.state = HTTPBody::State::ChunkSize;
+		}else if(body.state == HTTPBody::State::ChunkSize){
+			size_t size;
+			if(!detail::ParseChunkSize(line, size)) return Reject(false);
 			
-			if(header.opcode() >= 0x08){
-				if(!header.fin()) return Close(1002, "Control op codes can't be fragmented");
-				if(frameLength > 125) return Close(1002, "Control op codes can't be more than 125 bytes");
-				
-				
-				ProcessDataFrame(header.opcode(), curPosition, frameLength);
-			}else if(!IsBuildingFrames() && header.fin()){
-				// Fast path, we received a whole frame and we don't need to combine it with anything
-				ProcessDataFrame(header.opcode(), curPosition, frameLength);
+			if(size == 0){
+				body.state = HTTPBody::State::Trailers;
 			}else{
-				if(IsBuildingFrames()){
-					if(header.opcode() != 0) return Close(1002, "Expected continuation frame");
-				}else{
-					if(header.opcode() == 0) return Close(1002, "Unexpected continuation frame");
-					m_iFrameOpcode = header.opcode();
-				}
-				
-				if(m_FrameBuffer.size() + frameLength >= m_pServer->m_iMaxMessageSize) return Close(1009, "Message too large");
-				
-				m_FrameBuffer.insert(m_FrameBuffer.end(), curPosition, curPosition + frameLength);
-				
-				if(header.fin()){
-					// Assemble frame
-					
-					ProcessDataFrame(m_iFrameOpcode, m_FrameBuffer.data(), m_FrameBuffer.size());
-					
-					m_iFrameOpcode = 0;
-					m_FrameBuffer.clear();
-				}
+				if(size > body.limit - body.received) return Reject(true);
 				
+				body.received += size;
+				body.remaining = size;
+				body.state = HTTPBody::State::Data;
 			}
-			
-			Consume((curPosition - buffer.data()) + frameLength);
+		}else if(line.empty()){
+			// We don't care about trailers, only about where they end
+			FinishHTTPBody();
+			return offset;
 		}
 	}
+}
+
+void Client::FinishHTTPBody(){
+	auto body = std::move(m_pHTTPBody);
+	
+	m_pServer->m_fnHTTPBodyData(body->req, "", 0);
+	if(!m_Transport) return;
+	
+	AnswerHTTPRequest(body->req);
+}
+
+bool Client::TakeRateLimitTokens(size_t len, size_t messages){
+	uint32_t messageRate = m_pServer->m_iClientMessageRate;
+	uint32_t byteRate = m_pServer->m_iClientByteRate;
+	if((messageRate == 0 && byteRate == 0) || m_bIsOutgoing) return true;
+	
+	uint64_t now = uv_now(m_pServer->GetLoop());
+	uint64_t wait = 0;
+	
+	if(messageRate != 0){
+		m_MessageTokens.Refill(now, messageRate);
+		wait = m_MessageTokens.Wait(messageRate, messages);
+	}
+	
+	if(byteRate != 0){
+		m_ByteTokens.Refill(now, byteRate);
+		wait = std::max(wait, m_ByteTokens.Wait(byteRate, len));
+	}
+	
+	if(wait == 0){
+		if(messageRate != 0) m_MessageTokens.Take(messages);
+		if(byteRate != 0) m_ByteTokens.Take(len);
+		return true;
+	}
+	
+	switch(m_pServer->m_ClientRateLimitPolicy){
+	case RateLimitPolicy::Drop:
+		Metrics::Local().Add(metrics::RateLimitDrops);
+	break;
+	
+	case RateLimitPolicy::Delay:
+		Metrics::Local().Add(metrics::RateLimitDelays);
+		PauseReading(wait);
+	break;
+	
+	case RateLimitPolicy::Close:
+		Metrics::Local().Add(metrics::RateLimitCloses);
+	break;
+	}
+	
+	return false;
+}
+
+void Client::PauseReading(uint64_t ms){
+	m_bReadingPaused = true;
+	m_Transport->StopReading();
+	
+	if(m_pResumeTimer == nullptr){
+		m_pResumeTimer = new uv_timer_t;
+		uv_timer_init(m_pServer->GetLoop(), m_pResumeTimer);
+		m_pResumeTimer->data = this;
+	}
+	
+	uv_timer_start(m_pResumeTimer, [](uv_timer_t *timer){
+		((Client*) timer->data)->ResumeReading();
+	}, ms, 0);
+}
+
+void Client::ResumeReading(){
+	m_bReadingPaused = false;
+	
+	// What we have buffered goes first, it might pause us again before we read anything new.
+	// There might be nothing, e.g. the memory budget can pause a TLS client that's only waiting to send its handshake
+	if(!m_Buffer.empty()) OnSocketData(nullptr, 0);
+	UpdateBufferedBytes();
 	
-	// Unreachable
+	// A handshake job starts reading again on its own once it's done
+	if(m_Transport && !m_bReadingPaused && m_pHandshakeJob == nullptr) m_Transport->StartReading();
 }
 
+void Client::FlushDataBatch(){
+	if(m_DataBatch.empty() || m_pServer == nullptr) return;
+	
+	// The callback could make us parse more, so it gets its own vector
+	std::vector<DataMessage> batch;
+	batch.swap(m_DataBatch);
+	
+	m_pServer->NotifyClientDataBatch(this, batch.data(), batch.size());
+	
+	// Keep the capacity around for the next read
+	batch.clear();
+	if(m_DataBatch.empty()) m_DataBatch.swap(batch);
+}
 
-void Client::ProcessDataFrame(uint8_t opcode, char *data, size_t len){
+void Client::ProcessControlFrame(uint8_t opcode, char *data, size_t len){
 	switch(opcode){
 	case 9: // Ping
 		if(m_bIsClosing) return;
@@ -797,9 +1225,17 @@ void Client::ProcessDataFrame(uint8_t opcode, char *data, size_t len){
 	case 10: break; // Pong
 	
 	case 8: // Close
+		FlushDataBatch();
+		if(!m_Transport) return;
+		
 		m_bClientRequestedClose = true;
+		if(len >= 2){
+			uint16_t code = (uint8_t(data[0]) << 8) | uint8_t(data[1]);
+			Metrics::Local().Add(metrics::CloseCodesReceived + metrics::CloseCodeIndex(code));
+		}
+		
 		if(m_bIsClosing){
-			Destroy();
+			Destroy(DestroyReason::Closed);
 		}else{
 			
 			if(len == 1){
@@ -824,7 +1260,7 @@ void Client::ProcessDataFrame(uint8_t opcode, char *data, size_t len){
 					return;
 				}
 				
-				if(len > 2 && !IsValidUTF8(data + 2, len - 2)){
+				if(len > 2 && !detail::IsValidUTF8(data + 2, len - 2)){
 					Close(1002, "Close reason is not UTF-8");
 					return;
 				}
@@ -833,30 +1269,14 @@ void Client::ProcessDataFrame(uint8_t opcode, char *data, size_t len){
 			// Copy close message
 			m_bIsClosing = true;
 			
-			char header[MAX_HEADER_SIZE];
-			WriteDataFrameHeader(8, len, header);
-			
-			uv_buf_t bufs[2];
-			bufs[0].base = header;
-			bufs[0].len = GetDataFrameHeaderSize(len);
-			bufs[1].base = (char*) data;
-			bufs[1].len = len;
-			
-			Write<2>(bufs);
+			Send(data, len, 8);
+			if(len >= 2) Metrics::Local().Add(metrics::CloseCodesSent + metrics::CloseCodeIndex((uint8_t(data[0]) << 8) | uint8_t(data[1])));
 			
 			// We always close the tcp connection on our side, as allowed in 7.1.1
-			Destroy();
+			Destroy(DestroyReason::Closed);
 		}
 	break;
 	
-	case 1: // Text
-	case 2: // Binary
-		if(m_bIsClosing) return;
-		if(opcode == 1 && !IsValidUTF8(data, len)) return Close(1007, "Invalid UTF-8 in text frame");
-		
-		m_pServer->NotifyClientData(this, data, len, opcode);
-	break;
-	
 	default:
 		return Close(1002, "Unknown op code");
 	}
@@ -865,40 +1285,51 @@ void Client::ProcessDataFrame(uint8_t opcode, char *data, size_t len){
 void Client::Close(uint16_t code, const char *reason, size_t reasonLen){
 	if(m_bIsClosing) return;
 	
+	FlushDataBatch();
+	if(m_bIsClosing || !m_Transport) return;
+	
+	// What was sent before closing should still get there, even though the alternative protocol has no close message
+	SendWaitingMessages(true);
+	if(!m_Transport) return;
+	
+	if(!m_OutgoingBatch.empty()) FlushOutgoingBatch();
+	
 	m_bIsClosing = true;
 	
 	if(!m_bUsingAlternativeProtocol){
-		char coded[2];
-		coded[0] = (code >> 8) & 0xFF;
-		coded[1] = (code >> 0) & 0xFF;
+		// Control frames can't be more than 125 bytes, so the reason gets truncated to 123
+		char payload[125];
+		payload[0] = (code >> 8) & 0xFF;
+		payload[1] = (code >> 0) & 0xFF;
 		
 		if(reason == nullptr){
-			Send(coded, sizeof(coded), 8);
+			reasonLen = 0;
 		}else{
 			if(reasonLen == (size_t) -1) reasonLen = strlen(reason);
-			
-			char header[MAX_HEADER_SIZE];
-			WriteDataFrameHeader(8, 2 + reasonLen, header);
-			
-			uv_buf_t bufs[2];
-			bufs[0].base = header;
-			bufs[0].len = GetDataFrameHeaderSize(2 + reasonLen);
-			bufs[1].base = (char*) reason;
-			bufs[1].len = reasonLen;
-			
-			Write<2>(bufs);
+			if(reasonLen > sizeof(payload) - 2) reasonLen = sizeof(payload) - 2;
+			memcpy(payload + 2, reason, reasonLen);
 		}
+		
+		Send(payload, 2 + reasonLen, 8);
+		Metrics::Local().Add(metrics::CloseCodesSent + metrics::CloseCodeIndex(code));
 	}
 	
 	// We always close the tcp connection on our side, as allowed in 7.1.1
-	Destroy();
+	Destroy(DestroyReason::Closed);
 }
 
 
 void Client::Send(const char *data, size_t len, uint8_t opcode){
-	if(!m_Socket) return;
+	if(!m_Transport) return;
+	
+	auto &metrics = Metrics::Local();
 	
 	if(m_bUsingAlternativeProtocol){
+		metrics.Add(metrics::FramesOut + 2);
+		metrics.Add(metrics::BytesOut + 2, len);
+		
+		if(m_bAlternativeV2) return SendAlternativeV2(data, len, opcode);
+		
 		uint32_t len32 = (uint32_t) len;
 		uint8_t header[4];
 		header[0] = (len32 >>  0) & 0xFF;
@@ -914,12 +1345,41 @@ void Client::Send(const char *data, size_t len, uint8_t opcode){
 		
 		Write<2>(bufs);
 	}else{
-		char header[MAX_HEADER_SIZE];
-		WriteDataFrameHeader(opcode, len, header);
+		metrics.Add(metrics::FramesOut + (opcode & 0x0F));
+		metrics.Add(metrics::BytesOut + (opcode & 0x0F), len);
 		
+		char header[MAX_HEADER_SIZE];
 		uv_buf_t bufs[2];
+		
+		if(m_bIsOutgoing){
+			// Clients must mask everything they send. We can't touch the caller's buffer, so mask a copy
+			char maskKey[4];
+			m_pServer->GenerateMaskKey(maskKey);
+			detail::WriteDataFrameHeader(opcode, len, header, maskKey);
+			
+			char stackBuffer[1024];
+			std::unique_ptr<char[]> heapBuffer;
+			char *masked = stackBuffer;
+			if(len > sizeof(stackBuffer)){
+				heapBuffer.reset(new char[len]);
+				masked = heapBuffer.get();
+			}
+			
+			detail::Mask(masked, data, len, maskKey);
+			
+			bufs[0].base = header;
+			bufs[0].len = detail::GetDataFrameHeaderSize(len, true);
+			bufs[1].base = masked;
+			bufs[1].len = len;
+			
+			Write<2>(bufs);
+			return;
+		}
+		
+		detail::WriteDataFrameHeader(opcode, len, header);
+		
 		bufs[0].base = header;
-		bufs[0].len = GetDataFrameHeaderSize(len);
+		bufs[0].len = detail::GetDataFrameHeaderSize(len);
 		bufs[1].base = (char*) data;
 		bufs[1].len = len;
 		
@@ -927,10 +1387,418 @@ void Client::Send(const char *data, size_t len, uint8_t opcode){
 	}
 }
 
+void Client::SendQueued(const char *data, size_t len, uint8_t opcode, SendLane lane, uint32_t conflationKey){
+	if(!m_Transport) return;
+	if(!IsBackedUp() && m_WaitingMessages.empty()) return Send(data, len, opcode);
+	
+	auto &metrics = Metrics::Local();
+	
+	WaitingMessage *msg = nullptr;
+	if(conflationKey != 0){
+		for(auto &waiting : m_WaitingMessages){
+			if(waiting.key == conflationKey){
+				msg = &waiting;
+				break;
+			}
+		}
+	}
+	
+	if(msg != nullptr){
+		// It keeps the old one's place, so the newest state doesn't go to the back
+		metrics.Add(metrics::ConflatedMessages);
+		metrics.Sub(metrics::QueuedWriteBytes, msg->len);
+		m_iQueuedBytes -= msg->len;
+		
+		if(len > msg->len) msg->data.reset(new char[len]);
+	}else{
+		m_WaitingMessages.emplace_back();
+		msg = &m_WaitingMessages.back();
+		msg->data.reset(new char[len]);
+		msg->key = conflationKey;
+	}
+	
+	memcpy(msg->data.get(), data, len);
+	msg->len = len;
+	msg->opcode = opcode;
+	msg->lane = lane;
+	
+	metrics.Add(metrics::QueuedWriteBytes, len);
+	m_iQueuedBytes += len;
+	
+	// Only if the write we were waiting for finished without telling us (e.g. synchronously)
+	if(!IsBackedUp()) SendWaitingMessages();
+	
+	UpdateBufferedBytes();
+}
+
+char* Client::AllocateMessage(size_t len){
+	// The same buffer is reused for every message, so most of them don't allocate
+	if(MESSAGE_HEADROOM + len > m_iAllocatedCapacity){
+		m_iAllocatedCapacity = MESSAGE_HEADROOM + len;
+		m_AllocatedMessage.reset(new char[m_iAllocatedCapacity]);
+	}
+	
+	m_iAllocatedLen = len;
+	m_bHasAllocatedMessage = true;
+	return m_AllocatedMessage.get() + MESSAGE_HEADROOM;
+}
+
+void Client::SendAllocated(uint8_t opcode){
+	assert(m_bHasAllocatedMessage);
+	m_bHasAllocatedMessage = false;
+	
+	// Whatever isn't written right away is copied, so the buffer is free again once we return
+	char *data = m_AllocatedMessage.get() + MESSAGE_HEADROOM;
+	size_t len = m_iAllocatedLen;
+	
+	// Batches copy messages anyway
+	if(!m_Transport || (m_bAlternativeV2 && m_bBatching)){
+		Send(data, len, opcode);
+	}else{
+		SendAllocatedFrame(data, len, opcode);
+	}
+	
+	// Like with pooled buffers, big ones aren't worth keeping around
+	if(m_iAllocatedCapacity > Server::MAX_POOLED_BUFFER_SIZE){
+		m_AllocatedMessage.reset();
+		m_iAllocatedCapacity = 0;
+	}
+}
+
+void Client::SendAllocatedFrame(char *data, size_t len, uint8_t opcode){
+	auto &metrics = Metrics::Local();
+	
+	char header[MESSAGE_HEADROOM];
+	size_t headerLen;
+	
+	if(m_bUsingAlternativeProtocol){
+		metrics.Add(metrics::FramesOut + 2);
+		metrics.Add(metrics::BytesOut + 2, len);
+		
+		if(m_bAlternativeV2){
+			bool hasType = (m_iAlternativeFlags & AlternativeMessageTypes) != 0;
+			headerLen = detail::WriteVarint((uint64_t) (len + (hasType ? 1 : 0)) << 1, header);
+			if(hasType) header[headerLen++] = (char) opcode;
+		}else{
+			uint32_t len32 = (uint32_t) len;
+			header[0] = (len32 >>  0) & 0xFF;
+			header[1] = (len32 >>  8) & 0xFF;
+			header[2] = (len32 >> 16) & 0xFF;
+			header[3] = (len32 >> 24) & 0xFF;
+			headerLen = 4;
+		}
+	}else{
+		metrics.Add(metrics::FramesOut + (opcode & 0x0F));
+		metrics.Add(metrics::BytesOut + (opcode & 0x0F), len);
+		
+		if(m_bIsOutgoing){
+			// The buffer is ours, so unlike Send we can mask in place
+			char maskKey[4];
+			m_pServer->GenerateMaskKey(maskKey);
+			detail::WriteDataFrameHeader(opcode, len, header, maskKey);
+			detail::Mask(data, data, len, maskKey);
+			headerLen = detail::GetDataFrameHeaderSize(len, true);
+		}else{
+			detail::WriteDataFrameHeader(opcode, len, header);
+			headerLen = detail::GetDataFrameHeaderSize(len);
+		}
+	}
+	
+	memcpy(data - headerLen, header, headerLen);
+	
+	uv_buf_t bufs[1];
+	bufs[0].base = data - headerLen;
+	bufs[0].len = headerLen + len;
+	Write<1>(bufs);
+}
+
+void Client::SendAlternativeV2(const char *data, size_t len, uint8_t type){
+	bool hasType = (m_iAlternativeFlags & AlternativeMessageTypes) != 0;
+	size_t size = len + (hasType ? 1 : 0);
+	
+	if(m_bBatching){
+		if(!m_OutgoingBatch.empty() && m_OutgoingBatch.size() + detail::MAX_VARINT_SIZE + size > MAX_BATCH_SIZE) FlushOutgoingBatch();
+		
+		// Big messages aren't worth copying, they go out on their own
+		if(detail::MAX_VARINT_SIZE + size <= MAX_BATCH_SIZE){
+			char header[detail::MAX_VARINT_SIZE];
+			size_t headerLen = detail::WriteVarint(size, header);
+			
+			TakeBuffer(m_OutgoingBatch);
+			m_OutgoingBatch.insert(m_OutgoingBatch.end(), header, header + headerLen);
+			if(hasType) m_OutgoingBatch.push_back((char) type);
+			m_OutgoingBatch.insert(m_OutgoingBatch.end(), data, data + len);
+			return;
+		}
+	}
+	
+	char header[detail::MAX_VARINT_SIZE + 1];
+	size_t headerLen = detail::WriteVarint((uint64_t) size << 1, header);
+	if(hasType) header[headerLen++] = (char) type;
+	
+	uv_buf_t bufs[2];
+	bufs[0].base = header;
+	bufs[0].len = headerLen;
+	bufs[1].base = (char*) data;
+	bufs[1].len = len;
+	
+	Write<2>(bufs);
+}
+
+void Client::FlushOutgoingBatch(){
+	char header[detail::MAX_VARINT_SIZE];
+	size_t headerLen = detail::WriteVarint(((uint64_t) m_OutgoingBatch.size() << 1) | 1, header);
+	
+	uv_buf_t bufs[2];
+	bufs[0].base = header;
+	bufs[0].len = headerLen;
+	bufs[1].base = m_OutgoingBatch.data();
+	bufs[1].len = m_OutgoingBatch.size();
+	
+	Write<2>(bufs);
+	
+	// Keeps the capacity for the next batch
+	m_OutgoingBatch.clear();
+}
+
+void Client::BeginBatch(){
+	if(m_bBatching) return;
+	m_bBatching = true;
+	
+	if(!m_bAlternativeV2) Cork(true);
+}
+
+void Client::EndBatch(){
+	if(!m_bBatching) return;
+	m_bBatching = false;
+	
+	if(m_bAlternativeV2){
+		if(!m_OutgoingBatch.empty()) FlushOutgoingBatch();
+		ReturnBuffer(m_OutgoingBatch);
+	}else{
+		Cork(false);
+	}
+}
+
+void Client::SendEncoded(detail::EncodedFrame &frame){
+	if(!m_Transport || m_bIsClosing) return;
+	
+	// These need their own framing
+	if(m_bUsingAlternativeProtocol || m_bIsOutgoing) return Send(frame.data, frame.len, frame.opcode);
+	
+	auto &metrics = Metrics::Local();
+	metrics.Add(metrics::FramesOut + (frame.opcode & 0x0F));
+	metrics.Add(metrics::BytesOut + (frame.opcode & 0x0F), frame.len);
+	
+	if(IsSecure()){
+		if(frame.contiguous.empty()){
+			frame.contiguous.insert(frame.contiguous.end(), frame.header, frame.header + frame.headerLen);
+			frame.contiguous.insert(frame.contiguous.end(), frame.data, frame.data + frame.len);
+		}
+		
+		Write(frame.contiguous.data(), frame.contiguous.size());
+	}else{
+		uv_buf_t bufs[2];
+		bufs[0].base = frame.header;
+		bufs[0].len = frame.headerLen;
+		bufs[1].base = (char*) frame.data;
+		bufs[1].len = frame.len;
+		
+		WriteRaw<2>(bufs);
+	}
+}
+
+void Client::SetAddress(const struct sockaddr_storage &addr){
+	m_IPString.reset();
+	m_bHasAddress = true;
+	
+	if(addr.ss_family == AF_INET){
+		memcpy(m_Address, detail::ipv4Prefix, sizeof(detail::ipv4Prefix));
+		memcpy(m_Address + 12, &((const struct sockaddr_in*) &addr)->sin_addr, 4);
+	}else if(addr.ss_family == AF_INET6){
+		memcpy(m_Address, &((const struct sockaddr_in6*) &addr)->sin6_addr, 16);
+	}else{
+		m_bHasAddress = false;
+	}
+}
+
+std::string_view Client::FormatIP(char (&out)[IP_STRING_SIZE]) const {
+	if(!m_bHasAddress){
+		out[0] = '\0';
+		return {};
+	}
+	
+	// IPv4-mapped addresses are shown as plain IPv4
+	if(memcmp(m_Address, detail::ipv4Prefix, sizeof(detail::ipv4Prefix)) == 0){
+		uv_inet_ntop(AF_INET, m_Address + 12, out, IP_STRING_SIZE);
+	}else{
+		uv_inet_ntop(AF_INET6, m_Address, out, IP_STRING_SIZE);
+	}
+	
+	return out;
+}
+
+const char* Client::GetIP() const {
+	if(!m_bHasAddress) return "";
+	
+	if(!m_IPString){
+		char ip[IP_STRING_SIZE];
+		size_t len = FormatIP(ip).size();
+		m_IPString.reset(new char[len + 1]);
+		memcpy(m_IPString.get(), ip, len + 1);
+	}
+	
+	return m_IPString.get();
+}
+
+void Client::TakeBuffer(std::vector<char> &buffer){
+	if(buffer.capacity() == 0 && m_pServer != nullptr) m_pServer->TakeBuffer(buffer);
+}
+
+void Client::ReturnBuffer(std::vector<char> &buffer){
+	buffer.clear();
+	if(buffer.capacity() == 0) return;
+	
+	if(m_pServer != nullptr){
+		m_pServer->ReturnBuffer(buffer);
+	}else{
+		std::vector<char>().swap(buffer);
+	}
+}
+
+void Client::UpdateBufferedBytes(){
+	if(m_pServer == nullptr) return;
+	
+	size_t bytes = m_Buffer.capacity() + m_FrameBuffer.capacity() + m_OutgoingBatch.capacity() + m_iAllocatedCapacity + m_iQueuedBytes;
+	if(bytes == m_iBufferedBytes) return;
+	
+	bool grew = bytes > m_iBufferedBytes;
+	m_pServer->m_iBufferedBytes = m_pServer->m_iBufferedBytes - m_iBufferedBytes + bytes;
+	m_iBufferedBytes = bytes;
+	
+	if(!grew || !m_pServer->IsOverMemoryBudget() || !m_Transport) return;
+	
+	// Only the ones above the average, the rest aren't the problem
+	if(m_iBufferedBytes * m_pServer->m_Clients.size() <= m_pServer->m_iBufferedBytes) return;
+	
+	if(m_iQueuedBytes >= m_iBufferedBytes / 2){
+		// It isn't reading what we send, and it won't get better by waiting
+		Metrics::Local().Add(metrics::MemoryBudgetDestroys);
+		Destroy(DestroyReason::Overloaded);
+	}else if(!m_bReadingPaused){
+		Metrics::Local().Add(metrics::MemoryBudgetPauses);
+		PauseReading(MEMORY_PAUSE_MS);
+	}
+}
+
+bool Client::SetRealAddress(const struct sockaddr_storage &addr){
+	SetAddress(addr);
+	
+	// Behind a proxy the limits apply to the address it gives us, see Server::OnAccepted
+	if(m_bCountedIP || (m_pServer->m_iMaxConnectionsPerIP == 0 && m_pServer->m_iMaxConnectionRatePerIP == 0)) return true;
+	
+	detail::IPKey key;
+	if(!detail::IPKey::FromAddress((const struct sockaddr*) &addr, key)) return true;
+	if(!m_pServer->AdmitIP(key)) return false;
+	
+	m_IPKey = key;
+	m_bCountedIP = true;
+	return true;
+}
+
 void Client::InitSecure(){
 	m_pTLS = std::make_unique<TLS>(m_pServer->GetSSLContext());
 }
 
+void Client::StartOutgoingHandshake(const detail::URL &url, SSL_CTX *ctx){
+	m_bIsOutgoing = true;
+	m_bWaitingForFirstPacket = false;
+	
+	if(url.secure){
+		assert(ctx != nullptr);
+		m_pTLS = std::make_unique<TLS>(ctx, false, url.host.c_str());
+	}
+	
+	unsigned char nonce[16];
+	RAND_bytes(nonce, sizeof(nonce));
+	
+	m_pOutgoingHandshake = std::make_unique<OutgoingHandshake>();
+	m_pOutgoingHandshake->key = base64_encode(nonce, sizeof(nonce));
+	m_pOutgoingHandshake->path = url.path;
+	
+	std::stringstream ss;
+	ss << "GET " << url.path << " HTTP/1.1\r\n";
+	
+	ss << "Host: ";
+	if(url.host.find(':') != std::string::npos){
+		ss << "[" << url.host << "]";
+	}else{
+		ss << url.host;
+	}
+	
+	if(url.port != (url.secure ? 443 : 80)) ss << ":" << url.port;
+	ss << "\r\n";
+	
+	ss << "Upgrade: websocket\r\n";
+	ss << "Connection: Upgrade\r\n";
+	ss << "Sec-WebSocket-Key: " << m_pOutgoingHandshake->key << "\r\n";
+	ss << "Sec-WebSocket-Version: 13\r\n";
+	ss << "\r\n";
+	
+	// If this is a secure connection, this stays in the TLS buffer until the handshake is done
+	std::string str = ss.str();
+	Write(str.data(), str.size());
+	
+	if(IsSecure() && m_Transport) FlushTLS();
+}
+
+bool Client::ProcessHandshakeResponse(std::string_view headersBuffer){
+	auto endOfLine = headersBuffer.find("\r\n");
+	assert(endOfLine != std::string_view::npos); // Can't fail, the caller found the end of the headers
+	
+	{ // HTTP/1.1 101 Switching Protocols
+		auto statusLine = headersBuffer.substr(0, endOfLine);
+		if(statusLine.substr(0, 5) != "HTTP/") return false;
+		
+		auto statusStart = statusLine.find(' ');
+		if(statusStart == std::string_view::npos) return false;
+		
+		auto status = statusLine.substr(statusStart + 1, 4);
+		if(status != "101" && status != "101 ") return false;
+	}
+	
+	RequestHeaders headers;
+	if(!detail::ParseHTTPHeaders(headersBuffer.substr(endOfLine + 2), headers)) return false;
+	
+	auto upgrade = headers.Get("upgrade");
+	if(!upgrade || !detail::equalsi(*upgrade, "websocket")) return false;
+	
+	auto connection = headers.Get("connection");
+	if(!connection || !detail::HeaderContains(*connection, "upgrade")) return false;
+	
+	auto accept = headers.Get("sec-websocket-accept");
+	if(!accept || *accept != detail::ComputeAcceptKey(m_pOutgoingHandshake->key)) return false;
+	
+	m_bHasCompletedHandshake = true;
+	Metrics::Local().Add(metrics::HandshakesWebSocket);
+	
+	// The request we report is the one we sent, with the headers the server answered with
+	auto handshake = std::move(m_pOutgoingHandshake);
+	
+	char ip[IP_STRING_SIZE];
+	HTTPRequest req{
+		m_pServer,
+		"GET",
+		handshake->path,
+		FormatIP(ip),
+		headers,
+		this,
+	};
+	
+	m_pServer->NotifyClientInit(this, req);
+	return true;
+}
+
 void Client::FlushTLS(){
 	assert(m_pTLS != nullptr);
 	m_pTLS->ForEachPendingWrite([&](const char *data, size_t len){
@@ -942,29 +1810,9 @@ void Client::FlushTLS(){
 }
 
 void Client::Cork(bool v){
-	if(!m_Socket) return;
-	
-#if defined(TCP_CORK) || defined(TCP_NOPUSH)
-	
-	int enable = v;
-	uv_os_fd_t fd;
-	uv_fileno((uv_handle_t*) m_Socket.get(), &fd);
-	
-	// Shamelessly copied from uWebSockets
-#if defined(TCP_CORK)
-	// Linux
-	setsockopt(fd, IPPROTO_TCP, TCP_CORK, &enable, sizeof(int));
-#elif defined(TCP_NOPUSH)
-	// Mac OS X & FreeBSD
-	setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, &enable, sizeof(int));
-	
-	// MacOS needs this to flush the messages out
-	if(!enable){
-		::send(fd, "", 0, 0);
-	}
-#endif
+	if(!m_Transport) return;
 	
-#endif
+	m_Transport->Cork(v);
 }
 
 
@@ -9,43 +9,150 @@
 
 #include "Headers.h"
 #include "TLS.h"
+#include "Metrics.h"
+#include "Protocol.h"
+#include "Transport.h"
+#include "PubSub.h"
+#include "IPTable.h"
 
 namespace ws28 {
 	namespace detail {
 		struct Corker;
-		struct SocketDeleter {
-			void operator()(uv_tcp_t *socket) const {
-				if(socket == nullptr) return;
-				uv_close((uv_handle_t*) socket, [](uv_handle_t *h){
-					delete (uv_tcp_t*) h;
-				});
+		
+		// Tokens are kept in thousandths, so refilling is a multiply by the per second rate for every millisecond.
+		// Buckets hold up to a second's worth, and start full
+		struct TokenBucket {
+			uint64_t tokens = UINT64_MAX;
+			uint64_t lastRefill = 0;
+			
+			inline void Refill(uint64_t now, uint32_t rate){
+				uint64_t capacity = (uint64_t) rate * 1000;
+				uint64_t elapsed = now - lastRefill;
+				lastRefill = now;
+				
+				if(tokens >= capacity || elapsed >= 1000){
+					tokens = capacity;
+				}else{
+					tokens = std::min(capacity, tokens + elapsed * rate);
+				}
+			}
+			
+			// Milliseconds until we can take cost, 0 if we can now.
+			// Anything bigger than the capacity only needs a full bucket, otherwise it'd never go through
+			inline uint64_t Wait(uint32_t rate, uint64_t cost) const {
+				cost = std::min(cost * 1000, (uint64_t) rate * 1000);
+				if(tokens >= cost) return 0;
+				return (cost - tokens + rate - 1) / rate;
+			}
+			
+			inline void Take(uint64_t cost){
+				cost *= 1000;
+				tokens = tokens > cost ? tokens - cost : 0;
 			}
 		};
 	}
 	
-	typedef std::unique_ptr<uv_tcp_t, detail::SocketDeleter> SocketHandle;
+	// One message of a batch, see Server::SetClientDataBatchCallback
+	struct DataMessage {
+		int opcode;
+		char *data;
+		size_t len;
+	};
+	
+	// What happens to messages over a client's rate limit, see Server::SetClientRateLimit
+	enum class RateLimitPolicy : uint8_t {
+		Drop,  // They're thrown away
+		Delay, // We stop reading until the client has enough tokens, so TCP pushes back on it
+		Close, // The client is closed with 1008 (policy violation)
+	};
+	
+	// Lanes for Client::SendQueued. While a client is backed up, its messages wait in their lane, and higher lanes go out first
+	enum class SendLane : uint8_t {
+		High,   // Small and urgent, like input acks
+		Normal,
+		Bulk,   // Big or frequent, like world snapshots (usually with a conflation key)
+		
+		Count
+	};
+	
+	// Second byte of an alternative protocol v2 handshake, see Server::SetAllowAlternativeProtocol
+	enum AlternativeProtocolFlags : uint8_t {
+		AlternativeMessageTypes = 1, // Every message starts with a type byte, which callbacks and Send take as the opcode
+	};
 	
 	class Server;
+	struct HTTPRequest;
+	template<typename Handler> class BasicServer;
 	class Client {
-		enum { MAX_HEADER_SIZE = 10 };
+		enum { MAX_HEADER_SIZE = 14 };
+		enum { MAX_BATCH_SIZE = 64 * 1024 }; // Outgoing batches are sent once they get this big
+		enum { MEMORY_PAUSE_MS = 100 }; // How long we stop reading from a client when we're over the memory budget
 		enum : unsigned char { NO_FRAMES = 0 };
+		enum { OUTPUT_CHUNK_SIZE = 16 * 1024 };
+		enum { MESSAGE_HEADROOM = MAX_HEADER_SIZE }; // Fits any of our headers, see AllocateMessage
+		enum { IP_STRING_SIZE = 46 }; // Longest IPv6 address, with the null
+		
+		// Part of what we're writing, see QueueWrite
+		struct OutputChunk {
+			std::unique_ptr<char[]> data;
+			size_t len;
+			size_t capacity;
+		};
+		
+		// See SendQueued
+		struct WaitingMessage {
+			std::unique_ptr<char[]> data;
+			size_t len;
+			uint32_t key;
+			uint8_t opcode;
+			SendLane lane;
+		};
 	public:
 		~Client();
 		
 		// If reasonLen is -1, it'll use strlen
 		void Close(uint16_t code, const char *reason = nullptr, size_t reasonLen = -1);
-		void Destroy();
+		void Destroy(){ Destroy(DestroyReason::User); }
 		void Send(const char *data, size_t len, uint8_t opCode = 2);
 		
+		// Room for a len byte message, with space for its header in front. Fill it in and call SendAllocated
+		// before anything else that sends. It's written as a single buffer: one write, and one TLS record on secure clients.
+		// The buffer is reused for the next message, so it's only yours until SendAllocated
+		char* AllocateMessage(size_t len);
+		void SendAllocated(uint8_t opCode = 2);
+		
+		// Like Send, but if the client is backed up (the socket didn't take everything we sent it), the message waits here
+		// instead of being framed behind what's queued. Once the socket catches up, waiting messages go out from the highest lane down,
+		// in the order they were sent within a lane. A message with a conflationKey (other than 0) replaces the waiting one with
+		// the same key, so a lagging client only gets the newest. Messages sent with Send don't wait, so they go out first.
+		// Close sends what's waiting before the close frame, Destroy throws it away. See also Server::SetNotSentLowWatermark
+		void SendQueued(const char *data, size_t len, uint8_t opCode = 2, SendLane lane = SendLane::Normal, uint32_t conflationKey = 0);
+		inline size_t GetWaitingMessages() const { return m_WaitingMessages.size(); }
+		
 		inline void SetUserData(void *v){ m_pUserData = v; }
 		inline void* GetUserData(){ return m_pUserData; }
 		
+		// Messages sent until EndBatch go out together. Alternative protocol v2 clients get them in a single batch,
+		// everyone else gets them in as few packets as we can (TCP_CORK)
+		void BeginBatch();
+		void EndBatch();
+		
 		inline bool IsSecure(){ return m_pTLS != nullptr; }
 		inline bool IsUsingAlternativeProtocol(){ return m_bUsingAlternativeProtocol; }
 		
+		// 1 or 2, 0 if the client isn't using the alternative protocol
+		inline int GetAlternativeProtocolVersion() const { return !m_bUsingAlternativeProtocol ? 0 : m_bAlternativeV2 ? 2 : 1; }
+		
+		// What we agreed on in the v2 handshake, see AlternativeProtocolFlags
+		inline uint8_t GetAlternativeProtocolFlags() const { return m_iAlternativeFlags; }
+		
+		// Whether we opened this connection with Server::Connect
+		inline bool IsOutgoing() const { return m_bIsOutgoing; }
+		
 		inline Server* GetServer(){ return m_pServer; }
 		
-		inline const char* GetIP() const { return m_IP; }
+		// Formatted the first time it's asked for (and kept from then on), empty if we don't know it
+		const char* GetIP() const;
 		
 		inline bool HasClientRequestedClose() const { return m_bClientRequestedClose; }
 		
@@ -57,22 +164,80 @@ namespace ws28 {
 			size_t len;
 		};
 		
-		Client(Server *server, SocketHandle socket);
+		Client(Server *server, TransportHandle transport);
 		
 		Client(const Client &other) = delete;
 		Client& operator=(Client &other) = delete;
 		
-		size_t GetDataFrameHeaderSize(size_t len);
-		void WriteDataFrameHeader(uint8_t opcode, size_t len, char *out);
+		void Destroy(DestroyReason reason);
+		
+		struct OutgoingHandshake;
+		
 		void EncryptAndWrite(const char *data, size_t len);
 		
 		void OnRawSocketData(char *data, size_t len);
 		void OnSocketData(char *data, size_t len);
-		void ProcessDataFrame(uint8_t opcode, char *data, size_t len);
+		
+		// The address the proxy says the client has. Returns false if the per IP limits don't let it in
+		bool SetRealAddress(const struct sockaddr_storage &addr);
+		void SetAddress(const struct sockaddr_storage &addr);
+		
+		// Buffers come from the server's pool when they start filling up, and go back once they're empty,
+		// so idle clients don't hold any
+		void TakeBuffer(std::vector<char> &buffer);
+		void ReturnBuffer(std::vector<char> &buffer);
+		
+		// Tells the server how much our buffers and queued writes take now. If that went up while it's over
+		// its memory budget and we hold more than our share, we're paused or destroyed
+		void UpdateBufferedBytes();
+		
+		// Parses the frames in buffer, leaving what's left of a partial one, or returns false if it closed or destroyed us
+		// and the rest doesn't matter. These are templated on how messages get to the application (see ClientFrames.h),
+		// the server's m_fnParseFrames picks the instantiation
+		template<typename Dispatch> bool ParseFrames(std::string_view &buffer);
+		template<typename Dispatch> static bool ParseFramesWith(Client *client, std::string_view &buffer){ return client->ParseFrames<Dispatch>(buffer); }
+		inline bool StopParsing(uint16_t code, const char *reason){ Close(code, reason); return false; }
+		template<typename Dispatch> void ProcessDataFrame(uint8_t opcode, char *data, size_t len);
+		template<typename Dispatch> void ProcessAlternativeMessage(char *data, size_t len);
+		template<typename Dispatch> void DeliverData(int opcode, char *data, size_t len);
+		
+		// Pings, pongs, closes, and op codes we don't know
+		void ProcessControlFrame(uint8_t opcode, char *data, size_t len);
+		
+		// Takes messages totalling len bytes from the rate limit buckets. Returns false if it's over the limit,
+		// in which case the caller applies the server's policy (Delay has already stopped reading)
+		bool TakeRateLimitTokens(size_t len, size_t messages = 1);
+		void PauseReading(uint64_t ms);
+		void ResumeReading();
+		
+		// Hands the messages queued for the batch callback to it. Has to be called before the buffers they point to change
+		void FlushDataBatch();
+		
+		// Plain HTTP requests: answers with the HTTP callback and destroys us
+		void AnswerHTTPRequest(HTTPRequest &req);
+		
+		// Streams the body of a request to the body callbacks (see Server::SetHTTPBodyCallbacks). Returns how much it used
+		struct HTTPBody;
+		size_t ProcessHTTPBody(const char *data, size_t len);
+		void FinishHTTPBody();
+		
+		// Writes our address to out without keeping it, so clients nobody asks about don't pay for the string
+		std::string_view FormatIP(char (&out)[IP_STRING_SIZE]) const;
+		
+		void StartOutgoingHandshake(const detail::URL &url, SSL_CTX *ctx);
+		bool ProcessHandshakeResponse(std::string_view headersBuffer);
 		
 		void InitSecure();
 		void FlushTLS();
 		
+		// What TLS decrypted into m_Buffer past offset gets parsed, and what it wants to send goes out
+		void OnDecryptedData(size_t offset);
+		
+		// Feeds what we read to TLS on the threadpool (see Server::SetAsyncTLSHandshakes), we stop reading until it's done
+		struct HandshakeJob;
+		void StartHandshakeJob(const char *data, size_t len);
+		void OnHandshakeJobDone(HandshakeJob *job, int status);
+		
 		void Write(const char *data);
 		void Write(const char *data, size_t len);
 		
@@ -82,33 +247,89 @@ namespace ws28 {
 		template<size_t N>
 		void WriteRaw(uv_buf_t bufs[N]);
 		
-		void WriteRawQueue(std::unique_ptr<char[]> data, size_t len);
+		// Copies what the socket didn't take (after skipping skip bytes) to the write queue. There's only one write
+		// in flight at a time, with everything that was queued when it started, the rest waits for it to finish
+		void QueueWrite(const uv_buf_t *bufs, size_t nbufs, size_t skip);
+		void FlushWriteQueue();
+		void OnWriteDone(int status);
+		bool WriteChunks(std::vector<OutputChunk> &chunks, Transport::WriteCallback cb);
 		
-		void Cork(bool v);
+		inline bool IsBackedUp() const { return m_bWriteInFlight || !m_WriteQueue.empty(); }
+		
+		// Sends waiting messages until we're backed up again, or all of them
+		void SendWaitingMessages(bool all = false);
 		
-		// Stub, maybe some day
-		inline bool IsValidUTF8(const char *, size_t){ return true; }
+		// Writes the header in front of an allocated message and sends both as one buffer
+		void SendAllocatedFrame(char *data, size_t len, uint8_t opcode);
+		
+		void SendAlternativeV2(const char *data, size_t len, uint8_t type);
+		void FlushOutgoingBatch();
+		
+		// Sends a frame Server::Publish encoded for all subscribers
+		void SendEncoded(detail::EncodedFrame &frame);
+		
+		void Cork(bool v);
 		
 		inline bool IsBuildingFrames(){ return m_iFrameOpcode != NO_FRAMES; }
 		
 		Server *m_pServer;
-		SocketHandle m_Socket;
+		TransportHandle m_Transport;
 		void *m_pUserData = nullptr;
 		bool m_bWaitingForFirstPacket = true;
+		bool m_bWaitingForProxyHeader = false;
 		bool m_bHasCompletedHandshake = false;
 		bool m_bIsClosing = false;
 		bool m_bUsingAlternativeProtocol = false;
+		bool m_bAlternativeV2 = false;
+		uint8_t m_iAlternativeFlags = 0;
+		bool m_bBatching = false;
 		bool m_bClientRequestedClose = false;
-		char m_IP[46];
+		bool m_bIsOutgoing = false;
+		bool m_bCountedIP = false; // Whether m_IPKey counts towards the server's per IP limits
+		bool m_bHasAddress = false;
+		bool m_bReadingPaused = false; // Stopped reading because of the rate limit
+		bool m_bWriteInFlight = false;
+		uint32_t m_iCaptureID = 0; // 0 if we're not being captured
+		uint8_t m_Address[16]; // IPv6, or IPv4-mapped IPv6
+		detail::IPKey m_IPKey;
+		mutable std::unique_ptr<char[]> m_IPString; // Only once someone calls GetIP
+		uint64_t m_iAcceptTime = 0; // Only set if the server records latencies
+		size_t m_iQueuedBytes = 0; // In m_WriteQueue, m_Writing and m_WaitingMessages
+		size_t m_iBufferedBytes = 0; // What we count towards the server's memory budget
+		
+		detail::TokenBucket m_MessageTokens;
+		detail::TokenBucket m_ByteTokens;
+		uv_timer_t *m_pResumeTimer = nullptr; // Created the first time we pause
 		
 		std::unique_ptr<TLS> m_pTLS;
+		HandshakeJob *m_pHandshakeJob = nullptr; // While the threadpool has our TLS, nothing else can touch it
+		std::unique_ptr<OutgoingHandshake> m_pOutgoingHandshake; // Only while an outgoing connection waits for the 101
+		std::unique_ptr<HTTPBody> m_pHTTPBody; // Only while we're streaming a request body
 		
 		std::vector<char> m_Buffer;
 		
 		uint8_t m_iFrameOpcode = NO_FRAMES;
 		std::vector<char> m_FrameBuffer;
 		
+		std::vector<detail::Subscription> m_Subscriptions;
+		
+		std::vector<DataMessage> m_DataBatch; // Only used with the batch callback
+		std::vector<char> m_OutgoingBatch; // Alternative protocol v2 messages between BeginBatch and EndBatch
+		std::unique_ptr<char[]> m_AllocatedMessage; // Kept between messages, unless it got big
+		size_t m_iAllocatedCapacity = 0;
+		size_t m_iAllocatedLen = 0;
+		bool m_bHasAllocatedMessage = false; // Between AllocateMessage and SendAllocated
+		
+		std::vector<OutputChunk> m_WriteQueue; // Waiting for the write in flight
+		std::vector<OutputChunk> m_Writing; // In the write in flight
+		uint64_t m_iWriteQueuedAt = 0; // When m_WriteQueue got its first bytes, if we record latencies
+		uint64_t m_iWritingQueuedAt = 0;
+		
+		std::vector<WaitingMessage> m_WaitingMessages; // See SendQueued
+		
 		friend class Server;
+		template<typename Handler> friend class BasicServer;
+		friend class Transport;
 		friend struct detail::Corker;
 		friend class std::unique_ptr<Client>;
 	};
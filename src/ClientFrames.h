@@ -0,0 +1,222 @@
+#ifndef H_9DCCABDA3BAE4D46BB979AAAABC14200
+#define H_9DCCABDA3BAE4D46BB979AAAABC14200
+
+#include "Server.h"
+
+// Client's frame parsing, templated on how messages get to the application.
+// Server uses FunctionPointerDispatch, BasicServer instantiates it with its handler so the callback is inlined
+namespace ws28 {
+	namespace detail {
+		// A Dispatch says whether the alternative protocol can be used at all (so the parser can drop it),
+		// whether messages are batched, and delivers a single message
+		struct FunctionPointerDispatch {
+			static constexpr bool AlternativeProtocol = true; // Up to Server::SetAllowAlternativeProtocol
+			
+			static bool WantsBatch(Server *server){ return server->m_fnClientDataBatch != nullptr; }
+			static void ClientData(Server *server, Client *client, char *data, size_t len, int opcode){ server->NotifyClientData(client, data, len, opcode); }
+		};
+	}
+	
+	template<typename Dispatch>
+	bool Client::ParseFrames(std::string_view &buffer){
+		auto &metrics = Metrics::Local();
+		
+		for(;;){
+			if(!m_Transport) return false; // No need to destroy even
+			
+			if constexpr(Dispatch::AlternativeProtocol){
+				if(m_bAlternativeV2){
+					// varint (length << 1 | is batch), then a message, or a batch of (varint length, message)
+					uint64_t recordHeader;
+					int headerSize = detail::ReadVarint(buffer.data(), buffer.size(), recordHeader, 5);
+					if(headerSize == 0) return true;
+					if(headerSize < 0) return StopParsing(1002, "Invalid length");
+					
+					uint64_t recordLength = recordHeader >> 1;
+					bool isBatch = (recordHeader & 1) != 0;
+					
+					if(recordLength > m_pServer->m_iMaxMessageSize) return StopParsing(1002, "Too large");
+					if(recordLength > buffer.size() - headerSize) return true;
+					
+					char *record = (char*) buffer.data() + headerSize;
+					
+					// Count the messages first, so the rate limit applies to them and not to the batch
+					size_t count = 1;
+					if(isBatch){
+						count = 0;
+						for(size_t offset = 0; offset < recordLength; ++count){
+							uint64_t messageLength;
+							int n = detail::ReadVarint(record + offset, recordLength - offset, messageLength, 5);
+							if(n <= 0 || messageLength > recordLength - offset - n) return StopParsing(1002, "Invalid batch");
+							offset += n + messageLength;
+						}
+					}
+					
+					if(!TakeRateLimitTokens(recordLength, count)){
+						if(m_pServer->m_ClientRateLimitPolicy == RateLimitPolicy::Delay) return true;
+						if(m_pServer->m_ClientRateLimitPolicy == RateLimitPolicy::Close) return StopParsing(1008, "Rate limit exceeded");
+						
+						buffer.remove_prefix(headerSize + recordLength);
+						continue;
+					}
+					
+					if(isBatch){
+						for(size_t offset = 0; offset < recordLength && m_Transport && !m_bIsClosing;){
+							uint64_t messageLength;
+							int n = detail::ReadVarint(record + offset, recordLength - offset, messageLength, 5);
+							ProcessAlternativeMessage<Dispatch>(record + offset + n, messageLength);
+							offset += n + messageLength;
+						}
+					}else{
+						ProcessAlternativeMessage<Dispatch>(record, recordLength);
+					}
+					
+					buffer.remove_prefix(headerSize + recordLength);
+					continue;
+				}
+				
+				if(m_bUsingAlternativeProtocol){
+					if(buffer.size() < 4) return true;
+					uint32_t frameLength = ((uint32_t)(uint8_t) buffer[0]) | ((uint32_t)(uint8_t) buffer[1] << 8) | ((uint32_t)(uint8_t) buffer[2] << 16) | ((uint32_t)(uint8_t) buffer[3] << 24);
+					if(frameLength > m_pServer->m_iMaxMessageSize) return StopParsing(1002, "Too large");
+					if(buffer.size() < 4 + frameLength) return true;
+					
+					if(!TakeRateLimitTokens(frameLength)){
+						if(m_pServer->m_ClientRateLimitPolicy == RateLimitPolicy::Delay) return true;
+						if(m_pServer->m_ClientRateLimitPolicy == RateLimitPolicy::Close) return StopParsing(1008, "Rate limit exceeded");
+						
+						buffer.remove_prefix(4 + frameLength);
+						continue;
+					}
+					
+					metrics.Add(metrics::FramesIn + 2);
+					metrics.Add(metrics::BytesIn + 2, frameLength);
+					
+					ProcessDataFrame<Dispatch>(2, (char*)buffer.data() + 4, frameLength);
+					buffer.remove_prefix(4 + frameLength);
+					continue;
+				}
+			}
+			
+			// Not enough to read the header
+			if(buffer.size() < 2) return true;
+			
+			detail::DataFrameHeader header((char*) buffer.data());
+			
+			if(header.rsv1() || header.rsv2() || header.rsv3()) return StopParsing(1002, "Reserved bit used");
+			
+			// Clients MUST mask their frames, and servers must not
+			if(header.mask() == m_bIsOutgoing){
+				return StopParsing(1002, m_bIsOutgoing ? "Servers must not mask their payload" : "Clients must mask their payload");
+			}
+			
+			uint64_t frameLength;
+			const char *maskKey;
+			
+			size_t headerSize = detail::ParseDataFrameHeader(buffer.data(), buffer.size(), frameLength, maskKey);
+			if(headerSize == 0) return true;
+			
+			char *curPosition = (char*) buffer.data() + headerSize;
+			if(frameLength > buffer.size() - headerSize) return true;
+			
+			// Messages are limited once we have all of them, but before unmasking, so a delayed frame can be parsed again.
+			// Frames with the wrong opcode are left for the checks below
+			if(header.opcode() < 0x08 && header.fin() && (IsBuildingFrames() ? header.opcode() == 0 : header.opcode() != 0)){
+				if(!TakeRateLimitTokens(IsBuildingFrames() ? m_FrameBuffer.size() + frameLength : frameLength)){
+					if(m_pServer->m_ClientRateLimitPolicy == RateLimitPolicy::Delay) return true;
+					if(m_pServer->m_ClientRateLimitPolicy == RateLimitPolicy::Close) return StopParsing(1008, "Rate limit exceeded");
+					
+					// Dropped, along with the fragments that came before it
+					m_iFrameOpcode = NO_FRAMES;
+					ReturnBuffer(m_FrameBuffer);
+					buffer.remove_prefix(headerSize + frameLength);
+					continue;
+				}
+			}
+			
+			metrics.Add(metrics::FramesIn + header.opcode());
+			metrics.Add(metrics::BytesIn + header.opcode(), frameLength);
+			
+			if(maskKey != nullptr){
+				detail::Mask(curPosition, curPosition, frameLength, maskKey);
+			}
+			
+			if(header.opcode() >= 0x08){
+				if(!header.fin()) return StopParsing(1002, "Control op codes can't be fragmented");
+				if(frameLength > 125) return StopParsing(1002, "Control op codes can't be more than 125 bytes");
+				
+				
+				ProcessControlFrame(header.opcode(), curPosition, frameLength);
+			}else if(!IsBuildingFrames() && header.fin()){
+				// Fast path, we received a whole frame and we don't need to combine it with anything
+				ProcessDataFrame<Dispatch>(header.opcode(), curPosition, frameLength);
+			}else{
+				if(IsBuildingFrames()){
+					if(header.opcode() != 0) return StopParsing(1002, "Expected continuation frame");
+				}else{
+					if(header.opcode() == 0) return StopParsing(1002, "Unexpected continuation frame");
+					m_iFrameOpcode = header.opcode();
+				}
+				
+				if(m_FrameBuffer.size() + frameLength >= m_pServer->m_iMaxMessageSize) return StopParsing(1009, "Message too large");
+				
+				TakeBuffer(m_FrameBuffer);
+				m_FrameBuffer.insert(m_FrameBuffer.end(), curPosition, curPosition + frameLength);
+				
+				if(header.fin()){
+					// Assemble frame
+					
+					ProcessDataFrame<Dispatch>(m_iFrameOpcode, m_FrameBuffer.data(), m_FrameBuffer.size());
+					FlushDataBatch(); // It points into m_FrameBuffer
+					
+					m_iFrameOpcode = 0;
+					ReturnBuffer(m_FrameBuffer);
+				}
+				
+			}
+			
+			buffer.remove_prefix((curPosition - buffer.data()) + frameLength);
+		}
+	}
+	
+	template<typename Dispatch>
+	void Client::ProcessDataFrame(uint8_t opcode, char *data, size_t len){
+		if(opcode != 1 && opcode != 2) return ProcessControlFrame(opcode, data, len);
+		
+		if(m_bIsClosing) return;
+		if(opcode == 1 && !detail::IsValidUTF8(data, len)) return Close(1007, "Invalid UTF-8 in text frame");
+		
+		DeliverData<Dispatch>(opcode, data, len);
+	}
+	
+	template<typename Dispatch>
+	void Client::ProcessAlternativeMessage(char *data, size_t len){
+		if(m_bIsClosing) return;
+		
+		int opcode = 2;
+		if(m_iAlternativeFlags & AlternativeMessageTypes){
+			if(len == 0) return Close(1002, "Missing message type");
+			
+			opcode = (uint8_t) data[0];
+			++data;
+			--len;
+		}
+		
+		auto &metrics = Metrics::Local();
+		metrics.Add(metrics::FramesIn + 2);
+		metrics.Add(metrics::BytesIn + 2, len);
+		
+		DeliverData<Dispatch>(opcode, data, len);
+	}
+	
+	template<typename Dispatch>
+	void Client::DeliverData(int opcode, char *data, size_t len){
+		if(Dispatch::WantsBatch(m_pServer)){
+			m_DataBatch.push_back(DataMessage{opcode, data, len});
+		}else{
+			Dispatch::ClientData(m_pServer, this, data, len, opcode);
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,179 @@
+#include "Handoff.h"
+
+#ifndef _WIN32
+
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace ws28 {
+
+namespace {
+	enum { MAX_FDS = 64 };
+}
+
+bool SendFds(int socket, const int *fds, size_t count){
+	if(count == 0 || count > MAX_FDS) return false;
+	
+	// There has to be at least a byte of real data for the fds to ride along with
+	char byte = 'F';
+	struct iovec iov;
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+		struct cmsghdr align;
+	} control;
+	memset(&control, 0, sizeof(control));
+	
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+	
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+	
+	for(;;){
+		ssize_t r = sendmsg(socket, &msg, 0);
+		if(r == 1) return true;
+		if(r < 0 && errno == EINTR) continue;
+		return false;
+	}
+}
+
+int ReceiveFds(int socket, int *fds, size_t max){
+	char byte;
+	struct iovec iov;
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+		struct cmsghdr align;
+	} control;
+	
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	
+	int flags = 0;
+#ifdef MSG_CMSG_CLOEXEC
+	flags |= MSG_CMSG_CLOEXEC;
+#endif
+	
+	ssize_t r;
+	do {
+		r = recvmsg(socket, &msg, flags);
+	} while(r < 0 && errno == EINTR);
+	
+	if(r != 1) return -1;
+	
+	std::vector<int> received;
+	for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+		
+		size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		size_t offset = received.size();
+		received.resize(offset + n);
+		memcpy(received.data() + offset, CMSG_DATA(cmsg), n * sizeof(int));
+	}
+	
+	// Don't leak what we did get if something's off
+	if((msg.msg_flags & MSG_CTRUNC) || received.empty() || received.size() > max){
+		for(int fd : received) close(fd);
+		return -1;
+	}
+	
+	memcpy(fds, received.data(), received.size() * sizeof(int));
+	return (int) received.size();
+}
+
+int ReceiveListenFds(const char *path, int *fds, size_t max){
+	struct sockaddr_un addr;
+	if(strlen(path) >= sizeof(addr.sun_path)) return -1;
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	
+	int s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(s < 0) return -1;
+	
+	int r = -1;
+	if(connect(s, (struct sockaddr*) &addr, sizeof(addr)) == 0){
+		r = ReceiveFds(s, fds, max);
+	}
+	
+	close(s);
+	return r;
+}
+
+bool HandoffListener::Start(const char *path, std::vector<int> fds, HandedOffFn cb, void *userData){
+	if(m_pPipe != nullptr || fds.empty() || fds.size() > MAX_FDS) return false;
+	
+	m_pPipe = new uv_pipe_t;
+	uv_pipe_init(m_pLoop, m_pPipe, 0);
+	m_pPipe->data = this;
+	
+	unlink(path);
+	
+	if(uv_pipe_bind(m_pPipe, path) != 0 || uv_listen((uv_stream_t*) m_pPipe, 1, [](uv_stream_t *pipe, int status){
+		if(status < 0) return;
+		((HandoffListener*) pipe->data)->OnConnection();
+	}) != 0){
+		Stop();
+		return false;
+	}
+	
+	m_Fds = std::move(fds);
+	m_fnHandedOff = cb;
+	m_pUserData = userData;
+	return true;
+}
+
+void HandoffListener::Stop(){
+	if(m_pPipe == nullptr) return;
+	
+	uv_close((uv_handle_t*) m_pPipe, [](uv_handle_t *h){
+		delete (uv_pipe_t*) h;
+	});
+	m_pPipe = nullptr;
+}
+
+void HandoffListener::OnConnection(){
+	auto client = new uv_pipe_t;
+	uv_pipe_init(m_pLoop, client, 0);
+	
+	bool sent = false;
+	uv_os_fd_t fd;
+	if(uv_accept((uv_stream_t*) m_pPipe, (uv_stream_t*) client) == 0 && uv_fileno((uv_handle_t*) client, &fd) == 0){
+		// It's a tiny message on a fresh socket, so blocking here is fine
+		sent = SendFds(fd, m_Fds.data(), m_Fds.size());
+	}
+	
+	uv_close((uv_handle_t*) client, [](uv_handle_t *h){
+		delete (uv_pipe_t*) h;
+	});
+	
+	// Keep waiting if it didn't work, someone else might try again
+	if(!sent) return;
+	
+	Stop();
+	if(m_fnHandedOff) m_fnHandedOff(this, m_pUserData);
+}
+
+}
+
+#endif
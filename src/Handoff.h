@@ -0,0 +1,62 @@
+#ifndef H_E3A17C5D08B94F26A1D6C2B47F90E835
+#define H_E3A17C5D08B94F26A1D6C2B47F90E835
+
+#ifndef _WIN32
+
+#include <cstddef>
+#include <vector>
+#include <uv.h>
+
+namespace ws28 {
+	// Restarting without dropping connections: the old process hands its listening sockets over a Unix socket
+	// (SCM_RIGHTS) to the new one, which calls Server::ListenFromFd with them and starts accepting right away.
+	// Both processes share the same accept queue, so the old one can StopListening and drain its clients whenever it wants.
+	//
+	//   Old process:  handoff.Start("/run/app.sock", { server.GetListenFd() }, [](HandoffListener*, void *userData){
+	//                     ((ws28::Server*) userData)->StopListening(); // Then close clients as they finish
+	//                 }, &server);
+	//
+	//   New process:  int fd;
+	//                 if(ws28::ReceiveListenFds("/run/app.sock", &fd, 1) == 1) server.ListenFromFd(fd);
+	//                 else server.Listen(port);
+	//
+	// Whoever can connect to the path gets your sockets, so put it somewhere only your user can write to
+	
+	// Sends fds over a connected Unix socket. Blocks, returns false on error
+	bool SendFds(int socket, const int *fds, size_t count);
+	
+	// Receives what SendFds sent, at most max fds. Blocks, returns how many we got or -1 on error
+	int ReceiveFds(int socket, int *fds, size_t max);
+	
+	// New process side: connects to path and receives the listening sockets. Blocks, call it before running your loop.
+	// Returns how many we got, or -1 if there's no one to hand them over (e.g. first start)
+	int ReceiveListenFds(const char *path, int *fds, size_t max);
+	
+	// Old process side: listens on path and hands fds to the first process that connects, then calls the callback and stops
+	class HandoffListener {
+		typedef void (*HandedOffFn)(HandoffListener *, void *userData);
+	public:
+		HandoffListener(uv_loop_t *loop) : m_pLoop(loop){}
+		HandoffListener(const HandoffListener &other) = delete;
+		HandoffListener& operator=(const HandoffListener &other) = delete;
+		~HandoffListener(){ Stop(); }
+		
+		// The fds are still ours after the handoff, the other process gets copies.
+		// Replaces whatever is at path, since it's probably left over from the previous process
+		bool Start(const char *path, std::vector<int> fds, HandedOffFn cb, void *userData = nullptr);
+		void Stop();
+	
+	private:
+		void OnConnection();
+		
+		uv_loop_t *m_pLoop;
+		uv_pipe_t *m_pPipe = nullptr;
+		std::vector<int> m_Fds;
+		HandedOffFn m_fnHandedOff = nullptr;
+		void *m_pUserData = nullptr;
+	};
+}
+
+#endif
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef H_4853CEAD5E8C40BAB621995AB64B3DEA
+#define H_4853CEAD5E8C40BAB621995AB64B3DEA
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace ws28 {
+	
+	// Log-bucketed histogram in the spirit of HdrHistogram: every power of two is split in SUB_BUCKETS
+	// linear buckets, so values are stored with ~6% precision no matter their magnitude.
+	// Values are meant to be nanoseconds, anything over 2^48 (~3 days) ends up in the last bucket.
+	struct HistogramSnapshot;
+	class Histogram {
+	public:
+		enum { SUB_BUCKET_BITS = 4 };
+		enum { SUB_BUCKETS = 1 << SUB_BUCKET_BITS };
+		enum { MAX_EXPONENT = 47 };
+		enum { NUM_BUCKETS = (MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS };
+		
+		static inline size_t BucketIndex(uint64_t v){
+			if(v < SUB_BUCKETS) return (size_t) v;
+			
+			size_t e = Log2(v);
+			if(e > MAX_EXPONENT) return NUM_BUCKETS - 1;
+			
+			return (e - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + ((v >> (e - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+		}
+		
+		// Highest value that maps to this bucket
+		static inline uint64_t BucketUpperBound(size_t index){
+			if(index < SUB_BUCKETS) return index;
+			
+			size_t e = index / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+			uint64_t sub = index % SUB_BUCKETS;
+			uint64_t lower = (SUB_BUCKETS + sub) << (e - SUB_BUCKET_BITS);
+			return lower + (uint64_t(1) << (e - SUB_BUCKET_BITS)) - 1;
+		}
+		
+		// Like Metrics, a histogram is only written by the thread that owns it
+		inline void Record(uint64_t v){
+			Increment(m_Buckets[BucketIndex(v)], 1);
+			Increment(m_Count, 1);
+			Increment(m_Sum, v);
+			if(v > m_Max.load(std::memory_order_relaxed)) m_Max.store(v, std::memory_order_relaxed);
+		}
+		
+		inline uint64_t GetCount() const { return m_Count.load(std::memory_order_relaxed); }
+		
+		HistogramSnapshot Snapshot() const;
+		
+		// p is in [0, 100]
+		uint64_t Percentile(double p) const;
+	
+	private:
+		static inline size_t Log2(uint64_t v){
+#ifdef _MSC_VER
+			unsigned long r;
+			_BitScanReverse64(&r, v);
+			return r;
+#else
+			return 63 - __builtin_clzll(v);
+#endif
+		}
+		
+		static inline void Increment(std::atomic<uint64_t> &v, uint64_t n){
+			v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+		}
+		
+		std::atomic<uint64_t> m_Buckets[NUM_BUCKETS] = {};
+		std::atomic<uint64_t> m_Count{0};
+		std::atomic<uint64_t> m_Sum{0};
+		std::atomic<uint64_t> m_Max{0};
+		
+		friend struct HistogramSnapshot;
+	};
+	
+	struct HistogramSnapshot {
+		uint64_t buckets[Histogram::NUM_BUCKETS] = {};
+		uint64_t count = 0;
+		uint64_t sum = 0;
+		uint64_t max = 0;
+		
+		void Merge(const Histogram &other){
+			for(size_t i = 0; i < Histogram::NUM_BUCKETS; ++i){
+				buckets[i] += other.m_Buckets[i].load(std::memory_order_relaxed);
+			}
+			
+			count += other.m_Count.load(std::memory_order_relaxed);
+			sum += other.m_Sum.load(std::memory_order_relaxed);
+			
+			uint64_t otherMax = other.m_Max.load(std::memory_order_relaxed);
+			if(otherMax > max) max = otherMax;
+		}
+		
+		// p is in [0, 100]. Returns the upper bound of the bucket the percentile falls in,
+		// capped to the max value we've seen, or 0 if there are no values
+		uint64_t Percentile(double p) const {
+			if(count == 0) return 0;
+			if(p < 0) p = 0;
+			if(p > 100) p = 100;
+			
+			uint64_t target = (uint64_t) (p / 100.0 * count + 0.5);
+			if(target == 0) target = 1;
+			
+			uint64_t seen = 0;
+			for(size_t i = 0; i < Histogram::NUM_BUCKETS; ++i){
+				seen += buckets[i];
+				if(seen >= target){
+					uint64_t v = Histogram::BucketUpperBound(i);
+					return v < max ? v : max;
+				}
+			}
+			
+			return max;
+		}
+	};
+	
+	inline HistogramSnapshot Histogram::Snapshot() const {
+		HistogramSnapshot r;
+		r.Merge(*this);
+		return r;
+	}
+	
+	inline uint64_t Histogram::Percentile(double p) const {
+		return Snapshot().Percentile(p);
+	}
+
+}
+
+#endif
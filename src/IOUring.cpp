@@ -0,0 +1,597 @@
+#ifdef WS28_IO_URING
+
+#include "IOUring.h"
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+namespace ws28 {
+namespace detail {
+
+namespace {
+	int SysSetup(unsigned entries, struct io_uring_params *p){
+		return (int) syscall(__NR_io_uring_setup, entries, p);
+	}
+	
+	int SysEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags){
+		return (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+	}
+	
+	int SysRegister(int fd, unsigned opcode, void *arg, unsigned nrArgs){
+		return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+	}
+	
+	inline uint64_t PackUserData(void *owner, IOUring::Op op){
+		return (uint64_t) (uintptr_t) owner | op;
+	}
+}
+
+std::shared_ptr<IOUring> IOUring::Create(uv_loop_t *loop){
+	std::shared_ptr<IOUring> ring{new IOUring(loop)};
+	if(!ring->Init()) return nullptr;
+	return ring;
+}
+
+bool IOUring::Init(){
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+	p.cq_entries = SQ_ENTRIES * 4;
+	
+	m_iFD = SysSetup(SQ_ENTRIES, &p);
+	if(m_iFD < 0) return false;
+	
+	// We need buffer rings and the kernel to hold on to completions when the CQ is full
+	if(!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_SINGLE_MMAP)) return false;
+	
+	m_iSQRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	m_iCQRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	m_iSQRingSize = m_iCQRingSize = std::max(m_iSQRingSize, m_iCQRingSize);
+	
+	m_pSQRing = mmap(nullptr, m_iSQRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_iFD, IORING_OFF_SQ_RING);
+	if(m_pSQRing == MAP_FAILED){
+		m_pSQRing = nullptr;
+		return false;
+	}
+	
+	// Both rings are in the same mapping
+	m_pCQRing = m_pSQRing;
+	m_iCQRingSize = 0;
+	
+	m_iSQEsSize = p.sq_entries * sizeof(struct io_uring_sqe);
+	m_pSQEs = (struct io_uring_sqe*) mmap(nullptr, m_iSQEsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_iFD, IORING_OFF_SQES);
+	if(m_pSQEs == MAP_FAILED){
+		m_pSQEs = nullptr;
+		return false;
+	}
+	
+	char *sq = (char*) m_pSQRing;
+	m_pSQHead = (unsigned*) (sq + p.sq_off.head);
+	m_pSQTail = (unsigned*) (sq + p.sq_off.tail);
+	m_pSQFlags = (unsigned*) (sq + p.sq_off.flags);
+	m_pSQArray = (unsigned*) (sq + p.sq_off.array);
+	m_iSQMask = *(unsigned*) (sq + p.sq_off.ring_mask);
+	m_iSQEntries = p.sq_entries;
+	m_iSQTail = *m_pSQTail;
+	
+	char *cq = (char*) m_pCQRing;
+	m_pCQHead = (unsigned*) (cq + p.cq_off.head);
+	m_pCQTail = (unsigned*) (cq + p.cq_off.tail);
+	m_iCQMask = *(unsigned*) (cq + p.cq_off.ring_mask);
+	m_pCQEs = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+	
+	// Provided buffers for receiving
+	m_iBufferRingSize = BUFFER_COUNT * sizeof(struct io_uring_buf);
+	m_pBufferRing = (struct io_uring_buf_ring*) mmap(nullptr, m_iBufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(m_pBufferRing == MAP_FAILED){
+		m_pBufferRing = nullptr;
+		return false;
+	}
+	
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) m_pBufferRing;
+	reg.ring_entries = BUFFER_COUNT;
+	reg.bgid = BUFFER_GROUP;
+	if(SysRegister(m_iFD, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) return false;
+	
+	m_Buffers.reset(new char[(size_t) BUFFER_COUNT * BUFFER_SIZE]);
+	m_pBufferRing->tail = 0;
+	for(uint16_t i = 0; i < BUFFER_COUNT; ++i) RecycleBuffer(i);
+	
+	m_pPoll = new uv_poll_t;
+	uv_poll_init(m_pLoop, m_pPoll, m_iFD);
+	m_pPoll->data = this;
+	uv_poll_start(m_pPoll, UV_READABLE, [](uv_poll_t *h, int, int){
+		auto ring = ((IOUring*) h->data)->shared_from_this();
+		ring->Reap();
+		ring->Flush();
+	});
+	uv_unref((uv_handle_t*) m_pPoll);
+	
+	// Check runs right after I/O callbacks, prepare right before we block, so whatever was queued
+	// in this iteration (including from timers) is submitted before we wait again
+	m_pPrepare = new uv_prepare_t;
+	uv_prepare_init(m_pLoop, m_pPrepare);
+	m_pPrepare->data = this;
+	uv_prepare_start(m_pPrepare, [](uv_prepare_t *h){
+		((IOUring*) h->data)->shared_from_this()->Flush();
+	});
+	uv_unref((uv_handle_t*) m_pPrepare);
+	
+	m_pCheck = new uv_check_t;
+	uv_check_init(m_pLoop, m_pCheck);
+	m_pCheck->data = this;
+	uv_check_start(m_pCheck, [](uv_check_t *h){
+		((IOUring*) h->data)->shared_from_this()->Flush();
+	});
+	uv_unref((uv_handle_t*) m_pCheck);
+	
+	return true;
+}
+
+IOUring::~IOUring(){
+	assert(m_iInFlight == 0);
+	
+	if(m_pPoll) uv_close((uv_handle_t*) m_pPoll, [](uv_handle_t *h){ delete (uv_poll_t*) h; });
+	if(m_pPrepare) uv_close((uv_handle_t*) m_pPrepare, [](uv_handle_t *h){ delete (uv_prepare_t*) h; });
+	if(m_pCheck) uv_close((uv_handle_t*) m_pCheck, [](uv_handle_t *h){ delete (uv_check_t*) h; });
+	
+	if(m_pSQEs) munmap(m_pSQEs, m_iSQEsSize);
+	if(m_pSQRing) munmap(m_pSQRing, m_iSQRingSize);
+	if(m_pBufferRing) munmap(m_pBufferRing, m_iBufferRingSize);
+	if(m_iFD >= 0) close(m_iFD);
+}
+
+struct io_uring_sqe* IOUring::GetSQE(void *owner, Op op){
+	if(m_iSQTail - __atomic_load_n(m_pSQHead, __ATOMIC_ACQUIRE) >= m_iSQEntries){
+		Submit();
+	}
+	
+	unsigned index = m_iSQTail & m_iSQMask;
+	auto sqe = &m_pSQEs[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = PackUserData(owner, op);
+	
+	m_pSQArray[index] = index;
+	++m_iSQTail;
+	
+	if(m_iInFlight++ == 0) uv_ref((uv_handle_t*) m_pPoll);
+	
+	return sqe;
+}
+
+void IOUring::PrepareCancel(void *owner, Op op){
+	auto sqe = GetSQE(owner, op == OpAccept ? OpCancelAccept : OpCancel);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = PackUserData(owner, op);
+}
+
+void IOUring::Submit(){
+	// Counted from the kernel's head, so whatever a failed enter left behind goes with this one
+	unsigned toSubmit = m_iSQTail - __atomic_load_n(m_pSQHead, __ATOMIC_ACQUIRE);
+	if(toSubmit == 0) return;
+	
+	__atomic_store_n(m_pSQTail, m_iSQTail, __ATOMIC_RELEASE);
+	
+	while(SysEnter(m_iFD, toSubmit, 0, 0) < 0 && errno == EINTR){}
+}
+
+void IOUring::RecycleBuffer(uint16_t id){
+	unsigned short tail = m_pBufferRing->tail;
+	
+	// Not through bufs, the kernel header declares it in a way that puts it 8 bytes off in C++
+	auto &buf = ((struct io_uring_buf*) m_pBufferRing)[tail & (BUFFER_COUNT - 1)];
+	buf.addr = (uint64_t) (uintptr_t) GetBuffer(id);
+	buf.len = BUFFER_SIZE;
+	buf.bid = id;
+	__atomic_store_n(&m_pBufferRing->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
+
+void IOUring::MarkDirty(IOUringTransport *transport){
+	if(transport->m_bDirty) return;
+	transport->m_bDirty = true;
+	m_Dirty.push_back(transport);
+}
+
+void IOUring::Reap(){
+	for(;;){
+		unsigned head = *m_pCQHead;
+		unsigned tail = __atomic_load_n(m_pCQTail, __ATOMIC_ACQUIRE);
+		if(head == tail){
+			// The kernel keeps what didn't fit, ask for it
+			if(__atomic_load_n(m_pSQFlags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW){
+				SysEnter(m_iFD, 0, 0, IORING_ENTER_GETEVENTS);
+				continue;
+			}
+			
+			break;
+		}
+		
+		for(; head != tail; ++head){
+			// Copy it, so the kernel can reuse the slot as soon as we move the head
+			struct io_uring_cqe cqe = m_pCQEs[head & m_iCQMask];
+			__atomic_store_n(m_pCQHead, head + 1, __ATOMIC_RELEASE);
+			
+			auto op = (Op) (cqe.user_data & OpMask);
+			void *owner = (void*) (uintptr_t) (cqe.user_data & ~(uint64_t) OpMask);
+			
+			bool final = !(cqe.flags & IORING_CQE_F_MORE);
+			if(final && --m_iInFlight == 0) uv_unref((uv_handle_t*) m_pPoll);
+			
+			if(op == OpAccept || op == OpCancelAccept){
+				((IOUringAcceptor*) owner)->OnCompletion(op, &cqe);
+			}else{
+				((IOUringTransport*) owner)->OnCompletion(op, &cqe);
+			}
+		}
+	}
+}
+
+void IOUring::Flush(){
+	// Transports can mark themselves (or others) dirty while we go through these
+	for(size_t i = 0; i < m_Dirty.size(); ++i){
+		auto transport = m_Dirty[i];
+		transport->m_bDirty = false;
+		transport->Flush();
+	}
+	
+	m_Dirty.clear();
+	Submit();
+}
+
+
+
+IOUringTransport::IOUringTransport(std::shared_ptr<IOUring> ring, int fd) : m_Ring(std::move(ring)), m_iFD(fd){
+
+}
+
+IOUringTransport::~IOUringTransport(){
+	assert(m_iPendingOps == 0);
+	close(m_iFD);
+}
+
+void IOUringTransport::SetDefaultOptions(){
+	int enable = 1;
+	setsockopt(m_iFD, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+	setsockopt(m_iFD, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+	
+	// Same as uv_tcp_keepalive(10000), which is in seconds
+	int delay = 10000;
+	setsockopt(m_iFD, IPPROTO_TCP, TCP_KEEPIDLE, &delay, sizeof(delay));
+}
+
+void IOUringTransport::SetNotSentLowWatermark(uint32_t bytes){
+#ifdef TCP_NOTSENT_LOWAT
+	int v = (int) bytes;
+	setsockopt(m_iFD, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &v, sizeof(v));
+#endif
+}
+
+void IOUringTransport::Append(const uv_buf_t *bufs, unsigned int nbufs){
+	for(unsigned int i = 0; i < nbufs; ++i){
+		m_Pending.insert(m_Pending.end(), bufs[i].base, bufs[i].base + bufs[i].len);
+		m_iQueued += bufs[i].len;
+	}
+	
+	m_Ring->MarkDirty(this);
+}
+
+int IOUringTransport::TryWrite(const uv_buf_t *bufs, unsigned int nbufs){
+	if(m_iError != 0) return m_iError;
+	if(m_bShutdownRequested) return UV_EPIPE;
+	
+	if(m_bSendInFlight && m_Pending.size() + (m_Sending.size() - m_iSendingOffset) >= MAX_BUFFERED) return UV_EAGAIN;
+	
+	size_t total = 0;
+	for(unsigned int i = 0; i < nbufs; ++i) total += bufs[i].len;
+	
+	Append(bufs, nbufs);
+	return (int) total;
+}
+
+bool IOUringTransport::Write(const uv_buf_t *bufs, unsigned int nbufs, WriteCallback cb, void *userData){
+	if(m_iError != 0 || m_bShutdownRequested) return false;
+	
+	Append(bufs, nbufs);
+	m_WriteCallbacks.push_back(WriteCallbackEntry{m_iQueued, cb, userData});
+	return true;
+}
+
+void IOUringTransport::Shutdown(ShutdownCallback cb, void *userData){
+	m_fnShutdown = cb;
+	m_pShutdownUserData = userData;
+	m_bShutdownRequested = true;
+	m_Ring->MarkDirty(this);
+}
+
+void IOUringTransport::StartReading(){
+	m_bReading = true;
+	m_Ring->MarkDirty(this);
+}
+
+void IOUringTransport::StopReading(){
+	m_bReading = false;
+	if(m_bRecvArmed){
+		++m_iPendingOps;
+		m_Ring->PrepareCancel(this, IOUring::OpRecv);
+	}
+}
+
+void IOUringTransport::Abort(){
+	if(m_bReleased) return;
+	
+	// Same as with libuv, a zero linger makes close send a RST
+	struct linger l;
+	l.l_onoff = 1;
+	l.l_linger = 0;
+	setsockopt(m_iFD, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+	
+	// The shutdown becomes a NOP once we've failed, it only waits for the send in flight
+	Fail(UV_ECANCELED);
+	m_Pending.clear();
+	
+	if(m_bSendInFlight){
+		++m_iPendingOps;
+		m_Ring->PrepareCancel(this, IOUring::OpSend);
+	}
+	
+	m_Ring->MarkDirty(this);
+}
+
+size_t IOUringTransport::GetMemoryUsage() const {
+	return sizeof(*this) + m_Pending.capacity() + m_Sending.capacity() + m_HeldInput.capacity() + m_WriteCallbacks.capacity() * sizeof(WriteCallbackEntry);
+}
+
+bool IOUringTransport::GetPeerAddress(struct sockaddr_storage &addr){
+	socklen_t addrLen = sizeof(addr);
+	return getpeername(m_iFD, (struct sockaddr*) &addr, &addrLen) == 0;
+}
+
+void IOUringTransport::Release(){
+	m_pClient = nullptr;
+	m_bReleased = true;
+	m_bReading = false;
+	
+	// Like closing a libuv handle, writes that didn't make it are cancelled
+	auto callbacks = std::move(m_WriteCallbacks);
+	m_WriteCallbacks.clear();
+	for(auto &entry : callbacks) entry.cb(entry.userData, UV_ECANCELED);
+	
+	if(m_bRecvArmed){
+		++m_iPendingOps;
+		m_Ring->PrepareCancel(this, IOUring::OpRecv);
+	}
+	
+	if(m_bSendInFlight){
+		++m_iPendingOps;
+		m_Ring->PrepareCancel(this, IOUring::OpSend);
+	}
+	
+	m_Ring->MarkDirty(this);
+}
+
+void IOUringTransport::Fail(int status){
+	if(m_iError != 0) return;
+	m_iError = status;
+	
+	auto callbacks = std::move(m_WriteCallbacks);
+	m_WriteCallbacks.clear();
+	for(auto &entry : callbacks) entry.cb(entry.userData, status);
+	
+	// Writes that went through TryWrite have no callback to tell the client
+	NotifyReadError();
+}
+
+bool IOUringTransport::Flush(){
+	if(m_bReleased){
+		if(m_iPendingOps != 0) return true;
+		
+		delete this;
+		return false;
+	}
+	
+	if(m_bReading && !m_HeldInput.empty()){
+		auto held = std::move(m_HeldInput);
+		m_HeldInput.clear();
+		NotifyData(held.data(), held.size());
+		if(m_bReleased) return true; // Deleted on the next flush, once the cancels are back
+	}
+	
+	if(m_bReading && !m_bRecvArmed && m_iError == 0){
+		auto sqe = m_Ring->GetSQE(this, IOUring::OpRecv);
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = m_iFD;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = IOUring::BUFFER_GROUP;
+		
+		m_bRecvArmed = true;
+		++m_iPendingOps;
+	}
+	
+	if(!m_bSendInFlight && !m_Pending.empty() && m_iError == 0){
+		m_Sending.clear();
+		m_Sending.swap(m_Pending);
+		m_iSendingOffset = 0;
+		
+		auto sqe = m_Ring->GetSQE(this, IOUring::OpSend);
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = m_iFD;
+		sqe->addr = (uint64_t) (uintptr_t) m_Sending.data();
+		sqe->len = (uint32_t) std::min(m_Sending.size(), (size_t) UINT32_MAX);
+		sqe->msg_flags = MSG_NOSIGNAL;
+		
+		m_bSendInFlight = true;
+		++m_iPendingOps;
+	}
+	
+	// Shutdown goes after everything we had to send
+	if(m_bShutdownRequested && !m_bShutdownSubmitted && !m_bSendInFlight && m_Pending.empty()){
+		m_bShutdownSubmitted = true;
+		
+		if(m_iError != 0){
+			// Nothing to shut down gracefully, but the callback is still asynchronous
+			auto sqe = m_Ring->GetSQE(this, IOUring::OpShutdown);
+			sqe->opcode = IORING_OP_NOP;
+		}else{
+			auto sqe = m_Ring->GetSQE(this, IOUring::OpShutdown);
+			sqe->opcode = IORING_OP_SHUTDOWN;
+			sqe->fd = m_iFD;
+			sqe->len = SHUT_WR;
+		}
+		
+		++m_iPendingOps;
+	}
+	
+	return true;
+}
+
+void IOUringTransport::OnSent(int res){
+	m_bSendInFlight = false;
+	
+	if(res < 0){
+		if(!m_bReleased) Fail(res == -ECANCELED ? UV_ECANCELED : res);
+		
+		// A shutdown might have been waiting for this send
+		m_Ring->MarkDirty(this);
+		return;
+	}
+	
+	m_iSendingOffset += (size_t) res;
+	m_iSent += (size_t) res;
+	
+	size_t done = 0;
+	while(done < m_WriteCallbacks.size() && m_WriteCallbacks[done].end <= m_iSent) ++done;
+	
+	if(done != 0){
+		std::vector<WriteCallbackEntry> callbacks(m_WriteCallbacks.begin(), m_WriteCallbacks.begin() + done);
+		m_WriteCallbacks.erase(m_WriteCallbacks.begin(), m_WriteCallbacks.begin() + done);
+		for(auto &entry : callbacks) entry.cb(entry.userData, 0);
+	}
+	
+	if(m_bReleased) return;
+	
+	if(m_iSendingOffset < m_Sending.size()){
+		// Short send, put the rest in front of whatever was queued since
+		m_Pending.insert(m_Pending.begin(), m_Sending.begin() + m_iSendingOffset, m_Sending.end());
+	}
+	
+	m_Sending.clear();
+	m_iSendingOffset = 0;
+	m_Ring->MarkDirty(this);
+}
+
+void IOUringTransport::OnCompletion(IOUring::Op op, const struct io_uring_cqe *cqe){
+	bool final = !(cqe->flags & IORING_CQE_F_MORE);
+	if(final) --m_iPendingOps;
+	
+	switch(op){
+	case IOUring::OpRecv: {
+		if(final) m_bRecvArmed = false;
+		
+		if(cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)){
+			uint16_t id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			char *data = m_Ring->GetBuffer(id);
+			
+			if(m_bReleased){
+				// Nobody cares
+			}else if(m_bReading){
+				NotifyData(data, (size_t) cqe->res);
+			}else{
+				// Arrived before the cancel did
+				m_HeldInput.insert(m_HeldInput.end(), data, data + cqe->res);
+			}
+			
+			// The client copies what it doesn't consume, so the buffer can go back right away
+			m_Ring->RecycleBuffer(id);
+		}else if(cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)){
+			// EOF or error, there's nothing more to read
+			m_bReading = false;
+			if(!m_bReleased) NotifyReadError();
+		}
+		
+		// Multishot stops when buffers run out (among other things), we rearm on the next flush
+		if(final) m_Ring->MarkDirty(this);
+	break;
+	}
+	
+	case IOUring::OpSend:
+		OnSent(cqe->res);
+	break;
+	
+	case IOUring::OpShutdown:
+		if(m_fnShutdown){
+			auto cb = m_fnShutdown;
+			m_fnShutdown = nullptr;
+			cb(m_pShutdownUserData);
+		}
+	break;
+	
+	case IOUring::OpCancel:
+	default:
+	break;
+	}
+	
+	// Release might have been waiting for this one
+	if(m_bReleased && m_iPendingOps == 0) m_Ring->MarkDirty(this);
+}
+
+
+
+IOUringAcceptor::IOUringAcceptor(std::shared_ptr<IOUring> ring, int fd, AcceptCallback cb, void *userData) : m_Ring(std::move(ring)), m_iFD(fd), m_fnAccept(cb), m_pUserData(userData){
+	Arm();
+}
+
+void IOUringAcceptor::Arm(){
+	auto sqe = m_Ring->GetSQE(this, IOUring::OpAccept);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = m_iFD;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	++m_iPendingOps;
+	
+	m_Ring->Submit();
+}
+
+void IOUringAcceptor::Stop(){
+	m_bStopped = true;
+	m_iFD = -1; // The listening socket is closed by its owner, the kernel keeps its own reference until the cancel
+	
+	++m_iPendingOps;
+	m_Ring->PrepareCancel(this, IOUring::OpAccept);
+	m_Ring->Submit();
+}
+
+void IOUringAcceptor::OnCompletion(IOUring::Op op, const struct io_uring_cqe *cqe){
+	bool final = !(cqe->flags & IORING_CQE_F_MORE);
+	if(final) --m_iPendingOps;
+	
+	if(op == IOUring::OpAccept){
+		if(cqe->res >= 0){
+			if(m_bStopped){
+				close(cqe->res);
+			}else{
+				m_fnAccept(m_pUserData, cqe->res);
+			}
+		}
+		
+		// Multishot accept can stop on errors (like running out of fds), keep going
+		if(final && !m_bStopped) Arm();
+	}
+	
+	if(m_bStopped && m_iPendingOps == 0) delete this;
+}
+
+}
+}
+
+#endif
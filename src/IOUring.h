@@ -0,0 +1,194 @@
+#ifndef H_6B0E2D9A71F34C1E8A5D4F3C92B7E610
+#define H_6B0E2D9A71F34C1E8A5D4F3C92B7E610
+
+#ifdef WS28_IO_URING
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <uv.h>
+#include <linux/io_uring.h>
+
+#include "Transport.h"
+
+namespace ws28 {
+	namespace detail {
+		class IOUringTransport;
+		class IOUringAcceptor;
+		
+		// An io_uring instance that lives alongside a libuv loop. Completions are reaped from a uv_poll_t on the ring fd,
+		// and everything queued during a loop iteration is submitted with a single io_uring_enter from a prepare and a check handle.
+		// Receives use multishot recv with a ring of provided buffers, so idle connections don't hold any buffer.
+		// It stays alive (through shared_ptrs) until every transport and acceptor using it is gone
+		class IOUring : public std::enable_shared_from_this<IOUring> {
+			enum { SQ_ENTRIES = 4096 };
+			enum { BUFFER_COUNT = 512 }; // Power of 2
+			enum { BUFFER_SIZE = 4096 };
+			enum { BUFFER_GROUP = 0 };
+		public:
+			// Tags in the low bits of user_data, the rest is a pointer to the transport or acceptor
+			enum Op : uint64_t {
+				OpRecv = 1,
+				OpSend = 2,
+				OpShutdown = 3,
+				OpCancel = 4, // Cancelling one of a transport's ops
+				OpAccept = 5,
+				OpCancelAccept = 6,
+				
+				OpMask = 7
+			};
+			
+			// Returns nullptr if the kernel doesn't support what we need
+			static std::shared_ptr<IOUring> Create(uv_loop_t *loop);
+			
+			IOUring(const IOUring &other) = delete;
+			IOUring& operator=(const IOUring &other) = delete;
+			~IOUring();
+			
+			inline uv_loop_t* GetLoop() const { return m_pLoop; }
+			
+			// Never fails, submits what we have if the queue is full. Every sqe gets exactly one final completion
+			// (without IORING_CQE_F_MORE), the owner keeps itself alive until then
+			struct io_uring_sqe* GetSQE(void *owner, Op op);
+			void PrepareCancel(void *owner, Op op);
+			
+			inline char* GetBuffer(uint16_t id){ return m_Buffers.get() + (size_t) id * BUFFER_SIZE; }
+			void RecycleBuffer(uint16_t id);
+			
+			// Transports that have something to do before we submit (writes, rearming reads, held input, deleting themselves)
+			void MarkDirty(IOUringTransport *transport);
+		
+		private:
+			IOUring(uv_loop_t *loop) : m_pLoop(loop){}
+			
+			bool Init();
+			void Submit();
+			void Reap();
+			void Flush();
+			
+			uv_loop_t *m_pLoop;
+			int m_iFD = -1;
+			
+			void *m_pSQRing = nullptr;
+			size_t m_iSQRingSize = 0;
+			void *m_pCQRing = nullptr;
+			size_t m_iCQRingSize = 0;
+			struct io_uring_sqe *m_pSQEs = nullptr;
+			size_t m_iSQEsSize = 0;
+			
+			unsigned *m_pSQHead, *m_pSQTail, *m_pSQFlags, *m_pSQArray;
+			unsigned m_iSQMask, m_iSQEntries;
+			unsigned m_iSQTail = 0; // Local tail, published when we submit
+			unsigned *m_pCQHead, *m_pCQTail;
+			unsigned m_iCQMask;
+			struct io_uring_cqe *m_pCQEs;
+			
+			struct io_uring_buf_ring *m_pBufferRing = nullptr;
+			size_t m_iBufferRingSize = 0;
+			std::unique_ptr<char[]> m_Buffers;
+			
+			uv_poll_t *m_pPoll = nullptr;
+			uv_prepare_t *m_pPrepare = nullptr;
+			uv_check_t *m_pCheck = nullptr;
+			size_t m_iInFlight = 0; // The poll handle keeps the loop alive while this isn't 0
+			
+			std::vector<IOUringTransport*> m_Dirty;
+			
+			friend class IOUringTransport;
+			friend class IOUringAcceptor;
+		};
+		
+		// A TCP connection driven by io_uring. Writes are copied into a buffer that goes out as a single send per connection
+		// (with several connections per io_uring_enter), so lots of small messages don't mean lots of syscalls
+		class IOUringTransport : public Transport {
+			enum { MAX_BUFFERED = 64 * 1024 }; // TryWrite says UV_EAGAIN past this, so the client queues (and counts) it
+		public:
+			IOUringTransport(std::shared_ptr<IOUring> ring, int fd);
+			
+			int TryWrite(const uv_buf_t *bufs, unsigned int nbufs) override;
+			bool Write(const uv_buf_t *bufs, unsigned int nbufs, WriteCallback cb, void *userData) override;
+			void Shutdown(ShutdownCallback cb, void *userData) override;
+			void StartReading() override;
+			void StopReading() override;
+			bool GetPeerAddress(struct sockaddr_storage &addr) override;
+			void SetDefaultOptions() override;
+			void SetNotSentLowWatermark(uint32_t bytes) override;
+			void Abort() override;
+			size_t GetMemoryUsage() const override;
+			size_t GetQueuedBytes() const override { return (size_t) (m_iQueued - m_iSent); }
+			void Release() override;
+		
+		private:
+			~IOUringTransport();
+			
+			void Append(const uv_buf_t *bufs, unsigned int nbufs);
+			void OnCompletion(IOUring::Op op, const struct io_uring_cqe *cqe);
+			void OnSent(int res);
+			void Fail(int status);
+			
+			// Called by the ring before it submits. Returns false if we deleted ourselves
+			bool Flush();
+			
+			struct WriteCallbackEntry {
+				uint64_t end; // Done once m_iSent gets here
+				WriteCallback cb;
+				void *userData;
+			};
+			
+			std::shared_ptr<IOUring> m_Ring;
+			int m_iFD;
+			
+			std::vector<char> m_Pending; // Not sent yet
+			std::vector<char> m_Sending; // What the send in flight is sending
+			size_t m_iSendingOffset = 0;
+			uint64_t m_iQueued = 0; // Bytes ever appended
+			uint64_t m_iSent = 0;
+			std::vector<WriteCallbackEntry> m_WriteCallbacks;
+			
+			std::vector<char> m_HeldInput; // Arrived while we weren't reading
+			
+			ShutdownCallback m_fnShutdown = nullptr;
+			void *m_pShutdownUserData = nullptr;
+			
+			int m_iError = 0;
+			size_t m_iPendingOps = 0;
+			bool m_bReading = false;
+			bool m_bRecvArmed = false;
+			bool m_bSendInFlight = false;
+			bool m_bShutdownRequested = false;
+			bool m_bShutdownSubmitted = false;
+			bool m_bReleased = false;
+			bool m_bDirty = false;
+			
+			friend class IOUring;
+		};
+		
+		// Multishot accept on a listening socket. Stop cancels it, and it deletes itself once the kernel lets go
+		class IOUringAcceptor {
+		public:
+			typedef void (*AcceptCallback)(void *userData, int fd);
+			
+			IOUringAcceptor(std::shared_ptr<IOUring> ring, int fd, AcceptCallback cb, void *userData);
+			
+			// The callback won't be called after this
+			void Stop();
+		
+		private:
+			void Arm();
+			void OnCompletion(IOUring::Op op, const struct io_uring_cqe *cqe);
+			
+			std::shared_ptr<IOUring> m_Ring;
+			int m_iFD;
+			AcceptCallback m_fnAccept;
+			void *m_pUserData;
+			size_t m_iPendingOps = 0;
+			bool m_bStopped = false;
+			
+			friend class IOUring;
+		};
+	}
+}
+
+#endif
+
+#endif
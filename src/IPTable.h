@@ -0,0 +1,170 @@
+#ifndef H_5D88A788341A42099B388ED1656E9572
+#define H_5D88A788341A42099B388ED1656E9572
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <uv.h>
+
+namespace ws28 {
+	namespace detail {
+		// Binary form of an address, as we group them for limits. IPv4 (and IPv4-mapped IPv6) addresses
+		// stand on their own, IPv6 ones are truncated to their /64, since whoever has one address usually has the whole /64
+		struct IPKey {
+			uint8_t bytes[16];
+			
+			inline bool operator==(const IPKey &other) const { return memcmp(bytes, other.bytes, sizeof(bytes)) == 0; }
+			inline bool operator!=(const IPKey &other) const { return !(*this == other); }
+			
+			// Returns false for anything that isn't IPv4 or IPv6
+			static bool FromAddress(const struct sockaddr *addr, IPKey &out){
+				static const uint8_t ipv4Prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+				
+				if(addr->sa_family == AF_INET){
+					memcpy(out.bytes, ipv4Prefix, sizeof(ipv4Prefix));
+					memcpy(out.bytes + 12, &((const struct sockaddr_in*) addr)->sin_addr, 4);
+					return true;
+				}
+				
+				if(addr->sa_family == AF_INET6){
+					memcpy(out.bytes, &((const struct sockaddr_in6*) addr)->sin6_addr, 16);
+					if(memcmp(out.bytes, ipv4Prefix, sizeof(ipv4Prefix)) != 0) memset(out.bytes + 8, 0, 8);
+					return true;
+				}
+				
+				return false;
+			}
+		};
+		
+		// Open addressing hash table from IPKey to T, with linear probing and backward shift deletion,
+		// so lookups touch one or two cache lines and there are no tombstones to clean up.
+		// The hash is seeded, otherwise someone with a lot of IPv6 addresses could pick ones that collide
+		template<typename T>
+		class IPTable {
+		public:
+			IPTable(uint64_t seed) : m_iSeed(seed | 1){}
+			
+			IPTable(const IPTable &other) = delete;
+			IPTable& operator=(const IPTable &other) = delete;
+			
+			T* Find(const IPKey &key){
+				if(m_iCount == 0) return nullptr;
+				
+				for(size_t i = IndexFor(key);; i = (i + 1) & m_iMask){
+					auto &slot = m_Slots[i];
+					if(!slot.used) return nullptr;
+					if(slot.key == key) return &slot.value;
+				}
+			}
+			
+			// Finds or inserts a default constructed value
+			T& Get(const IPKey &key){
+				if((m_iCount + 1) * 4 > Capacity() * 3) Grow();
+				
+				for(size_t i = IndexFor(key);; i = (i + 1) & m_iMask){
+					auto &slot = m_Slots[i];
+					if(!slot.used){
+						slot.used = true;
+						slot.key = key;
+						slot.value = T{};
+						++m_iCount;
+						return slot.value;
+					}
+					
+					if(slot.key == key) return slot.value;
+				}
+			}
+			
+			void Erase(const IPKey &key){
+				if(m_iCount == 0) return;
+				
+				size_t i = IndexFor(key);
+				for(;; i = (i + 1) & m_iMask){
+					if(!m_Slots[i].used) return;
+					if(m_Slots[i].key == key) break;
+				}
+				
+				EraseAt(i);
+			}
+			
+			// Erases every entry for which f(value) is true
+			template<typename F>
+			void EraseIf(const F &f){
+				for(size_t i = 0; i < Capacity();){
+					// Erasing shifts the next entries back, so this slot has to be looked at again
+					if(m_Slots[i].used && f(m_Slots[i].value)){
+						EraseAt(i);
+					}else{
+						++i;
+					}
+				}
+			}
+			
+			inline size_t Size() const { return m_iCount; }
+			inline size_t Capacity() const { return m_Slots ? m_iMask + 1 : 0; }
+			inline size_t GetMemoryUsage() const { return Capacity() * sizeof(Slot); }
+		
+		private:
+			struct Slot {
+				IPKey key;
+				bool used;
+				T value;
+			};
+			
+			inline size_t IndexFor(const IPKey &key) const {
+				uint64_t a, b;
+				memcpy(&a, key.bytes, 8);
+				memcpy(&b, key.bytes + 8, 8);
+				
+				uint64_t h = (a ^ m_iSeed) * 0x9E3779B97F4A7C15ULL;
+				h ^= b;
+				h *= 0xBF58476D1CE4E5B9ULL;
+				h ^= h >> 31;
+				h *= m_iSeed;
+				h ^= h >> 29;
+				
+				return (size_t) h & m_iMask;
+			}
+			
+			void EraseAt(size_t i){
+				m_Slots[i].used = false;
+				--m_iCount;
+				
+				// Move back entries that would become unreachable because of the hole we just made
+				for(size_t j = (i + 1) & m_iMask; m_Slots[j].used; j = (j + 1) & m_iMask){
+					size_t home = IndexFor(m_Slots[j].key);
+					
+					// Can the entry at j live at i? It can if i is between its home and j (cyclically)
+					if(((j - home) & m_iMask) >= ((j - i) & m_iMask)){
+						m_Slots[i] = m_Slots[j];
+						m_Slots[j].used = false;
+						i = j;
+					}
+				}
+			}
+			
+			void Grow(){
+				size_t oldCapacity = Capacity();
+				size_t newCapacity = oldCapacity == 0 ? 64 : oldCapacity * 2;
+				
+				auto oldSlots = std::move(m_Slots);
+				
+				m_Slots.reset(new Slot[newCapacity]());
+				m_iMask = newCapacity - 1;
+				m_iCount = 0;
+				
+				for(size_t i = 0; i < oldCapacity; ++i){
+					if(oldSlots[i].used) Get(oldSlots[i].key) = oldSlots[i].value;
+				}
+			}
+			
+			std::unique_ptr<Slot[]> m_Slots;
+			size_t m_iMask = 0;
+			size_t m_iCount = 0;
+			uint64_t m_iSeed;
+		};
+	}
+}
+
+#endif
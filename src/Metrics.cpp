@@ -0,0 +1,182 @@
+#include "Metrics.h"
+#include <mutex>
+#include <vector>
+#include <sstream>
+
+namespace ws28 {
+
+namespace {
+	std::mutex g_MetricsMutex;
+	std::vector<Metrics*> g_Metrics;
+	
+	const char *g_OpcodeNames[metrics::NUM_OPCODES] = {
+		"continuation", "text", "binary", nullptr, nullptr, nullptr, nullptr, nullptr,
+		"close", "ping", "pong", nullptr, nullptr, nullptr, nullptr, nullptr,
+	};
+	
+	const char *g_DestroyReasonNames[(size_t) DestroyReason::Count] = {
+		"user", "closed", "read_error", "write_error", "tls_error", "http_request", "rejected", "too_large", "server_shutdown", "overloaded",
+	};
+}
+
+Metrics* Metrics::CreateLocal(){
+	auto m = new Metrics();
+	
+	std::lock_guard<std::mutex> lock(g_MetricsMutex);
+	g_Metrics.push_back(m);
+	return m;
+}
+
+MetricsSnapshot Metrics::Snapshot() const {
+	MetricsSnapshot r;
+	for(size_t i = 0; i < metrics::COUNT; ++i){
+		r.values[i] = Get(i);
+	}
+	
+	for(size_t i = 0; i < metrics::NUM_HISTOGRAMS; ++i){
+		r.histograms[i].Merge(m_Histograms[i]);
+	}
+	
+	return r;
+}
+
+MetricsSnapshot Metrics::Aggregate(){
+	MetricsSnapshot r;
+	
+	std::lock_guard<std::mutex> lock(g_MetricsMutex);
+	for(auto m : g_Metrics){
+		for(size_t i = 0; i < metrics::COUNT; ++i){
+			r.values[i] += m->Get(i);
+		}
+		
+		for(size_t i = 0; i < metrics::NUM_HISTOGRAMS; ++i){
+			r.histograms[i].Merge(m->m_Histograms[i]);
+		}
+	}
+	
+	return r;
+}
+
+std::vector<const Metrics*> Metrics::GetAll(){
+	std::lock_guard<std::mutex> lock(g_MetricsMutex);
+	return std::vector<const Metrics*>(g_Metrics.begin(), g_Metrics.end());
+}
+
+std::string Metrics::FormatPrometheus(){
+	return FormatPrometheus(Aggregate());
+}
+
+std::string Metrics::FormatPrometheus(const MetricsSnapshot &s){
+	std::stringstream ss;
+	
+	auto Header = [&](const char *name, const char *type, const char *help){
+		ss << "# HELP " << name << " " << help << "\n";
+		ss << "# TYPE " << name << " " << type << "\n";
+	};
+	
+	auto Counter = [&](const char *name, const char *help, size_t id){
+		Header(name, "counter", help);
+		ss << name << " " << s.Get(id) << "\n";
+	};
+	
+	// Gauges are stored as wrapping unsigned values, so print them as signed
+	auto Gauge = [&](const char *name, const char *help, size_t id){
+		Header(name, "gauge", help);
+		ss << name << " " << (int64_t) s.Get(id) << "\n";
+	};
+	
+	auto PerOpcode = [&](const char *name, const char *help, size_t base){
+		Header(name, "counter", help);
+		for(size_t i = 0; i < metrics::NUM_OPCODES; ++i){
+			if(g_OpcodeNames[i] == nullptr) continue;
+			ss << name << "{opcode=\"" << g_OpcodeNames[i] << "\"} " << s.Get(base + i) << "\n";
+		}
+	};
+	
+	auto PerCloseCode = [&](const char *name, const char *help, size_t base){
+		Header(name, "counter", help);
+		for(size_t i = 0; i < metrics::NUM_CLOSE_CODES; ++i){
+			uint64_t v = s.Get(base + i);
+			if(v == 0) continue;
+			
+			if(i == 16){
+				ss << name << "{code=\"other\"} " << v << "\n";
+			}else{
+				ss << name << "{code=\"" << (1000 + i) << "\"} " << v << "\n";
+			}
+		}
+	};
+	
+	Counter("ws28_accepts_total", "TCP connections accepted", metrics::Accepts);
+	Counter("ws28_connects_total", "Outgoing TCP connections established", metrics::Connects);
+	
+	Header("ws28_ip_limit_rejects_total", "counter", "Connections closed right after accepting them because of per IP limits");
+	ss << "ws28_ip_limit_rejects_total{limit=\"connections\"} " << s.Get(metrics::IPConnectionLimitRejects) << "\n";
+	ss << "ws28_ip_limit_rejects_total{limit=\"rate\"} " << s.Get(metrics::IPRateLimitRejects) << "\n";
+	
+	Header("ws28_rate_limited_total", "counter", "Messages that went over a client's rate limit, by what we did with them");
+	ss << "ws28_rate_limited_total{action=\"drop\"} " << s.Get(metrics::RateLimitDrops) << "\n";
+	ss << "ws28_rate_limited_total{action=\"delay\"} " << s.Get(metrics::RateLimitDelays) << "\n";
+	ss << "ws28_rate_limited_total{action=\"close\"} " << s.Get(metrics::RateLimitCloses) << "\n";
+	
+	Header("ws28_memory_budget_total", "counter", "What we did to stay within the server's memory budget");
+	ss << "ws28_memory_budget_total{action=\"reject\"} " << s.Get(metrics::MemoryBudgetRejects) << "\n";
+	ss << "ws28_memory_budget_total{action=\"pause\"} " << s.Get(metrics::MemoryBudgetPauses) << "\n";
+	ss << "ws28_memory_budget_total{action=\"destroy\"} " << s.Get(metrics::MemoryBudgetDestroys) << "\n";
+	
+	Header("ws28_handshakes_total", "counter", "Completed handshakes by kind");
+	ss << "ws28_handshakes_total{kind=\"websocket\"} " << s.Get(metrics::HandshakesWebSocket) << "\n";
+	ss << "ws28_handshakes_total{kind=\"alternative\"} " << s.Get(metrics::HandshakesAlternative) << "\n";
+	ss << "ws28_handshakes_total{kind=\"tls\"} " << s.Get(metrics::HandshakesTLS) << "\n";
+	ss << "ws28_handshakes_total{kind=\"rejected\"} " << s.Get(metrics::HandshakesRejected) << "\n";
+	
+	PerOpcode("ws28_frames_in_total", "Frames received", metrics::FramesIn);
+	PerOpcode("ws28_bytes_in_total", "Payload bytes received", metrics::BytesIn);
+	PerOpcode("ws28_frames_out_total", "Frames sent", metrics::FramesOut);
+	PerOpcode("ws28_bytes_out_total", "Payload bytes sent", metrics::BytesOut);
+	
+	PerCloseCode("ws28_close_codes_sent_total", "Close codes sent", metrics::CloseCodesSent);
+	PerCloseCode("ws28_close_codes_received_total", "Close codes received", metrics::CloseCodesReceived);
+	
+	Counter("ws28_partial_writes_total", "Writes that didn't complete immediately and had to be queued", metrics::PartialWrites);
+	Counter("ws28_write_eagain_total", "uv_try_write calls that returned UV_EAGAIN", metrics::WriteEAGAIN);
+	Counter("ws28_linger_timeouts_total", "Closing sockets reset because they didn't finish within the linger timeout", metrics::LingerTimeouts);
+	Counter("ws28_conflated_messages_total", "Waiting messages replaced by a newer one with the same conflation key", metrics::ConflatedMessages);
+	
+	Header("ws28_destroys_total", "counter", "Clients destroyed by reason");
+	for(size_t i = 0; i < (size_t) DestroyReason::Count; ++i){
+		ss << "ws28_destroys_total{reason=\"" << g_DestroyReasonNames[i] << "\"} " << s.Get(metrics::Destroys + i) << "\n";
+	}
+	
+	Gauge("ws28_clients", "Connected clients", metrics::Clients);
+	Gauge("ws28_queued_write_bytes", "Bytes waiting in write queues", metrics::QueuedWriteBytes);
+	Gauge("ws28_closing_clients", "Destroyed clients waiting for their socket to close", metrics::ClosingClients);
+	Gauge("ws28_tls_handshake_jobs", "TLS handshakes running or waiting on the threadpool", metrics::TLSHandshakeJobs);
+	
+	auto Summary = [&](const char *name, const char *label, const char *labelValue, const HistogramSnapshot &h){
+		static const char *quantiles[] = { "0.5", "0.9", "0.99", "0.999" };
+		static const double percentiles[] = { 50, 90, 99, 99.9 };
+		
+		for(size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i){
+			ss << name << "{" << label << "=\"" << labelValue << "\",quantile=\"" << quantiles[i] << "\"} " << h.Percentile(percentiles[i]) / 1e9 << "\n";
+		}
+		
+		ss << name << "_sum{" << label << "=\"" << labelValue << "\"} " << h.sum / 1e9 << "\n";
+		ss << name << "_count{" << label << "=\"" << labelValue << "\"} " << h.count << "\n";
+	};
+	
+	Header("ws28_callback_duration_seconds", "summary", "Time spent inside user callbacks");
+	Summary("ws28_callback_duration_seconds", "callback", "data", s.histograms[metrics::DataCallbackLatency]);
+	Summary("ws28_callback_duration_seconds", "callback", "http", s.histograms[metrics::HTTPCallbackLatency]);
+	
+	Header("ws28_write_queue_duration_seconds", "summary", "Time between a write being queued and it reaching the socket");
+	Summary("ws28_write_queue_duration_seconds", "kind", "queued", s.histograms[metrics::WriteQueueLatency]);
+	
+	Header("ws28_handshake_duration_seconds", "summary", "Time between accepting a connection and the client being connected");
+	Summary("ws28_handshake_duration_seconds", "kind", "plain", s.histograms[metrics::HandshakePlainLatency]);
+	Summary("ws28_handshake_duration_seconds", "kind", "tls", s.histograms[metrics::HandshakeTLSLatency]);
+	
+	return ss.str();
+}
+
+}
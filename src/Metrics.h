@@ -0,0 +1,148 @@
+#ifndef H_27E37B951D0C48AC9CBA07A397853510
+#define H_27E37B951D0C48AC9CBA07A397853510
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Histogram.h"
+
+namespace ws28 {
+	
+	// Why a client was destroyed
+	enum class DestroyReason : uint8_t {
+		User,           // Client::Destroy was called by the application
+		Closed,         // A close frame was sent or received
+		ReadError,      // EOF or read error on the socket
+		WriteError,     // uv_try_write or uv_write failed
+		TLSError,       // The TLS layer failed
+		HTTPRequest,    // A plain HTTP request was answered
+		Rejected,       // A check callback refused the connection, or the handshake was malformed
+		TooLarge,       // The client went over the max message size before completing the handshake
+		ServerShutdown, // Server::DestroyClients
+		Overloaded,     // Shed to stay within Server::SetMemoryBudget
+		
+		Count
+	};
+	
+	namespace metrics {
+		enum { NUM_OPCODES = 16 };
+		
+		// Close codes 1000-1015 have their own slot, everything else goes into the last one
+		enum { NUM_CLOSE_CODES = 17 };
+		inline size_t CloseCodeIndex(uint16_t code){
+			return (code >= 1000 && code < 1016) ? code - 1000 : 16;
+		}
+		
+		enum ID : uint16_t {
+			Accepts,
+			Connects,
+			HandshakesWebSocket,
+			HandshakesAlternative,
+			HandshakesTLS,
+			HandshakesRejected,
+			PartialWrites,
+			WriteEAGAIN,
+			IPConnectionLimitRejects,
+			IPRateLimitRejects,
+			RateLimitDrops,
+			RateLimitDelays,
+			RateLimitCloses,
+			MemoryBudgetRejects,
+			MemoryBudgetPauses,
+			MemoryBudgetDestroys,
+			LingerTimeouts,
+			ConflatedMessages,
+			
+			FramesIn, // + opcode
+			BytesIn = FramesIn + NUM_OPCODES, // + opcode
+			FramesOut = BytesIn + NUM_OPCODES, // + opcode
+			BytesOut = FramesOut + NUM_OPCODES, // + opcode
+			CloseCodesSent = BytesOut + NUM_OPCODES, // + CloseCodeIndex(code)
+			CloseCodesReceived = CloseCodesSent + NUM_CLOSE_CODES, // + CloseCodeIndex(code)
+			Destroys = CloseCodesReceived + NUM_CLOSE_CODES, // + DestroyReason
+			
+			// Gauges, these go up and down
+			Clients = Destroys + (size_t) DestroyReason::Count,
+			QueuedWriteBytes,
+			ClosingClients, // Destroyed, waiting for their socket to close
+			TLSHandshakeJobs, // On the threadpool, see Server::SetAsyncTLSHandshakes
+			
+			COUNT
+		};
+		
+		// Latency histograms, all in nanoseconds
+		enum HistogramID : uint8_t {
+			DataCallbackLatency,   // Time spent inside ClientDataFn
+			HTTPCallbackLatency,   // Time spent inside HTTPRequestFn
+			WriteQueueLatency,     // Time between a write being queued and it reaching the socket
+			HandshakePlainLatency, // Time between accepting the TCP connection and NotifyClientInit
+			HandshakeTLSLatency,   // Same as above, for secure connections
+			
+			NUM_HISTOGRAMS
+		};
+	}
+	
+	struct MetricsSnapshot {
+		uint64_t values[metrics::COUNT] = {};
+		HistogramSnapshot histograms[metrics::NUM_HISTOGRAMS];
+		
+		inline uint64_t Get(size_t id) const { return values[id]; }
+	};
+	
+	// Counters and gauges for a single thread, which in practice means a single loop.
+	// Each slot is only ever written by its own thread, so we don't need locked instructions,
+	// the atomics are only there so that Aggregate can read them from any thread without tearing.
+	class Metrics {
+	public:
+		Metrics(const Metrics &other) = delete;
+		Metrics& operator=(const Metrics &other) = delete;
+		
+		// Metrics of the calling thread. Blocks are created on first use and live forever,
+		// so counters of threads that exited still show up in Aggregate
+		static inline Metrics& Local(){
+			thread_local Metrics *local = nullptr;
+			if(local == nullptr) local = CreateLocal();
+			return *local;
+		}
+		
+		inline void Add(size_t id, uint64_t n = 1){
+			auto &v = m_Values[id];
+			v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+		}
+		
+		inline void Sub(size_t id, uint64_t n = 1){
+			auto &v = m_Values[id];
+			v.store(v.load(std::memory_order_relaxed) - n, std::memory_order_relaxed);
+		}
+		
+		inline uint64_t Get(size_t id) const { return m_Values[id].load(std::memory_order_relaxed); }
+		
+		inline void Record(metrics::HistogramID id, uint64_t nanoseconds){ m_Histograms[id].Record(nanoseconds); }
+		inline const Histogram& GetHistogram(metrics::HistogramID id) const { return m_Histograms[id]; }
+		
+		MetricsSnapshot Snapshot() const;
+		
+		// Sums the metrics of every thread. Safe to call from any thread
+		static MetricsSnapshot Aggregate();
+		
+		// Metrics of every thread, to look at loops individually (e.g. their percentiles).
+		// Safe to call from any thread, the pointers are valid forever
+		static std::vector<const Metrics*> GetAll();
+		
+		// Prometheus text exposition format (version 0.0.4) of Aggregate()
+		static std::string FormatPrometheus();
+		static std::string FormatPrometheus(const MetricsSnapshot &snapshot);
+	
+	private:
+		Metrics() = default;
+		static Metrics* CreateLocal();
+		
+		std::atomic<uint64_t> m_Values[metrics::COUNT] = {};
+		Histogram m_Histograms[metrics::NUM_HISTOGRAMS];
+	};
+
+}
+
+#endif
@@ -0,0 +1,325 @@
+#include "Protocol.h"
+#include "base64.h"
+#include <cstring>
+#include <algorithm>
+
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define WS28_HAS_SSE2
+#endif
+
+namespace ws28 {
+namespace detail {
+
+void Mask(char *dst, const char *src, size_t len, const char *key, size_t keyOffset){
+	char k[4];
+	for(size_t i = 0; i < 4; ++i){
+		k[i] = key[(i + keyOffset) & 3];
+	}
+	
+	size_t i = 0;
+	
+	// Every step here is a multiple of 4, so the key lines up again for the tail
+#ifdef WS28_HAS_SSE2
+	int32_t k32;
+	memcpy(&k32, k, 4);
+	__m128i k128 = _mm_set1_epi32(k32);
+	
+	for(; i + 64 <= len; i += 64){
+		__m128i a = _mm_loadu_si128((const __m128i*) (src + i + 0));
+		__m128i b = _mm_loadu_si128((const __m128i*) (src + i + 16));
+		__m128i c = _mm_loadu_si128((const __m128i*) (src + i + 32));
+		__m128i d = _mm_loadu_si128((const __m128i*) (src + i + 48));
+		_mm_storeu_si128((__m128i*) (dst + i + 0), _mm_xor_si128(a, k128));
+		_mm_storeu_si128((__m128i*) (dst + i + 16), _mm_xor_si128(b, k128));
+		_mm_storeu_si128((__m128i*) (dst + i + 32), _mm_xor_si128(c, k128));
+		_mm_storeu_si128((__m128i*) (dst + i + 48), _mm_xor_si128(d, k128));
+	}
+	
+	for(; i + 16 <= len; i += 16){
+		__m128i a = _mm_loadu_si128((const __m128i*) (src + i));
+		_mm_storeu_si128((__m128i*) (dst + i), _mm_xor_si128(a, k128));
+	}
+#endif
+	
+	uint64_t k64;
+	memcpy((char*) &k64 + 0, k, 4);
+	memcpy((char*) &k64 + 4, k, 4);
+	
+	for(; i + 8 <= len; i += 8){
+		uint64_t v;
+		memcpy(&v, src + i, 8);
+		v ^= k64;
+		memcpy(dst + i, &v, 8);
+	}
+	
+	for(; i < len; ++i){
+		dst[i] = src[i] ^ k[i & 3];
+	}
+}
+
+bool IsValidUTF8(const char *str, size_t len){
+	const uint8_t *data = (const uint8_t*) str;
+	size_t i = 0;
+	
+	while(i < len){
+		// Fast path, skip 8 ASCII bytes at a time
+		if(i + 8 <= len){
+			uint64_t v;
+			memcpy(&v, data + i, 8);
+			if((v & 0x8080808080808080ULL) == 0){
+				i += 8;
+				continue;
+			}
+		}
+		
+		uint8_t c = data[i];
+		if(c < 0x80){
+			++i;
+			continue;
+		}
+		
+		// See table 3-7 of the Unicode standard, the first continuation byte has tighter bounds
+		// for some leading bytes to reject overlong encodings, surrogates, and values past U+10FFFF
+		size_t n;
+		uint8_t lo = 0x80, hi = 0xBF;
+		
+		if(c >= 0xC2 && c <= 0xDF){
+			n = 1;
+		}else if(c >= 0xE0 && c <= 0xEF){
+			n = 2;
+			if(c == 0xE0) lo = 0xA0;
+			if(c == 0xED) hi = 0x9F;
+		}else if(c >= 0xF0 && c <= 0xF4){
+			n = 3;
+			if(c == 0xF0) lo = 0x90;
+			if(c == 0xF4) hi = 0x8F;
+		}else{
+			return false;
+		}
+		
+		if(len - i <= n) return false;
+		if(data[i + 1] < lo || data[i + 1] > hi) return false;
+		
+		for(size_t j = 2; j <= n; ++j){
+			if((data[i + j] & 0xC0) != 0x80) return false;
+		}
+		
+		i += n + 1;
+	}
+	
+	return true;
+}
+
+std::string ComputeAcceptKey(std::string_view key){
+	std::string securityKey = std::string(key);
+	securityKey += "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+	
+	unsigned char hash[20];
+#if OPENSSL_VERSION_NUMBER <= 0x030000000L
+	SHA_CTX sha1;
+	SHA1_Init(&sha1);
+	SHA1_Update(&sha1, securityKey.data(), securityKey.size());
+	SHA1_Final(hash, &sha1);
+#else
+	EVP_MD_CTX *sha1 = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(sha1, EVP_sha1(), NULL);
+	EVP_DigestUpdate(sha1, securityKey.data(), securityKey.size());
+	EVP_DigestFinal_ex(sha1, hash, NULL);
+	EVP_MD_CTX_free(sha1);
+#endif
+	
+	return base64_encode(hash, sizeof(hash));
+}
+
+bool ParseHTTPHeaders(std::string_view headersBuffer, RequestHeaders &headers){
+	for(;;) {
+		auto nextLine = headersBuffer.find("\r\n");
+		
+		// This means that we have finished parsing the headers
+		if(nextLine == 0) {
+			return true;
+		}
+		
+		// This can't happen... right?
+		if(nextLine == std::string_view::npos) return false;
+		
+		auto colonPos = headersBuffer.find(':');
+		if(colonPos == std::string_view::npos || colonPos > nextLine) return false;
+		
+		auto key = headersBuffer.substr(0, colonPos);
+		
+		// Key to lower case
+		std::transform(key.begin(), key.end(), (char*) key.data(), [](char v) -> char {
+			if(v < 0 || v >= 127) return v;
+			return tolower(v);
+		});
+		
+		auto value = headersBuffer.substr(colonPos + 1, nextLine - (colonPos + 1));
+		
+		// Trim spaces
+		while(!key.empty() && key.front() == ' ') key.remove_prefix(1);
+		while(!key.empty() && key.back() == ' ') key.remove_suffix(1);
+		while(!value.empty() && value.front() == ' ') value.remove_prefix(1);
+		while(!value.empty() && value.back() == ' ') value.remove_suffix(1);
+		
+		headers.Set(key, value);
+		
+		headersBuffer = headersBuffer.substr(nextLine+2);
+	}
+}
+
+bool ParseURL(std::string_view url, URL &out){
+	if(url.substr(0, 5) == "ws://"){
+		out.secure = false;
+		url.remove_prefix(5);
+	}else if(url.substr(0, 6) == "wss://"){
+		out.secure = true;
+		url.remove_prefix(6);
+	}else{
+		return false;
+	}
+	
+	auto pathStart = url.find_first_of("/?#");
+	auto authority = url.substr(0, pathStart);
+	
+	out.path = pathStart == std::string_view::npos ? "/" : std::string(url.substr(pathStart));
+	if(out.path[0] != '/') out.path.insert(out.path.begin(), '/');
+	
+	// Fragments are never sent
+	auto fragment = out.path.find('#');
+	if(fragment != std::string::npos) out.path.resize(fragment);
+	
+	std::string_view host;
+	std::string_view port;
+	
+	if(!authority.empty() && authority.front() == '['){
+		// IPv6 literal
+		auto end = authority.find(']');
+		if(end == std::string_view::npos) return false;
+		
+		host = authority.substr(1, end - 1);
+		authority.remove_prefix(end + 1);
+		
+		if(!authority.empty()){
+			if(authority.front() != ':') return false;
+			port = authority.substr(1);
+		}
+	}else{
+		auto colon = authority.find(':');
+		host = authority.substr(0, colon);
+		if(colon != std::string_view::npos) port = authority.substr(colon + 1);
+	}
+	
+	if(host.empty()) return false;
+	out.host = std::string(host);
+	
+	if(port.empty()){
+		out.port = out.secure ? 443 : 80;
+	}else{
+		int v = 0;
+		for(char c : port){
+			if(c < '0' || c > '9') return false;
+			v = v * 10 + (c - '0');
+			if(v > 65535) return false;
+		}
+		
+		if(v == 0) return false;
+		out.port = v;
+	}
+	
+	return true;
+}
+
+bool ParseIPAddress(std::string_view text, struct sockaddr_storage &addr){
+	// uv_inet_pton wants a null terminated string
+	char buf[64];
+	if(text.empty() || text.size() >= sizeof(buf)) return false;
+	memcpy(buf, text.data(), text.size());
+	buf[text.size()] = '\0';
+	
+	memset(&addr, 0, sizeof(addr));
+	
+	auto v4 = (struct sockaddr_in*) &addr;
+	if(uv_inet_pton(AF_INET, buf, &v4->sin_addr) == 0){
+		v4->sin_family = AF_INET;
+		return true;
+	}
+	
+	auto v6 = (struct sockaddr_in6*) &addr;
+	if(uv_inet_pton(AF_INET6, buf, &v6->sin6_addr) == 0){
+		v6->sin6_family = AF_INET6;
+		return true;
+	}
+	
+	return false;
+}
+
+int ParseProxyHeader(const char *data, size_t len, struct sockaddr_storage &addr){
+	static const char v2Signature[12] = { '\r', '\n', '\r', '\n', '\0', '\r', '\n', 'Q', 'U', 'I', 'T', '\n' };
+	static const char v1Prefix[6] = { 'P', 'R', 'O', 'X', 'Y', ' ' };
+	enum { V1_MAX_SIZE = 107 };
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.ss_family = AF_UNSPEC;
+	
+	if(len == 0) return 0;
+	
+	if(data[0] == '\r'){
+		if(memcmp(data, v2Signature, std::min(len, sizeof(v2Signature))) != 0) return -1;
+		if(len < 16) return 0;
+		
+		auto p = (const uint8_t*) data;
+		if((p[12] >> 4) != 2) return -1;
+		
+		uint8_t command = p[12] & 0x0F;
+		if(command > 1) return -1;
+		
+		size_t size = 16 + (((size_t) p[14] << 8) | p[15]);
+		if(len < size) return 0;
+		
+		// LOCAL means the proxy itself connected (health checks), it doesn't speak for anyone
+		if(command == 0) return (int) size;
+		
+		// Only the source address matters to us, everything after it (destination, ports, TLVs) is skipped
+		uint8_t family = p[13] >> 4;
+		if(family == 1 && size >= 16 + 12){
+			auto v4 = (struct sockaddr_in*) &addr;
+			v4->sin_family = AF_INET;
+			memcpy(&v4->sin_addr, p + 16, 4);
+		}else if(family == 2 && size >= 16 + 36){
+			auto v6 = (struct sockaddr_in6*) &addr;
+			v6->sin6_family = AF_INET6;
+			memcpy(&v6->sin6_addr, p + 16, 16);
+		}
+		
+		return (int) size;
+	}
+	
+	if(memcmp(data, v1Prefix, std::min(len, sizeof(v1Prefix))) != 0) return -1;
+	
+	std::string_view header(data, std::min(len, (size_t) V1_MAX_SIZE));
+	auto end = header.find("\r\n");
+	if(end == std::string_view::npos) return len >= V1_MAX_SIZE ? -1 : 0;
+	if(end < sizeof(v1Prefix)) return -1;
+	
+	// PROXY TCP4 <source> <destination> <source port> <destination port>
+	std::string_view line = header.substr(sizeof(v1Prefix), end - sizeof(v1Prefix));
+	
+	auto space = line.find(' ');
+	auto protocol = line.substr(0, space);
+	
+	if(protocol == "UNKNOWN") return (int) end + 2;
+	if((protocol != "TCP4" && protocol != "TCP6") || space == std::string_view::npos) return -1;
+	
+	line = line.substr(space + 1);
+	if(!ParseIPAddress(line.substr(0, line.find(' ')), addr)) return -1;
+	
+	return (int) end + 2;
+}
+
+}
+}
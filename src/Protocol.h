@@ -0,0 +1,206 @@
+#ifndef H_A10AB834203A4B2BBCCED9B5CAA2DB89
+#define H_A10AB834203A4B2BBCCED9B5CAA2DB89
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <uv.h>
+
+#include "Headers.h"
+
+namespace ws28 {
+	namespace detail {
+		struct DataFrameHeader {
+			char *data;
+		
+			DataFrameHeader(char *data) : data(data){
+		
+			}
+		
+			void reset(){
+				data[0] = 0;
+				data[1] = 0;
+			}
+		
+			void fin(bool v) { data[0] &= ~(1 << 7); data[0] |= v << 7; }
+			void rsv1(bool v) { data[0] &= ~(1 << 6); data[0] |= v << 6; }
+			void rsv2(bool v) { data[0] &= ~(1 << 5); data[0] |= v << 5; }
+			void rsv3(bool v) { data[0] &= ~(1 << 4); data[0] |= v << 4; }
+			void mask(bool v) { data[1] &= ~(1 << 7); data[1] |= v << 7; }
+			void opcode(uint8_t v) {
+				data[0] &= ~0x0F;
+				data[0] |= v & 0x0F;
+			}
+		
+			void len(uint8_t v) {
+				data[1] &= ~0x7F;
+				data[1] |= v & 0x7F;
+			}
+		
+			bool fin() { return (data[0] >> 7) & 1; }
+			bool rsv1() { return (data[0] >> 6) & 1; }
+			bool rsv2() { return (data[0] >> 5) & 1; }
+			bool rsv3() { return (data[0] >> 4) & 1; }
+			bool mask() { return (data[1] >> 7) & 1; }
+		
+			uint8_t opcode() {
+				return data[0] & 0x0F;
+			}
+		
+			uint8_t len() {
+				return data[1] & 0x7F;
+			}
+		};
+		
+		inline size_t GetDataFrameHeaderSize(size_t len, bool masked = false){
+			size_t maskSize = masked ? 4 : 0;
+			
+			if(len >= 126){
+				if(len > UINT16_MAX){
+					return 10 + maskSize;
+				}else{
+					return 4 + maskSize;
+				}
+			}else{
+				return 2 + maskSize;
+			}
+		}
+		
+		// Writes a header for a final frame. out must have room for GetDataFrameHeaderSize(len, maskKey != nullptr) bytes
+		inline void WriteDataFrameHeader(uint8_t opcode, size_t len, char *headerStart, const char *maskKey = nullptr){
+			DataFrameHeader header{ headerStart };
+			
+			header.reset();
+			header.fin(true);
+			header.opcode(opcode);
+			header.mask(maskKey != nullptr);
+			header.rsv1(false);
+			header.rsv2(false);
+			header.rsv3(false);
+			if(len >= 126){
+				if(len > UINT16_MAX){
+					header.len(127);
+					*(uint8_t*)(headerStart + 2) = ((uint64_t) len >> 56) & 0xFF;
+					*(uint8_t*)(headerStart + 3) = ((uint64_t) len >> 48) & 0xFF;
+					*(uint8_t*)(headerStart + 4) = ((uint64_t) len >> 40) & 0xFF;
+					*(uint8_t*)(headerStart + 5) = ((uint64_t) len >> 32) & 0xFF;
+					*(uint8_t*)(headerStart + 6) = (len >> 24) & 0xFF;
+					*(uint8_t*)(headerStart + 7) = (len >> 16) & 0xFF;
+					*(uint8_t*)(headerStart + 8) = (len >> 8) & 0xFF;
+					*(uint8_t*)(headerStart + 9) = (len >> 0) & 0xFF;
+				}else{
+					header.len(126);
+					*(uint8_t*)(headerStart + 2) = (len >> 8) & 0xFF;
+					*(uint8_t*)(headerStart + 3) = (len >> 0) & 0xFF;
+				}
+			}else{
+				header.len(len);
+			}
+			
+			if(maskKey != nullptr){
+				memcpy(headerStart + GetDataFrameHeaderSize(len), maskKey, 4);
+			}
+		}
+		
+		// Reads the payload length and mask key of the frame starting at data, which must have at least 2 bytes.
+		// Returns the size of the whole header (including the mask key), or 0 if we don't have all of it yet
+		inline size_t ParseDataFrameHeader(const char *data, size_t len, uint64_t &frameLength, const char *&maskKey){
+			DataFrameHeader header((char*) data);
+			
+			const uint8_t *curPosition = (const uint8_t*) data + 2;
+			
+			frameLength = header.len();
+			if(frameLength == 126){
+				if(len < 4) return 0;
+				frameLength = (curPosition[0] << 8) | curPosition[1];
+				curPosition += 2;
+			}else if(frameLength == 127){
+				if(len < 10) return 0;
+				
+				frameLength = ((uint64_t) curPosition[0] << 56) | ((uint64_t) curPosition[1] << 48)
+					| ((uint64_t) curPosition[2] << 40) | ((uint64_t) curPosition[3] << 32)
+					| ((uint64_t) curPosition[4] << 24) | ((uint64_t) curPosition[5] << 16)
+					| ((uint64_t) curPosition[6] << 8) | ((uint64_t) curPosition[7] << 0);
+				
+				curPosition += 8;
+			}
+			
+			maskKey = nullptr;
+			if(header.mask()){
+				if(len < (size_t) ((const char*) curPosition - data) + 4) return 0;
+				maskKey = (const char*) curPosition;
+				curPosition += 4;
+			}
+			
+			return (const char*) curPosition - data;
+		}
+		
+		// XORs len bytes of src with the 4 byte masking key and writes them to dst (which can be the same as src).
+		// keyOffset is the position in the key of the first byte, for payloads that are masked in pieces
+		void Mask(char *dst, const char *src, size_t len, const char *key, size_t keyOffset = 0);
+		
+		// Validates UTF-8 as defined by RFC 3629 (no overlong encodings, surrogates, or code points past U+10FFFF)
+		bool IsValidUTF8(const char *data, size_t len);
+		
+		// Sec-WebSocket-Accept value for a Sec-WebSocket-Key
+		std::string ComputeAcceptKey(std::string_view key);
+		
+		// Parses header lines until (and including) the empty line that ends them.
+		// Keys are lower cased in place, so the buffer must be writable.
+		// Returns false if they're malformed
+		bool ParseHTTPHeaders(std::string_view buffer, RequestHeaders &headers);
+		
+		struct URL {
+			bool secure;
+			std::string host;
+			int port;
+			std::string path;
+		};
+		
+		// Parses ws:// and wss:// URLs
+		bool ParseURL(std::string_view url, URL &out);
+		
+		enum { MAX_VARINT_SIZE = 10 };
+		
+		// LEB128, like captures. out needs MAX_VARINT_SIZE bytes, returns how many were used
+		inline size_t WriteVarint(uint64_t v, char *out){
+			size_t n = 0;
+			
+			do {
+				uint8_t b = v & 0x7F;
+				v >>= 7;
+				if(v != 0) b |= 0x80;
+				out[n++] = (char) b;
+			} while(v != 0);
+			
+			return n;
+		}
+		
+		// Returns how many bytes it took, 0 if we don't have all of it yet, or -1 if it's longer than maxSize bytes
+		inline int ReadVarint(const char *data, size_t len, uint64_t &v, size_t maxSize = MAX_VARINT_SIZE){
+			v = 0;
+			
+			for(size_t i = 0; i < maxSize; ++i){
+				if(i >= len) return 0;
+				
+				uint8_t b = (uint8_t) data[i];
+				v |= (uint64_t) (b & 0x7F) << (i * 7);
+				if((b & 0x80) == 0) return (int) i + 1;
+			}
+			
+			return -1;
+		}
+		
+		// Parses a textual IPv4 or IPv6 address (no port)
+		bool ParseIPAddress(std::string_view text, struct sockaddr_storage &addr);
+		
+		// PROXY protocol header (v1 text or v2 binary), which proxies send before anything else to tell us who the client is.
+		// Returns its size, 0 if we don't have all of it yet, or -1 if it isn't one.
+		// addr is the client's address, AF_UNSPEC if the proxy didn't give one (health checks, UNKNOWN or non IP connections)
+		int ParseProxyHeader(const char *data, size_t len, struct sockaddr_storage &addr);
+	}
+}
+
+#endif
@@ -0,0 +1,34 @@
+#include "PubSub.h"
+#include <algorithm>
+
+namespace ws28 {
+
+void PubSubGroup::Publish(std::string_view topic, const char *data, size_t len, uint8_t opcode){
+	auto msg = std::make_shared<detail::PublishedMessage>();
+	msg->topic = std::string(topic);
+	msg->data.assign(data, data + len);
+	msg->opcode = opcode;
+	
+	std::lock_guard<std::mutex> lock{m_Mutex};
+	
+	for(auto inbox : m_Inboxes){
+		{
+			std::lock_guard<std::mutex> inboxLock{inbox->mutex};
+			inbox->messages.push_back(msg);
+		}
+		
+		uv_async_send(&inbox->async);
+	}
+}
+
+void PubSubGroup::Add(detail::PublishInbox *inbox){
+	std::lock_guard<std::mutex> lock{m_Mutex};
+	m_Inboxes.push_back(inbox);
+}
+
+void PubSubGroup::Remove(detail::PublishInbox *inbox){
+	std::lock_guard<std::mutex> lock{m_Mutex};
+	m_Inboxes.erase(std::remove(m_Inboxes.begin(), m_Inboxes.end(), inbox), m_Inboxes.end());
+}
+
+}
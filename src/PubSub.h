@@ -0,0 +1,90 @@
+#ifndef H_3F7EC4E32130433389691F3F9CB6752D
+#define H_3F7EC4E32130433389691F3F9CB6752D
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <uv.h>
+
+namespace ws28 {
+	class Client;
+	class Server;
+	
+	namespace detail {
+		struct Topic;
+		
+		// Each side knows where the other one is, so unsubscribing is a swap and pop on both
+		struct Subscriber {
+			Client *client;
+			uint32_t index; // In client->m_Subscriptions
+		};
+		
+		struct Subscription {
+			Topic *topic;
+			uint32_t index; // In topic->subscribers
+		};
+		
+		struct Topic {
+			std::string name;
+			std::vector<Subscriber> subscribers;
+			int publishing = 0; // Topics aren't erased while we're publishing to them
+		};
+		
+		// A frame encoded once by Server::Publish and written to every subscriber
+		struct EncodedFrame {
+			uint8_t opcode;
+			const char *data;
+			size_t len;
+			
+			char header[14];
+			size_t headerLen;
+			
+			// Header and payload together, built the first time a TLS client needs it so it ends up in a single record
+			std::vector<char> contiguous;
+		};
+		
+		struct PublishedMessage {
+			std::string topic;
+			std::vector<char> data;
+			uint8_t opcode;
+		};
+		
+		struct PublishInbox {
+			uv_async_t async;
+			Server *server;
+			
+			std::mutex mutex;
+			std::vector<std::shared_ptr<const PublishedMessage>> messages;
+		};
+	}
+	
+	// Lets servers running on different loops (usually one per thread) publish to each other's subscribers.
+	// Servers join with Server::JoinGroup, and each of them fans the message out on its own loop.
+	// The group must outlive its servers
+	class PubSubGroup {
+	public:
+		PubSubGroup(){}
+		PubSubGroup(const PubSubGroup &other) = delete;
+		PubSubGroup& operator=(const PubSubGroup &other) = delete;
+		
+		// Can be called from any thread. The message is copied once and shared by every server in the group,
+		// which publish it asynchronously (including the one on the calling thread, if any)
+		void Publish(std::string_view topic, const char *data, size_t len, uint8_t opcode = 2);
+	
+	private:
+		void Add(detail::PublishInbox *inbox);
+		void Remove(detail::PublishInbox *inbox);
+		
+		std::mutex m_Mutex;
+		std::vector<detail::PublishInbox*> m_Inboxes;
+		
+		friend class Server;
+	};
+
+}
+
+#endif
@@ -1,12 +1,75 @@
 #include "Server.h"
+#include "ClientFrames.h"
+#include <openssl/rand.h>
 
 #ifndef _WIN32
 #include <signal.h>
+#include <unistd.h>
+#endif
+
+#ifdef WS28_IO_URING
+#include <sys/socket.h>
+#endif
+
+#ifdef __linux__
+#include <linux/filter.h>
+#include <netinet/tcp.h>
 #endif
 
 namespace ws28{
 
-Server::Server(uv_loop_t *loop, SSL_CTX *ctx) : m_pLoop(loop), m_pSSLContext(ctx){
+struct Server::ConnectRequest {
+	Server *server;
+	detail::URL url;
+	SSL_CTX *ctx;
+	void *userData;
+	
+	uv_getaddrinfo_t resolve;
+	uv_connect_t connect;
+	TransportHandle transport;
+	
+	// Removes us from the server and reports the failure, if the server still exists
+	void Fail(){
+		if(server == nullptr) return;
+		server->m_ConnectRequests.erase(std::find(server->m_ConnectRequests.begin(), server->m_ConnectRequests.end(), this));
+		server->NotifyConnectFailed(userData);
+	}
+};
+
+namespace {
+	uint64_t RandomSeed(){
+		uint64_t v;
+		if(RAND_bytes((unsigned char*) &v, sizeof(v)) != 1) v = uv_hrtime();
+		return v;
+	}
+	
+	// See ListenOptions::reuseportGroupSize. The program belongs to the whole reuseport group, and it has to be
+	// attached once the socket is listening, otherwise it gets a group of its own and the next bind fails
+	void SteerByCPU(uv_handle_t *server, int groupSize){
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+		uv_os_fd_t fd;
+		if(groupSize <= 0 || uv_fileno(server, &fd) != 0) return;
+		
+		// return cpu % groupSize
+		struct sock_filter code[] = {
+			{ BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t) (SKF_AD_OFF + SKF_AD_CPU) },
+			{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t) groupSize },
+			{ BPF_RET | BPF_A, 0, 0, 0 },
+		};
+		
+		struct sock_fprog prog;
+		prog.len = sizeof(code) / sizeof(code[0]);
+		prog.filter = code;
+		setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+#else
+		(void) server;
+		(void) groupSize;
+#endif
+	}
+}
+
+Server::Server(uv_loop_t *loop, SSL_CTX *ctx) : m_pLoop(loop), m_pSSLContext(ctx), m_IPs(RandomSeed()){
+	m_fnParseFrames = &Client::ParseFramesWith<detail::FunctionPointerDispatch>;
 
 	m_fnCheckConnection = [](Client*, HTTPRequest &req) -> bool {
 		auto host = req.headers.Get("host");
@@ -21,7 +84,15 @@ Server::Server(uv_loop_t *loop, SSL_CTX *ctx) : m_pLoop(loop), m_pSSLContext(ctx
 }
 
 bool Server::Listen(int port, bool ipv4Only){
-	if(m_Server) return false;
+	ListenOptions options;
+	options.ipv4Only = ipv4Only;
+	return Listen(port, options);
+}
+
+bool Server::Listen(int port, const ListenOptions &options){
+	if(m_Server || m_UnixServer) return false;
+	
+	bool ipv4Only = options.ipv4Only;
 	
 #ifndef _WIN32
 	signal(SIGPIPE, SIG_IGN);
@@ -55,53 +126,606 @@ bool Server::Listen(int port, bool ipv4Only){
 		return false;
 	}
 	
-	if(uv_listen((uv_stream_t*) server.get(), 512, [](uv_stream_t* server, int status){
+	return StartListening(std::move(server), options);
+}
+
+bool Server::ListenUnix(const char *path, int backlog){
+	if(m_Server || m_UnixServer) return false;
+	
+#ifndef _WIN32
+	signal(SIGPIPE, SIG_IGN);
+	
+	// Probably left over from the last time we ran
+	unlink(path);
+#endif
+	
+	auto server = PipeHandle{new uv_pipe_t};
+	uv_pipe_init(m_pLoop, server.get(), 0);
+	server->data = this;
+	
+	if(uv_pipe_bind(server.get(), path) != 0) return false;
+	
+	return StartListening(std::move(server), backlog);
+}
+
+#ifndef _WIN32
+bool Server::ListenFromFd(int fd, const ListenOptions &options){
+	if(m_Server || m_UnixServer){
+		close(fd);
+		return false;
+	}
+	
+	signal(SIGPIPE, SIG_IGN);
+	
+	struct sockaddr_storage addr;
+	socklen_t addrLen = sizeof(addr);
+	if(getsockname(fd, (struct sockaddr*) &addr, &addrLen) == 0 && addr.ss_family == AF_UNIX){
+		auto server = PipeHandle{new uv_pipe_t};
+		uv_pipe_init(m_pLoop, server.get(), 0);
+		server->data = this;
+		
+		if(uv_pipe_open(server.get(), fd) != 0){
+			close(fd);
+			return false;
+		}
+		
+		return StartListening(std::move(server), options.backlog);
+	}
+	
+	auto server = SocketHandle{new uv_tcp_t};
+	uv_tcp_init(m_pLoop, server.get());
+	server->data = this;
+	
+	// The handle closes it from here on, but it doesn't have it if this fails
+	if(uv_tcp_open(server.get(), (uv_os_sock_t) fd) != 0){
+		close(fd);
+		return false;
+	}
+	
+	uv_tcp_nodelay(server.get(), (int) true);
+	return StartListening(std::move(server), options);
+}
+
+int Server::GetListenFd() const {
+	uv_os_fd_t fd;
+	if(m_Server && uv_fileno((uv_handle_t*) m_Server.get(), &fd) == 0) return fd;
+	if(m_UnixServer && uv_fileno((uv_handle_t*) m_UnixServer.get(), &fd) == 0) return fd;
+	return -1;
+}
+#endif
+
+bool Server::StartListening(SocketHandle server, const ListenOptions &options){
+#ifndef _WIN32
+	uv_os_fd_t fd;
+	if(uv_fileno((uv_handle_t*) server.get(), &fd) != 0) return false;
+#endif
+	
+	// These are all hints, if the kernel doesn't support one we listen without it
+#if defined(TCP_DEFER_ACCEPT)
+	if(options.deferAcceptSeconds > 0){
+		setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &options.deferAcceptSeconds, sizeof(int));
+	}
+#endif
+	
+#if defined(TCP_FASTOPEN) && !defined(_WIN32)
+	if(options.fastOpenQueue > 0){
+		setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &options.fastOpenQueue, sizeof(int));
+	}
+#endif
+	
+#if defined(SO_INCOMING_CPU)
+	if(options.incomingCPU >= 0){
+		setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &options.incomingCPU, sizeof(int));
+	}
+#endif
+	
+#ifdef WS28_IO_URING
+	if(m_bUseIOUring && !m_IOUring) m_IOUring = detail::IOUring::Create(m_pLoop);
+	
+	if(m_IOUring){
+		// The socket stays a libuv handle so StopListening closes it the same way, but the ring does the accepting
+		if(listen(fd, options.backlog) != 0) return false;
+		
+		m_pAcceptor = new detail::IOUringAcceptor(m_IOUring, fd, [](void *userData, int fd){
+			auto server = (Server*) userData;
+			server->OnAccepted(new detail::IOUringTransport(server->m_IOUring, fd));
+		}, this);
+		
+		SteerByCPU((uv_handle_t*) server.get(), options.reuseportGroupSize);
+		m_Server = std::move(server);
+		return true;
+	}
+#endif
+	
+	if(uv_listen((uv_stream_t*) server.get(), options.backlog, [](uv_stream_t* server, int status){
 		((Server*) server->data)->OnConnection(server, status);
 	}) != 0){
 		return false;
 	}
 	
+	SteerByCPU((uv_handle_t*) server.get(), options.reuseportGroupSize);
 	m_Server = std::move(server);
 	return true;
 }
 
+bool Server::StartListening(PipeHandle server, int backlog){
+	if(uv_listen((uv_stream_t*) server.get(), backlog, [](uv_stream_t* server, int status){
+		((Server*) server->data)->OnConnection(server, status);
+	}) != 0){
+		return false;
+	}
+	
+	m_UnixServer = std::move(server);
+	return true;
+}
+
 void Server::StopListening(){
+	m_UnixServer.reset();
+	
 	// Just in case we have more logic in the future
 	if(!m_Server) return;
 	
+#ifdef WS28_IO_URING
+	if(m_pAcceptor != nullptr){
+		m_pAcceptor->Stop();
+		m_pAcceptor = nullptr;
+	}
+	
+	// So the loop can close once the clients that still use it are gone
+	m_IOUring.reset();
+#endif
+	
 	m_Server.reset();
 }
 
 void Server::DestroyClients(){
 	// Clients will erase themselves from this vector
 	while(!m_Clients.empty()){
-		m_Clients.back()->Destroy();
+		m_Clients.back()->Destroy(DestroyReason::ServerShutdown);
 	}
 }
 
 Server::~Server(){
 	StopListening();
+	LeaveGroup();
 	DestroyClients();
+	
+	// Connections still resolving or connecting clean themselves up when their callback fires
+	for(auto req : m_ConnectRequests){
+		req->server = nullptr;
+	}
+}
+
+bool Server::Connect(std::string_view url, void *userData, SSL_CTX *clientCtx){
+	auto req = std::make_unique<ConnectRequest>();
+	if(!detail::ParseURL(url, req->url)) return false;
+	if(req->url.secure && clientCtx == nullptr) return false;
+	
+#ifndef _WIN32
+	signal(SIGPIPE, SIG_IGN);
+#endif
+	
+	req->server = this;
+	req->ctx = clientCtx;
+	req->userData = userData;
+	req->resolve.data = req.get();
+	req->connect.data = req.get();
+	
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	
+	auto port = std::to_string(req->url.port);
+	
+	if(uv_getaddrinfo(m_pLoop, &req->resolve, [](uv_getaddrinfo_t *resolve, int status, struct addrinfo *res){
+		std::unique_ptr<ConnectRequest> req{(ConnectRequest*) resolve->data};
+		
+		if(status < 0 || req->server == nullptr){
+			if(res) uv_freeaddrinfo(res);
+			return req->Fail();
+		}
+		
+		auto transport = new detail::TCPTransport(req->server->m_pLoop);
+		transport->SetDefaultOptions();
+		if(req->server->m_iNotSentLowWatermark != 0) transport->SetNotSentLowWatermark(req->server->m_iNotSentLowWatermark);
+		req->transport.reset(transport);
+		
+		int r = uv_tcp_connect(&req->connect, transport->GetSocket(), res->ai_addr, [](uv_connect_t *connect, int status){
+			std::unique_ptr<ConnectRequest> req{(ConnectRequest*) connect->data};
+			if(status < 0 || req->server == nullptr) return req->Fail();
+			
+			auto server = req->server;
+			server->m_ConnectRequests.erase(std::find(server->m_ConnectRequests.begin(), server->m_ConnectRequests.end(), req.get()));
+			server->OnOutgoingConnection(req.get(), std::move(req->transport));
+		});
+		
+		uv_freeaddrinfo(res);
+		
+		if(r != 0) return req->Fail();
+		
+		// Now owned by the connect callback
+		req.release();
+	}, req->url.host.c_str(), port.c_str(), &hints) != 0){
+		return false;
+	}
+	
+	m_ConnectRequests.push_back(req.release());
+	return true;
+}
+
+void Server::OnOutgoingConnection(ConnectRequest *req, TransportHandle transport){
+	Metrics::Local().Add(metrics::Connects);
+	
+	auto client = new Client(this, std::move(transport));
+	m_Clients.emplace_back(client);
+	
+	client->SetUserData(req->userData);
+	client->StartOutgoingHandshake(req->url, req->ctx);
+}
+
+void Server::GenerateMaskKey(char *out){
+	if(m_iMaskKeyPoolOffset + 4 > sizeof(m_MaskKeyPool)){
+		RAND_bytes(m_MaskKeyPool, sizeof(m_MaskKeyPool));
+		m_iMaskKeyPoolOffset = 0;
+	}
+	
+	memcpy(out, m_MaskKeyPool + m_iMaskKeyPoolOffset, 4);
+	m_iMaskKeyPoolOffset += 4;
 }
 
 void Server::OnConnection(uv_stream_t* server, int status){
 	if(status < 0) return;
 	
-	SocketHandle socket{new uv_tcp_t};
-	uv_tcp_init(m_pLoop, socket.get());
+	Transport *transport;
+	uv_stream_t *socket;
+	
+	if(server->type == UV_NAMED_PIPE){
+		auto pipe = new detail::PipeTransport(m_pLoop);
+		transport = pipe;
+		socket = (uv_stream_t*) pipe->GetSocket();
+	}else{
+		auto tcp = new detail::TCPTransport(m_pLoop);
+		transport = tcp;
+		socket = (uv_stream_t*) tcp->GetSocket();
+	}
+	
+	if(uv_accept(server, socket) != 0){
+		transport->Release();
+		return;
+	}
+	
+	OnAccepted(transport);
+}
+
+void Server::SetRealIPHeader(std::string_view name){
+	m_RealIPHeader = name;
+	std::transform(m_RealIPHeader.begin(), m_RealIPHeader.end(), m_RealIPHeader.begin(), [](char c) -> char{
+		if(c < 0 || c >= 127) return c;
+		return tolower(c);
+	});
+}
+
+#ifdef WS28_IO_URING
+bool Server::SetUseIOUring(bool v){
+	assert(!m_Server);
+	
+	m_bUseIOUring = v;
+	if(!v) return true;
+	
+	// Created here to find out whether it works, Listen creates it again if it's gone
+	if(!m_IOUring) m_IOUring = detail::IOUring::Create(m_pLoop);
+	if(!m_IOUring) m_bUseIOUring = false;
+	
+	return m_bUseIOUring;
+}
+#endif
+
+void Server::OnAccepted(Transport *transport){
+	Metrics::Local().Add(metrics::Accepts);
+	
+	// Check the limits before anything else, so floods are cheap
+	if(IsOverMemoryBudget()){
+		Metrics::Local().Add(metrics::MemoryBudgetRejects);
+		transport->Release();
+		return;
+	}
+	
+	detail::IPKey key;
+	bool limited = false;
+	if((m_iMaxConnectionsPerIP != 0 || m_iMaxConnectionRatePerIP != 0) && !IsBehindProxy()){
+		struct sockaddr_storage addr;
+		limited = transport->GetPeerAddress(addr) && detail::IPKey::FromAddress((struct sockaddr*) &addr, key);
+		
+		if(limited && !AdmitIP(key)){
+			transport->Release();
+			return;
+		}
+	}
+	
+	// Default to true since that's what most people want
+	transport->SetDefaultOptions();
+	if(m_iNotSentLowWatermark != 0) transport->SetNotSentLowWatermark(m_iNotSentLowWatermark);
+	
+	auto client = AddClient(transport);
+	if(!limited) return;
+	
+	if(client != nullptr){
+		client->m_IPKey = key;
+		client->m_bCountedIP = true;
+	}else{
+		ReleaseIP(key);
+	}
+}
+
+bool Server::AdmitIP(const detail::IPKey &key){
+	uint64_t now = uv_now(m_pLoop);
+	
+	// Entries stay around after their last connection to remember the rate, get rid of the ones that don't matter anymore
+	if(m_IPs.Size() >= m_iIPSweepSize){
+		m_IPs.EraseIf([&](const IPState &state){
+			return state.connections == 0 && (m_iMaxConnectionRatePerIP == 0 || IsRateWindowOver(state, now));
+		});
+		
+		m_iIPSweepSize = std::max((size_t) 1024, m_IPs.Size() * 2);
+	}
+	
+	auto &state = m_IPs.Get(key);
+	
+	if(m_iMaxConnectionsPerIP != 0 && state.connections >= m_iMaxConnectionsPerIP){
+		Metrics::Local().Add(metrics::IPConnectionLimitRejects);
+		return false;
+	}
+	
+	if(m_iMaxConnectionRatePerIP != 0){
+		if(IsRateWindowOver(state, now)){
+			state.windowStart = now;
+			state.recentConnections = 0;
+		}
+		
+		if(state.recentConnections >= m_iMaxConnectionRatePerIP){
+			Metrics::Local().Add(metrics::IPRateLimitRejects);
+			return false;
+		}
+		
+		++state.recentConnections;
+	}
+	
+	++state.connections;
+	return true;
+}
+
+void Server::ReleaseIP(const detail::IPKey &key){
+	auto state = m_IPs.Find(key);
+	assert(state != nullptr && state->connections > 0);
+	if(state == nullptr) return;
+	
+	if(--state->connections == 0 && (m_iMaxConnectionRatePerIP == 0 || IsRateWindowOver(*state, uv_now(m_pLoop)))){
+		m_IPs.Erase(key);
+	}
+}
+
+Client* Server::AddClient(Transport *transport){
+	auto client = new Client(this, TransportHandle{transport});
+	client->m_bWaitingForProxyHeader = m_bProxyProtocol;
+	m_Clients.emplace_back(client);
+	
+	// If for whatever reason uv_tcp_getpeername failed (happens... somehow?)
+	if(!client->m_bHasAddress){
+		client->Destroy(DestroyReason::Rejected);
+		return nullptr;
+	}
+	
+	if(m_pCapture != nullptr){
+		char ip[Client::IP_STRING_SIZE];
+		client->FormatIP(ip);
+		client->m_iCaptureID = m_pCapture->RecordOpen(ip);
+	}
+	
+	return client;
+}
+
+void Server::Subscribe(Client *client, std::string_view topicName){
+	assert(client->GetServer() == this);
+	if(client->GetServer() != this) return;
+	
+	auto it = m_Topics.find(topicName);
+	if(it == m_Topics.end()){
+		auto topic = std::make_unique<detail::Topic>();
+		topic->name = std::string(topicName);
+		
+		std::string_view key = topic->name;
+		it = m_Topics.emplace(key, std::move(topic)).first;
+	}
+	
+	auto &topic = it->second;
+	
+	for(auto &sub : client->m_Subscriptions){
+		if(sub.topic == topic.get()) return;
+	}
+	
+	client->m_Subscriptions.push_back({ topic.get(), (uint32_t) topic->subscribers.size() });
+	topic->subscribers.push_back({ client, (uint32_t) client->m_Subscriptions.size() - 1 });
+}
+
+void Server::Unsubscribe(Client *client, std::string_view topicName){
+	auto it = m_Topics.find(topicName);
+	if(it == m_Topics.end()) return;
+	
+	auto &subs = client->m_Subscriptions;
+	for(size_t i = 0; i < subs.size(); ++i){
+		if(subs[i].topic != it->second.get()) continue;
+		
+		RemoveSubscription(client, i);
+		return;
+	}
+}
+
+void Server::TakeBuffer(std::vector<char> &buffer){
+	if(m_BufferPool.empty()) return;
+	
+	buffer.swap(m_BufferPool.back());
+	m_BufferPool.pop_back();
+}
+
+void Server::ReturnBuffer(std::vector<char> &buffer){
+	// Big ones were for unusual messages, they'd just sit there
+	if(m_BufferPool.size() >= BUFFER_POOL_SIZE || buffer.capacity() > MAX_POOLED_BUFFER_SIZE){
+		std::vector<char>().swap(buffer);
+		return;
+	}
 	
-	socket->data = nullptr;
+	m_BufferPool.emplace_back();
+	m_BufferPool.back().swap(buffer);
+}
 
-	if(uv_accept(server, (uv_stream_t*) socket.get()) == 0){
-		auto client = new Client(this, std::move(socket));
-		m_Clients.emplace_back(client);
+MemoryUsage Server::GetMemoryUsage() const {
+	MemoryUsage usage;
+	usage.clients = m_Clients.size();
+	usage.ipTableBytes = m_IPs.GetMemoryUsage();
+	
+	usage.poolBytes = m_BufferPool.capacity() * sizeof(std::vector<char>);
+	for(auto &buffer : m_BufferPool) usage.poolBytes += buffer.capacity();
+	
+	for(auto &client : m_Clients){
+		usage.clientBytes += sizeof(Client);
+		if(client->m_IPString) usage.clientBytes += strlen(client->m_IPString.get()) + 1;
+		usage.clientBytes += client->m_Subscriptions.capacity() * sizeof(detail::Subscription);
+		usage.clientBytes += client->m_DataBatch.capacity() * sizeof(DataMessage);
+		usage.clientBytes += client->m_WaitingMessages.capacity() * sizeof(Client::WaitingMessage);
+		
+		usage.bufferBytes += client->m_Buffer.capacity() + client->m_FrameBuffer.capacity() + client->m_OutgoingBatch.capacity() + client->m_iAllocatedCapacity;
+		usage.queuedWriteBytes += client->m_iQueuedBytes;
 		
-		// If for whatever reason uv_tcp_getpeername failed (happens... somehow?)
-		if(client->GetIP()[0] == '\0') client->Destroy();
+		if(client->m_Transport){
+			usage.clientBytes += client->m_Transport->GetMemoryUsage();
+			usage.queuedWriteBytes += client->m_Transport->GetQueuedBytes();
+		}
+	}
+	
+	return usage;
+}
+
+void Server::UnsubscribeAll(Client *client){
+	while(!client->m_Subscriptions.empty()){
+		RemoveSubscription(client, client->m_Subscriptions.size() - 1);
 	}
 }
 
+void Server::RemoveSubscription(Client *client, size_t index){
+	auto &subs = client->m_Subscriptions;
+	auto topic = subs[index].topic;
+	uint32_t topicIndex = subs[index].index;
+	
+	// Swap and pop on both sides, fixing the index the other side has of whatever we moved
+	auto &subscribers = topic->subscribers;
+	if(topicIndex != subscribers.size() - 1){
+		subscribers[topicIndex] = subscribers.back();
+		subscribers[topicIndex].client->m_Subscriptions[subscribers[topicIndex].index].index = topicIndex;
+	}
+	subscribers.pop_back();
+	
+	if(index != subs.size() - 1){
+		subs[index] = subs.back();
+		subs[index].topic->subscribers[subs[index].index].index = (uint32_t) index;
+	}
+	subs.pop_back();
+	
+	if(subscribers.empty() && topic->publishing == 0){
+		m_Topics.erase(m_Topics.find(topic->name));
+	}
+}
+
+size_t Server::GetSubscriberCount(std::string_view topicName) const {
+	auto it = m_Topics.find(topicName);
+	if(it == m_Topics.end()) return 0;
+	
+	return it->second->subscribers.size();
+}
+
+void Server::Publish(std::string_view topicName, const char *data, size_t len, uint8_t opcode){
+	auto it = m_Topics.find(topicName);
+	if(it == m_Topics.end()) return;
+	
+	auto topic = it->second.get();
+	
+	auto &frame = m_PublishFrame;
+	frame.opcode = opcode;
+	frame.data = data;
+	frame.len = len;
+	frame.headerLen = detail::GetDataFrameHeaderSize(len);
+	frame.contiguous.clear();
+	detail::WriteDataFrameHeader(opcode, len, frame.header);
+	
+	// Backwards, so a client that gets destroyed while we write to it (and swaps the last one into its place)
+	// doesn't make us skip anyone
+	++topic->publishing;
+	
+	for(size_t i = topic->subscribers.size(); i-- > 0;){
+		if(i >= topic->subscribers.size()) continue;
+		topic->subscribers[i].client->SendEncoded(frame);
+	}
+	
+	--topic->publishing;
+	
+	if(topic->subscribers.empty() && topic->publishing == 0){
+		m_Topics.erase(m_Topics.find(topic->name));
+	}
+}
+
+void Server::JoinGroup(PubSubGroup *group){
+	LeaveGroup();
+	
+	auto inbox = new detail::PublishInbox();
+	inbox->server = this;
+	
+	uv_async_init(m_pLoop, &inbox->async, [](uv_async_t *async){
+		auto inbox = (detail::PublishInbox*) async->data;
+		
+		std::vector<std::shared_ptr<const detail::PublishedMessage>> messages;
+		{
+			std::lock_guard<std::mutex> lock{inbox->mutex};
+			messages.swap(inbox->messages);
+		}
+		
+		for(auto &msg : messages){
+			inbox->server->Publish(msg->topic, msg->data.data(), msg->data.size(), msg->opcode);
+		}
+	});
+	
+	inbox->async.data = inbox;
+	
+	// Being in a group shouldn't keep the loop alive
+	uv_unref((uv_handle_t*) &inbox->async);
+	
+	group->Add(inbox);
+	m_pGroup = group;
+	m_pInbox = inbox;
+}
+
+void Server::LeaveGroup(){
+	if(m_pGroup == nullptr) return;
+	
+	// Once we're out of the group, nobody else touches the inbox
+	m_pGroup->Remove(m_pInbox);
+	
+	uv_close((uv_handle_t*) &m_pInbox->async, [](uv_handle_t *h){
+		delete (detail::PublishInbox*) h->data;
+	});
+	
+	m_pGroup = nullptr;
+	m_pInbox = nullptr;
+}
+
 std::unique_ptr<Client> Server::NotifyClientPreDestroyed(Client *client){
+	UnsubscribeAll(client);
+	
+	if(client->m_bCountedIP){
+		client->m_bCountedIP = false;
+		ReleaseIP(client->m_IPKey);
+	}
+	
 	for(auto it = m_Clients.begin(); it != m_Clients.end(); ++it){
 		if(it->get() == client){
 			std::unique_ptr<Client> r = std::move(*it);
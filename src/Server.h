@@ -3,11 +3,15 @@
 
 #include <memory>
 #include <map>
+#include <unordered_map>
 #include <string>
 #include <string_view>
 #include <cassert>
 
 #include "Client.h"
+#include "Capture.h"
+#include "PubSub.h"
+#include "IOUring.h"
 
 namespace ws28 {
 	class Server;
@@ -16,10 +20,15 @@ namespace ws28 {
 		Server *server;
 		std::string_view method;
 		std::string_view path;
-		std::string_view ip;
+		std::string_view ip; // Only valid during the callback (it used to live as long as the client), see Client::GetIP
 		
 		// Header keys are always lower case
 		const RequestHeaders &headers;
+		
+		Client *client = nullptr;
+		
+		// Yours, e.g. to keep track of a body you're streaming (see Server::SetHTTPBodyCallbacks)
+		void *userData = nullptr;
 	};
 	
 	class HTTPResponse {
@@ -41,6 +50,44 @@ namespace ws28 {
 		friend class Client;
 	};
 	
+	struct ListenOptions {
+		bool ipv4Only = false;
+		int backlog = 512;
+		
+		// Linux: the kernel holds on to connections until they send something (or this many seconds pass),
+		// so connects that never send anything don't wake us up. 0 disables it
+		int deferAcceptSeconds = 0;
+		
+		// TCP Fast Open, lets returning clients send their handshake with the SYN. This is the max
+		// amount of pending fast open connections, 0 disables it
+		int fastOpenQueue = 0;
+		
+		// Linux, for one server per loop listening on the same port (SO_REUSEPORT). Attaches a program that gives each
+		// connection to the socket at index (CPU that received it % reuseportGroupSize), indexes being the order servers
+		// started listening in. Pin loop i to CPU i (and steer NIC queues accordingly), and connections are accepted on the
+		// core that handles their interrupts. 0 leaves it to the kernel's hash
+		int reuseportGroupSize = 0;
+		
+		// Linux: SO_INCOMING_CPU on the listener, the kernel prefers it (in its reuseport group) for connections received on that CPU.
+		// An alternative to the above that doesn't depend on listening order. -1 doesn't set it
+		int incomingCPU = -1;
+	};
+	
+	// What a server and its clients take in memory, as far as we can tell (OpenSSL and the kernel keep their own).
+	// Idle clients only count towards clientBytes, their buffers come from a pool while they're in use
+	struct MemoryUsage {
+		size_t clients = 0;
+		size_t clientBytes = 0; // Clients and their sockets
+		size_t bufferBytes = 0; // Partial messages, outgoing batches and AllocateMessage buffers
+		size_t queuedWriteBytes = 0; // Written, but the socket didn't take it yet
+		size_t poolBytes = 0; // Buffers waiting for a client to need them
+		size_t ipTableBytes = 0; // Per IP limits
+		
+		inline size_t Total() const { return clientBytes + bufferBytes + queuedWriteBytes + poolBytes + ipTableBytes; }
+	};
+	
+	namespace detail { struct FunctionPointerDispatch; }
+	
 	class Server {
 		typedef bool (*CheckTCPConnectionFn)(std::string_view ip, bool secure);
 		typedef bool (*CheckConnectionFn)(Client *, HTTPRequest&);
@@ -48,7 +95,11 @@ namespace ws28 {
 		typedef void (*ClientConnectedFn)(Client *, HTTPRequest&);
 		typedef void (*ClientDisconnectedFn)(Client *);
 		typedef void (*ClientDataFn)(Client *, char *data, size_t len, int opcode);
+		typedef void (*ClientDataBatchFn)(Client *, DataMessage *messages, size_t count);
 		typedef void (*HTTPRequestFn)(HTTPRequest&, HTTPResponse&);
+		typedef size_t (*HTTPBodyStartFn)(HTTPRequest&);
+		typedef void (*HTTPBodyDataFn)(HTTPRequest&, const char *data, size_t len);
+		typedef void (*ConnectFailedFn)(Server *, void *userData);
 	public:
 		
 		// Note: By default, this listens on both ipv4 and ipv6
@@ -60,11 +111,63 @@ namespace ws28 {
 		~Server();
 		
 		bool Listen(int port, bool ipv4Only = false);
+		bool Listen(int port, const ListenOptions &options);
+		
+		// Listens on a Unix domain socket (a named pipe on Windows) instead of a port, for when a proxy on the same machine
+		// sits in front of us. Whatever is at path is replaced. Clients look like they come from 127.0.0.1, unless you use
+		// SetProxyProtocol or SetRealIPHeader. Doesn't use io_uring
+		bool ListenUnix(const char *path, int backlog = 512);
 		void StopListening();
+		
+#ifndef _WIN32
+		// Listens on a socket that's already bound (usually one another process handed us, see Handoff.h), TCP or Unix.
+		// We own fd after this, even if it fails. ipv4Only is ignored, the socket already is whatever it is
+		bool ListenFromFd(int fd, const ListenOptions &options = ListenOptions());
+		
+		// The socket we're listening on, for handing it to another process. -1 if we aren't listening.
+		// It's still ours, the other process gets its own copy
+		int GetListenFd() const;
+#endif
 		void DestroyClients();
 		
+		// Opens a websocket connection to a ws:// or wss:// url on this server's loop.
+		// Outgoing clients go through the same callbacks as the ones we accept: ClientConnected is called once the
+		// server accepts the handshake (the request has the path we asked for and the headers the server answered with),
+		// then ClientData and ClientDisconnected. userData is set on the client before any of those.
+		// If the connection fails before the handshake completes, ConnectFailed is called instead.
+		// wss:// needs a client SSL_CTX (the one we were created with is for accepting connections).
+		// Returns false if the url is invalid
+		bool Connect(std::string_view url, void *userData = nullptr, SSL_CTX *clientCtx = nullptr);
+		
+#ifdef WS28_IO_URING
+		// Accepts and talks to clients through io_uring instead of libuv's epoll loop (Linux 6.0+), see detail::IOUring.
+		// Call it before Listen. Returns false if the kernel doesn't support it, in which case we keep using libuv.
+		// Outgoing connections still use libuv
+		bool SetUseIOUring(bool v);
+#endif
+		
+		// Adds a client that talks over a custom transport (see MemoryTransport), as if we had just accepted it.
+		// The transport is released once the client is gone.
+		// Returns nullptr if the transport has no peer address, the client is destroyed right away in that case
+		Client* AddClient(Transport *transport);
+		
+		// Clients can subscribe to any amount of topics, which only exist while they have subscribers.
+		// Clients are unsubscribed from everything when they're destroyed
+		void Subscribe(Client *client, std::string_view topic);
+		void Unsubscribe(Client *client, std::string_view topic);
+		void UnsubscribeAll(Client *client);
+		size_t GetSubscriberCount(std::string_view topic) const;
+		
+		// Sends a message to every subscriber of topic on this server. The frame is encoded once for all of them
+		void Publish(std::string_view topic, const char *data, size_t len, uint8_t opcode = 2);
+		
+		// Makes this server receive what's published to the group, see PubSubGroup.
+		// A server can only be in one group at a time, and leaves it when destroyed
+		void JoinGroup(PubSubGroup *group);
+		void LeaveGroup();
+		
 		// This callback is called when we know whether a TCP connection wants a secure connection or not,
-		// once we receive the very first byte from the client
+		// once we receive the very first byte from the client. ip is only valid during the callback
 		void SetCheckTCPConnectionCallback(CheckTCPConnectionFn v){ m_fnCheckTCPConnection = v; }
 		
 		// This callback is called when the client is trying to connect using websockets
@@ -72,7 +175,9 @@ namespace ws28 {
 		// It's likely you wanna change this check if your websocket server is in a different domain.
 		void SetCheckConnectionCallback(CheckConnectionFn v){ m_fnCheckConnection = v; }
 		
-		// This is called instead of CheckConnection for connections using the alternative protocol (if enabled)
+		// This is called instead of CheckConnection for connections using the alternative protocol (if enabled).
+		// The version and flags are already known here. Unlike CheckConnection, returning true rejects the client,
+		// and so does not setting it at all
 		void SetCheckAlternativeConnectionCallback(CheckAlternativeConnectionFn v){ m_fnCheckAlternativeConnection = v; }
 		
 		// This callback is called when a client establishes a connection (after websocket handshake)
@@ -89,13 +194,86 @@ namespace ws28 {
 		// Note that both text and binary op codes end up here
 		void SetClientDataCallback(ClientDataFn v){ m_fnClientData = v; }
 		
+		// If set, this is called instead of ClientData with all the messages we parsed from one read (or one TLS record), in order.
+		// They point into our receive buffers without copying, so they're only valid during the callback.
+		// A batch is cut short before a fragmented message is reassembled, and before the client is closed or destroyed
+		void SetClientDataBatchCallback(ClientDataBatchFn v){ m_fnClientDataBatch = v; }
+		
 		// This callback is called when a normal http request is received
 		// If you don't send anything in response, the status code is 404
 		// If you send anything in response without setting a specific status code, it will be 200
 		// Connections that call this callback never lead to a connection
 		void SetHTTPCallback(HTTPRequestFn v){ m_fnHTTPRequest = v;}
 		
+		// Streams request bodies (Content-Length or chunked) instead of ignoring them. Without these, bodies are skipped like before.
+		// start is called once the headers are in, and returns the most bytes you accept for this body (0 refuses it with a 413).
+		// data then gets the body as it arrives, in pieces of any size, followed by one call with len == 0 once it's complete,
+		// after which the HTTP callback answers the request. If the body never completes (e.g. the connection drops or the body
+		// is too large or refused), the last call has data == nullptr instead, and there's no HTTP callback.
+		// Everything in the request stays valid until that last call, put whatever you need in req.userData
+		void SetHTTPBodyCallbacks(HTTPBodyStartFn start, HTTPBodyDataFn data){ m_fnHTTPBodyStart = start; m_fnHTTPBodyData = data; }
+		
+		// This callback is called when an outgoing connection (see Connect) fails before completing the handshake
+		void SetConnectFailedCallback(ConnectFailedFn v){ m_fnConnectFailed = v; }
+		
+		// If set, GET requests to this path are answered with Metrics::FormatPrometheus() (metrics of every loop),
+		// and never reach the HTTP callback. Empty (the default) disables it
+		void SetMetricsPath(std::string_view path){ m_MetricsPath = path; }
+		
+		// Per IP limits, checked right after accepting a connection, before we allocate anything else for it.
+		// IPv6 addresses count as their /64. Outgoing connections and AddClient don't count. 0 disables them (the default)
+		inline void SetMaxConnectionsPerIP(uint32_t v){ m_iMaxConnectionsPerIP = v; }
+		
+		// At most count new connections from the same IP every periodMs milliseconds
+		inline void SetMaxConnectionRatePerIP(uint32_t count, uint32_t periodMs){ m_iMaxConnectionRatePerIP = count; m_iConnectionRatePeriod = periodMs; }
+		
+		// Per client limits on incoming text and binary messages (control frames don't count), as token buckets that hold
+		// up to a second's worth. A message bigger than a second's worth of bytes goes through once the bucket is full.
+		// 0 disables each of them (the default). Outgoing connections aren't limited
+		inline void SetClientRateLimit(uint32_t messagesPerSecond, uint32_t bytesPerSecond, RateLimitPolicy policy = RateLimitPolicy::Delay){
+			m_iClientMessageRate = messagesPerSecond;
+			m_iClientByteRate = bytesPerSecond;
+			m_ClientRateLimitPolicy = policy;
+		}
+		
+		// Caps what all clients hold in buffers and queued writes (bufferBytes + queuedWriteBytes in GetMemoryUsage).
+		// While we're over it, connections are closed right after accepting them, and clients holding more than their share
+		// can't grow: the ones that don't read what we send are destroyed, the ones sending us big messages are paused for a bit.
+		// Destroyed clients stop counting right away, even if their writes take a while to go away. 0 disables it (the default)
+		inline void SetMemoryBudget(size_t bytes){ m_iMemoryBudget = bytes; }
+		inline size_t GetMemoryBudget() const { return m_iMemoryBudget; }
+		
+		// What counts towards the memory budget right now, even if there's no budget
+		inline size_t GetBufferedBytes() const { return m_iBufferedBytes; }
+		
+		// How long destroyed clients get to send what's left before we reset the connection. 0 waits forever,
+		// which lets peers that stop reading keep the socket (and our queued writes) around. 30 seconds by default
+		inline void SetLingerTimeout(uint32_t ms){ m_iLingerTimeout = ms; }
+		
+		// Runs the crypto of TLS handshakes on libuv's threadpool (UV_THREADPOOL_SIZE threads, 4 by default, shared with
+		// file system calls and DNS), so a burst of new connections doesn't stall everyone else on the loop.
+		// We stop reading from a client while its handshake is on the pool. Outgoing connections always do it on the loop. Off by default
+		inline void SetAsyncTLSHandshakes(bool v){ m_bAsyncTLSHandshakes = v; }
+		
+		// Sets TCP_NOTSENT_LOWAT on new TCP connections: the kernel only takes this many bytes that it hasn't sent yet,
+		// so a backlog builds up on our side instead, where Client::SendQueued can reorder and conflate it.
+		// Something like 16KB keeps latency low for lagging clients. 0 leaves the system default (the default)
+		inline void SetNotSentLowWatermark(uint32_t bytes){ m_iNotSentLowWatermark = bytes; }
+		
+		// Records latency histograms (callback durations, write queueing and handshake duration) into Metrics::Local()
+		// Off by default since it costs a couple of uv_hrtime calls per message
+		inline void SetRecordLatencies(bool v){ m_bRecordLatencies = v; }
+		inline bool GetRecordLatencies() const { return m_bRecordLatencies; }
+		
+		// Records what clients send us to a file, see CaptureWriter. nullptr (the default) stops capturing.
+		// Only connections accepted while this is set are captured
+		void SetCapture(CaptureWriter *capture){ m_pCapture = capture; }
+		
+		// Goes through every client, so it's for stats every now and then, not every message
+		MemoryUsage GetMemoryUsage() const;
+		
 		SSL_CTX* GetSSLContext() const { return m_pSSLContext; }
+		uv_loop_t* GetLoop() const { return m_pLoop; }
 		
 		inline void SetUserData(void *v){ m_pUserData = v; }
 		inline void* GetUserData() const { return m_pUserData; }
@@ -108,31 +286,152 @@ namespace ws28 {
 		// This means clients don't call CheckConnection, and they receive an empty request header in the connection callback
 		// Opcode is always binary
 		// In the alternative protocol, clients and servers send the packet length as a Little Endian uint32, then its contents
+		//
+		// v2 clients send 0x01 and a byte of AlternativeProtocolFlags instead, and we answer 0x01 and the flags we agreed to.
+		// Then both sides send varint (LEB128) (length << 1 | is batch), followed by length bytes:
+		//   a single message if it's not a batch, or (varint length, message) over and over if it is.
+		// With AlternativeMessageTypes, messages start with a type byte. Batches count as one message for SetMaxMessageSize,
+		// and as what they have inside for the rate limits. See Client::BeginBatch for sending them
 		inline void SetAllowAlternativeProtocol(bool v){ m_bAllowAlternativeProtocol = v; }
-		inline bool GetAllowAlternativeProtocol(){ return m_bAllowAlternativeProtocol; }
+		inline bool GetAllowAlternativeProtocol(){ return m_bAllowAlternativeProtocol && m_bCanParseAlternativeProtocol; }
+		
+		// The v2 flags we agree to if a client asks for them. None by default, since message types change what opcode means
+		inline void SetAlternativeProtocolFlags(uint8_t v){ m_iAlternativeProtocolFlags = v; }
 		
-		void Ref(){ if(m_Server) uv_ref((uv_handle_t*) m_Server.get()); }
-		void Unref(){ if(m_Server) uv_unref((uv_handle_t*) m_Server.get()); }
+		// Clients start with a PROXY protocol (v1 or v2) header, which tells us their real address. Connections without one
+		// are closed, so only use this if everything comes through a proxy that sends it
+		inline void SetProxyProtocol(bool v){ m_bProxyProtocol = v; }
+		
+		// Takes the client's address from this header of the WebSocket handshake (e.g. "X-Real-IP", or "X-Forwarded-For",
+		// whose last entry is used) instead of the socket. Only use it if everything comes through a proxy that always sets it,
+		// otherwise clients can say they're whoever they want. CheckTCPConnection still sees the proxy's address, since it's
+		// called before the handshake. Ignored with SetProxyProtocol
+		void SetRealIPHeader(std::string_view name);
+		
+		void Ref(){
+			if(m_Server) uv_ref((uv_handle_t*) m_Server.get());
+			if(m_UnixServer) uv_ref((uv_handle_t*) m_UnixServer.get());
+		}
+		
+		void Unref(){
+			if(m_Server) uv_unref((uv_handle_t*) m_Server.get());
+			if(m_UnixServer) uv_unref((uv_handle_t*) m_UnixServer.get());
+		}
 		
 	private:
+		struct ConnectRequest;
+		
 		void OnConnection(uv_stream_t* server, int status);
 		
+		// Everything we do with a connection we just accepted, whatever accepted it
+		void OnAccepted(Transport *transport);
+		bool StartListening(SocketHandle server, const ListenOptions &options);
+		bool StartListening(PipeHandle server, int backlog);
+		
+		// When a proxy tells us who clients are, per IP limits wait until it does
+		inline bool IsBehindProxy() const { return m_bProxyProtocol || !m_RealIPHeader.empty(); }
+		void OnOutgoingConnection(ConnectRequest *req, TransportHandle transport);
+		void NotifyConnectFailed(void *userData){
+			if(m_fnConnectFailed) m_fnConnectFailed(this, userData);
+		}
+		
+		// Masking keys for outgoing connections, taken from a pool we refill from RAND_bytes
+		void GenerateMaskKey(char *out);
+		
 		void NotifyClientInit(Client *client, HTTPRequest &req){
+			if(m_bRecordLatencies && client->m_iAcceptTime != 0){
+				Metrics::Local().Record(client->IsSecure() ? metrics::HandshakeTLSLatency : metrics::HandshakePlainLatency, uv_hrtime() - client->m_iAcceptTime);
+			}
+			
 			if(m_fnClientConnected) m_fnClientConnected(client, req);
 		}
 		
 		std::unique_ptr<Client> NotifyClientPreDestroyed(Client *client);
 		
+		void RemoveSubscription(Client *client, size_t index);
+		
+		// Empty buffers clients aren't using, see Client::TakeBuffer
+		enum { BUFFER_POOL_SIZE = 64 };
+		enum { MAX_POOLED_BUFFER_SIZE = 64 * 1024 };
+		void TakeBuffer(std::vector<char> &buffer);
+		void ReturnBuffer(std::vector<char> &buffer);
+		
+		struct IPState {
+			uint32_t connections;
+			uint32_t recentConnections; // Since windowStart
+			uint64_t windowStart;
+		};
+		
+		bool AdmitIP(const detail::IPKey &key);
+		void ReleaseIP(const detail::IPKey &key);
+		inline bool IsRateWindowOver(const IPState &state, uint64_t now) const { return now - state.windowStart >= m_iConnectionRatePeriod; }
+		
+		inline bool IsOverMemoryBudget() const { return m_iMemoryBudget != 0 && m_iBufferedBytes > m_iMemoryBudget; }
+		
 		void NotifyClientData(Client *client, char *data, size_t len, int opcode){
-			if(m_fnClientData) m_fnClientData(client, data, len, opcode);
+			if(!m_fnClientData) return;
+			
+			if(m_bRecordLatencies){
+				uint64_t start = uv_hrtime();
+				m_fnClientData(client, data, len, opcode);
+				Metrics::Local().Record(metrics::DataCallbackLatency, uv_hrtime() - start);
+			}else{
+				m_fnClientData(client, data, len, opcode);
+			}
+		}
+		
+		void NotifyClientDataBatch(Client *client, DataMessage *messages, size_t count){
+			if(m_bRecordLatencies){
+				uint64_t start = uv_hrtime();
+				m_fnClientDataBatch(client, messages, count);
+				Metrics::Local().Record(metrics::DataCallbackLatency, uv_hrtime() - start);
+			}else{
+				m_fnClientDataBatch(client, messages, count);
+			}
 		}
 		
 		uv_loop_t *m_pLoop;
 		SocketHandle m_Server;
+		PipeHandle m_UnixServer;
 		SSL_CTX *m_pSSLContext;
 		void *m_pUserData = nullptr;
+		CaptureWriter *m_pCapture = nullptr;
 		std::vector<std::unique_ptr<Client>> m_Clients;
+		std::vector<std::vector<char>> m_BufferPool;
+		
+		std::unordered_map<std::string_view, std::unique_ptr<detail::Topic>> m_Topics; // Keys point at the topic's name, so looking one up doesn't allocate
+		detail::EncodedFrame m_PublishFrame;
+		PubSubGroup *m_pGroup = nullptr;
+		detail::PublishInbox *m_pInbox = nullptr;
+		
+		detail::IPTable<IPState> m_IPs;
+		size_t m_iIPSweepSize = 1024; // Entries that only remember the rate are swept when we get this many
+		uint32_t m_iMaxConnectionsPerIP = 0;
+		uint32_t m_iMaxConnectionRatePerIP = 0;
+		uint32_t m_iConnectionRatePeriod = 0;
+		uint32_t m_iClientMessageRate = 0;
+		uint32_t m_iClientByteRate = 0;
+		RateLimitPolicy m_ClientRateLimitPolicy = RateLimitPolicy::Delay;
+		size_t m_iMemoryBudget = 0;
+		uint32_t m_iLingerTimeout = 30000;
+		bool m_bAsyncTLSHandshakes = false;
+		uint32_t m_iNotSentLowWatermark = 0;
+		size_t m_iBufferedBytes = 0; // Sum of the clients' m_iBufferedBytes
+		bool m_bProxyProtocol = false;
+		std::string m_RealIPHeader; // Lower case, like the parsed headers
+		std::vector<ConnectRequest*> m_ConnectRequests;
+		
+#ifdef WS28_IO_URING
+		bool m_bUseIOUring = false;
+		std::shared_ptr<detail::IOUring> m_IOUring; // Only while listening, clients keep it alive on their own
+		detail::IOUringAcceptor *m_pAcceptor = nullptr;
+#endif
+		
+		unsigned char m_MaskKeyPool[256];
+		size_t m_iMaskKeyPoolOffset = sizeof(m_MaskKeyPool);
 		bool m_bAllowAlternativeProtocol = false;
+		uint8_t m_iAlternativeProtocolFlags = 0;
+		bool m_bRecordLatencies = false;
 		
 		CheckTCPConnectionFn m_fnCheckTCPConnection = nullptr;
 		CheckConnectionFn m_fnCheckConnection = nullptr;
@@ -140,11 +439,24 @@ namespace ws28 {
 		ClientConnectedFn m_fnClientConnected = nullptr;
 		ClientDisconnectedFn m_fnClientDisconnected = nullptr;
 		ClientDataFn m_fnClientData = nullptr;
+		ClientDataBatchFn m_fnClientDataBatch = nullptr;
 		HTTPRequestFn m_fnHTTPRequest = nullptr;
+		HTTPBodyStartFn m_fnHTTPBodyStart = nullptr;
+		HTTPBodyDataFn m_fnHTTPBodyData = nullptr;
+		ConnectFailedFn m_fnConnectFailed = nullptr;
+		
+		std::string m_MetricsPath;
 		
 		size_t m_iMaxMessageSize = 16 * 1024;
 		
 		friend class Client;
+		friend struct detail::FunctionPointerDispatch;
+	
+	protected:
+		// Parses clients' frames and hands out the messages, BasicServer swaps in one that calls its handler directly
+		typedef bool (*ParseFramesFn)(Client *, std::string_view &buffer);
+		ParseFramesFn m_fnParseFrames;
+		bool m_bCanParseAlternativeProtocol = true; // Whether m_fnParseFrames was built with the alternative protocol
 	};
 	
 }
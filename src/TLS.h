@@ -3,6 +3,7 @@
 
 #include <vector>
 #include <mutex>
+#include <algorithm>
 
 #include <openssl/bio.h>
 #include <openssl/err.h>
@@ -18,6 +19,8 @@ class TLS {
 		SSLSTATUS_OK, SSLSTATUS_WANT_IO, SSLSTATUS_FAIL
 	};
 	
+	enum { MAX_RECORD_SIZE = 16 * 1024 };
+	
 public:
 	
 	TLS(SSL_CTX *ctx, bool server = true, const char *hostname = nullptr){
@@ -31,7 +34,12 @@ public:
 			SSL_set_connect_state(m_SSL);
 		}
 		
-		if(!server && hostname) SSL_set_tlsext_host_name(m_SSL, hostname);
+		if(!server && hostname){
+			SSL_set_tlsext_host_name(m_SSL, hostname);
+			
+			// Only enforced if the context has SSL_VERIFY_PEER
+			SSL_set1_host(m_SSL, hostname);
+		}
 		SSL_set_bio(m_SSL, m_ReadBIO, m_WriteBIO);
 		
 		if(!server) DoSSLHandhake();
@@ -61,14 +69,31 @@ public:
 	// Writes unencrypted bytes to be encrypted and sent out
 	// If this returns false, the connection must be closed
 	bool Write(const char *buf, size_t len){
+		if(!m_EncryptBuf.empty() || !SSL_is_init_finished(m_SSL)){
+			m_EncryptBuf.insert(m_EncryptBuf.end(), buf, buf + len);
+			return DoEncrypt();
+		}
+		
+		// Nothing's waiting in front of it, so it's encrypted straight from buf
+		while(len > 0){
+			int n = Encrypt(buf, len);
+			if(n < 0) return false;
+			
+			buf += n;
+			len -= n;
+		}
+		
+		return true;
+	}
+	
+	// Holds bytes to be encrypted together with the next Write, so they end up in the same record (if they fit in one)
+	void Queue(const char *buf, size_t len){
 		m_EncryptBuf.insert(m_EncryptBuf.end(), buf, buf + len);
-		return DoEncrypt();
 	}
 	
-	// Process raw bytes received from the other side
+	// Process raw bytes received from the other side, appending what they decrypt to out
 	// If this returns false, the connection must be closed
-	template<typename F>
-	bool ReceivedData(const char *src, size_t len, const F &f){
+	bool ReceivedData(const char *src, size_t len, std::vector<char> &out){
 		int n;
 		while(len > 0){
 			n = BIO_write(m_ReadBIO, src, len);
@@ -82,14 +107,26 @@ public:
 			if(!SSL_is_init_finished(m_SSL)){
 				if(DoSSLHandhake() == SSLSTATUS_FAIL) return false;
 				if(!SSL_is_init_finished(m_SSL)) return true;
+				
+				// Clients can write before the handshake is done, that can go out now
+				if(!DoEncrypt()) return false;
 			}
 			
 			ERR_clear_error();
 			do {
-				char buf[4096];
-				n = SSL_read(m_SSL, buf, sizeof buf);
-				if(n > 0){
-					f(buf, (size_t) n);
+				size_t room = NextReadSize();
+				
+				if(room == 0){
+					// Probably nothing left, which we don't want to grow out for just to find out
+					char probe[256];
+					n = SSL_read(m_SSL, probe, sizeof(probe));
+					if(n > 0) out.insert(out.end(), probe, probe + n);
+				}else{
+					size_t offset = out.size();
+					out.resize(offset + room);
+					
+					n = SSL_read(m_SSL, out.data() + offset, (int) room);
+					out.resize(offset + (n > 0 ? (size_t) n : 0));
 				}
 			}while(n > 0);
 			
@@ -131,6 +168,24 @@ public:
 	}
 	
 private:
+	// How much the next SSL_read can give us, so we don't grow (and zero) buffers for nothing.
+	// A guess that's too small is fine, the rest of the record shows up in SSL_pending
+	size_t NextReadSize(){
+		size_t pending = (size_t) SSL_pending(m_SSL);
+		if(pending != 0) return pending;
+		
+		char *data;
+		long avail = BIO_get_mem_data(m_ReadBIO, &data);
+		if(avail <= 0) return 0;
+		
+		// If OpenSSL is halfway through a record, what's in the BIO is the rest of it and not a header
+		if(avail < 5 || SSL_has_pending(m_SSL)) return std::min((size_t) avail, (size_t) MAX_RECORD_SIZE);
+		
+		// Otherwise the header tells us how long the record is, the plaintext is a bit shorter
+		size_t recordLen = ((size_t) (uint8_t) data[3] << 8) | (uint8_t) data[4];
+		return std::min(recordLen, (size_t) MAX_RECORD_SIZE);
+	}
+	
 	SSLStatus GetSSLStatus(int n){
 		switch(SSL_get_error(m_SSL, n)){
 			case SSL_ERROR_NONE:
@@ -154,34 +209,40 @@ private:
 	bool DoEncrypt(){
 		if(!SSL_is_init_finished(m_SSL)) return true;
 		
-		int n;
-		
 		while(!m_EncryptBuf.empty()){
-			ERR_clear_error();
-			n = SSL_write(m_SSL, m_EncryptBuf.data(), (int) m_EncryptBuf.size());
-			
-			if(GetSSLStatus(n) == SSLSTATUS_FAIL) return false;
+			int n = Encrypt(m_EncryptBuf.data(), m_EncryptBuf.size());
+			if(n < 0) return false;
 			
-			if(n > 0){
-				// Consume bytes
-				m_EncryptBuf.erase(m_EncryptBuf.begin(), m_EncryptBuf.begin() + n);
-				
-				// Write them out
-				do {
-					char buf[4096];
-					n = BIO_read(m_WriteBIO, buf, sizeof buf);
-					if(n > 0){
-						QueueEncrypted(buf, n);
-					}else if(!BIO_should_retry(m_WriteBIO)){
-						return false;
-					}
-				}while(n > 0);
-			}
+			// Consume bytes
+			m_EncryptBuf.erase(m_EncryptBuf.begin(), m_EncryptBuf.begin() + n);
 		}
 		
 		return true;
 	}
 	
+	// Encrypts what OpenSSL takes from buf into m_WriteBuf. Returns how many bytes that was, or -1 on failure
+	int Encrypt(const char *buf, size_t len){
+		ERR_clear_error();
+		int n = SSL_write(m_SSL, buf, (int) len);
+		
+		if(GetSSLStatus(n) == SSLSTATUS_FAIL) return -1;
+		if(n <= 0) return 0;
+		
+		// Write them out
+		int r;
+		do {
+			char out[4096];
+			r = BIO_read(m_WriteBIO, out, sizeof out);
+			if(r > 0){
+				QueueEncrypted(out, r);
+			}else if(!BIO_should_retry(m_WriteBIO)){
+				return -1;
+			}
+		}while(r > 0);
+		
+		return n;
+	}
+	
 	SSLStatus DoSSLHandhake(){
 		ERR_clear_error();
 		SSLStatus status = GetSSLStatus(SSL_do_handshake(m_SSL));
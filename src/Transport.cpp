@@ -0,0 +1,374 @@
+#include "Transport.h"
+#include "Client.h"
+#include <cassert>
+#include <cstring>
+
+namespace ws28 {
+
+void Transport::NotifyData(char *data, size_t len){
+	if(m_pClient != nullptr) m_pClient->OnRawSocketData(data, len);
+	
+	// Whatever we read might have grown its buffers
+	if(m_pClient != nullptr) m_pClient->UpdateBufferedBytes();
+}
+
+void Transport::NotifyReadError(){
+	if(m_pClient != nullptr) m_pClient->Destroy(DestroyReason::ReadError);
+}
+
+namespace detail {
+
+int StreamTransport::TryWrite(const uv_buf_t *bufs, unsigned int nbufs){
+	return uv_try_write(m_pStream, bufs, nbufs);
+}
+
+bool StreamTransport::Write(const uv_buf_t *bufs, unsigned int nbufs, WriteCallback cb, void *userData){
+	struct WriteRequest : uv_write_t {
+		WriteCallback cb;
+		void *userData;
+	};
+	
+	auto req = new WriteRequest();
+	req->cb = cb;
+	req->userData = userData;
+	
+	if(uv_write(req, m_pStream, bufs, nbufs, [](uv_write_t *reqq, int status){
+		auto req = (WriteRequest*) reqq;
+		req->cb(req->userData, status);
+		delete req;
+	}) != 0){
+		delete req;
+		return false;
+	}
+	
+	return true;
+}
+
+void StreamTransport::Shutdown(ShutdownCallback cb, void *userData){
+	struct ShutdownRequest : uv_shutdown_t {
+		ShutdownCallback cb;
+		void *userData;
+	};
+	
+	auto req = new ShutdownRequest();
+	req->cb = cb;
+	req->userData = userData;
+	
+	if(uv_shutdown(req, m_pStream, [](uv_shutdown_t *reqq, int){
+		auto req = (ShutdownRequest*) reqq;
+		req->cb(req->userData);
+		delete req;
+	}) != 0){
+		// There's nothing to shut down gracefully, the callback comes once we're closed
+		delete req;
+		m_fnShutdown = cb;
+		m_pShutdownUserData = userData;
+		Close();
+	}
+}
+
+void StreamTransport::StartReading(){
+	uv_read_start(m_pStream, [](uv_handle_t*, size_t suggested_size, uv_buf_t *buf){
+		buf->base = new char[suggested_size];
+		buf->len = suggested_size;
+	}, [](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf){
+		auto transport = (StreamTransport*) stream->data;
+		
+		if(nread < 0){
+			transport->NotifyReadError();
+		}else if(nread > 0){
+			transport->NotifyData(buf->base, (size_t) nread);
+		}
+		
+		if(buf != nullptr) delete[] buf->base;
+	});
+}
+
+void StreamTransport::StopReading(){
+	uv_read_stop(m_pStream);
+}
+
+void StreamTransport::Abort(){
+	if(m_bClosing) return;
+	
+	// A zero linger makes close send a RST and throw away what the kernel still has for the peer
+	if(m_pStream->type == UV_TCP){
+		struct linger l;
+		l.l_onoff = 1;
+		l.l_linger = 0;
+		
+		uv_os_fd_t fd;
+		if(uv_fileno((uv_handle_t*) m_pStream, &fd) == 0){
+			setsockopt((uv_os_sock_t) fd, SOL_SOCKET, SO_LINGER, (const char*) &l, sizeof(l));
+		}
+	}
+	
+	// Closing cancels the shutdown, which calls its callback
+	Close();
+}
+
+void StreamTransport::Release(){
+	m_pClient = nullptr;
+	m_bReleased = true;
+	
+	if(m_bClosed){
+		delete this;
+	}else{
+		Close();
+	}
+}
+
+void StreamTransport::Close(){
+	if(m_bClosing) return;
+	m_bClosing = true;
+	
+	// Pending writes are cancelled before the close callback, so their requests never outlive us
+	uv_close((uv_handle_t*) m_pStream, [](uv_handle_t *h){
+		auto transport = (StreamTransport*) h->data;
+		
+		if(transport->m_fnShutdown != nullptr){
+			auto cb = transport->m_fnShutdown;
+			transport->m_fnShutdown = nullptr;
+			cb(transport->m_pShutdownUserData);
+		}
+		
+		transport->m_bClosed = true;
+		if(transport->m_bReleased) delete transport;
+	});
+}
+
+TCPTransport::TCPTransport(uv_loop_t *loop) : StreamTransport((uv_stream_t*) &m_Socket){
+	uv_tcp_init(loop, &m_Socket);
+	m_Socket.data = this;
+}
+
+void TCPTransport::SetDefaultOptions(){
+	uv_tcp_nodelay(&m_Socket, true);
+	uv_tcp_keepalive(&m_Socket, true, 10000);
+}
+
+void TCPTransport::SetNotSentLowWatermark(uint32_t bytes){
+#ifdef TCP_NOTSENT_LOWAT
+	uv_os_fd_t fd;
+	if(uv_fileno((uv_handle_t*) &m_Socket, &fd) != 0) return;
+	
+	int v = (int) bytes;
+	setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &v, sizeof(v));
+#endif
+}
+
+bool TCPTransport::GetPeerAddress(struct sockaddr_storage &addr){
+	int addrLen = sizeof(addr);
+	return uv_tcp_getpeername(&m_Socket, (sockaddr*) &addr, &addrLen) == 0;
+}
+
+void TCPTransport::Cork(bool v){
+#if defined(TCP_CORK) || defined(TCP_NOPUSH)
+	
+	int enable = v;
+	uv_os_fd_t fd;
+	if(uv_fileno((uv_handle_t*) &m_Socket, &fd) != 0) return;
+	
+	// Shamelessly copied from uWebSockets
+#if defined(TCP_CORK)
+	// Linux
+	setsockopt(fd, IPPROTO_TCP, TCP_CORK, &enable, sizeof(int));
+#elif defined(TCP_NOPUSH)
+	// Mac OS X & FreeBSD
+	setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, &enable, sizeof(int));
+	
+	// MacOS needs this to flush the messages out
+	if(!enable){
+		::send(fd, "", 0, 0);
+	}
+#endif
+
+#endif
+}
+
+PipeTransport::PipeTransport(uv_loop_t *loop) : StreamTransport((uv_stream_t*) &m_Socket){
+	uv_pipe_init(loop, &m_Socket, 0);
+	m_Socket.data = this;
+}
+
+bool PipeTransport::GetPeerAddress(struct sockaddr_storage &addr){
+	memset(&addr, 0, sizeof(addr));
+	return uv_ip4_addr("127.0.0.1", 0, (struct sockaddr_in*) &addr) == 0;
+}
+
+}
+
+MemoryTransport::MemoryTransport(const char *ip){
+	memset(&m_Address, 0, sizeof(m_Address));
+	
+	if(uv_ip4_addr(ip, 0, (struct sockaddr_in*) &m_Address) != 0 && uv_ip6_addr(ip, 0, (struct sockaddr_in6*) &m_Address) != 0){
+		m_Address.ss_family = AF_UNSPEC;
+	}
+}
+
+bool MemoryTransport::Push(const char *data, size_t len){
+	RunCallbacks();
+	if(m_pClient == nullptr) return false;
+	
+	if(!m_bReading){
+		m_HeldInput.insert(m_HeldInput.end(), data, data + len);
+		return true;
+	}
+	
+	// The client modifies what it reads in place, so it gets a copy, like it would from a socket
+	m_ReadBuffer.assign(data, data + len);
+	NotifyData(m_ReadBuffer.data(), m_ReadBuffer.size());
+	
+	RunCallbacks();
+	return m_pClient != nullptr;
+}
+
+void MemoryTransport::PushEOF(){
+	m_bHeldEOF = true;
+	RunCallbacks();
+}
+
+void MemoryTransport::Reset(){
+	NotifyReadError();
+	RunCallbacks();
+}
+
+void MemoryTransport::RunCallbacks(){
+	if(m_bReading && m_pClient != nullptr && !m_HeldInput.empty()){
+		m_ReadBuffer.swap(m_HeldInput);
+		m_HeldInput.clear();
+		NotifyData(m_ReadBuffer.data(), m_ReadBuffer.size());
+	}
+	
+	if(m_bReading && m_pClient != nullptr && m_bHeldEOF && m_HeldInput.empty()){
+		m_bHeldEOF = false;
+		NotifyReadError();
+	}
+	
+	// Callbacks might write more
+	while(!m_Done.empty()){
+		auto done = std::move(m_Done);
+		m_Done.clear();
+		
+		for(auto &w : done) w.cb(w.userData, 0);
+	}
+	
+	if(m_fnShutdown != nullptr && m_Blocked.empty()){
+		auto cb = m_fnShutdown;
+		m_fnShutdown = nullptr;
+		
+		// This is where the client lets go of us
+		cb(m_pShutdownUserData);
+	}
+}
+
+void MemoryTransport::SetBlocked(bool v){
+	m_bBlocked = v;
+	if(v) return;
+	
+	for(auto &w : m_Blocked){
+		m_Output.insert(m_Output.end(), w.data.begin(), w.data.end());
+		w.data.clear();
+		m_Done.push_back(std::move(w));
+	}
+	
+	m_Blocked.clear();
+	RunCallbacks();
+}
+
+int MemoryTransport::TryWrite(const uv_buf_t *bufs, unsigned int nbufs){
+	if(m_bReleased || m_bShutdown) return UV_EPIPE;
+	if(m_bBlocked || !m_Blocked.empty()) return UV_EAGAIN;
+	
+	size_t total = 0;
+	for(unsigned int i = 0; i < nbufs; ++i){
+		m_Output.insert(m_Output.end(), bufs[i].base, bufs[i].base + bufs[i].len);
+		total += bufs[i].len;
+	}
+	
+	return (int) total;
+}
+
+bool MemoryTransport::Write(const uv_buf_t *bufs, unsigned int nbufs, WriteCallback cb, void *userData){
+	if(m_bReleased || m_bShutdown) return false;
+	
+	PendingWrite w;
+	w.cb = cb;
+	w.userData = userData;
+	
+	if(m_bBlocked || !m_Blocked.empty()){
+		for(unsigned int i = 0; i < nbufs; ++i){
+			w.data.insert(w.data.end(), bufs[i].base, bufs[i].base + bufs[i].len);
+		}
+		
+		m_Blocked.push_back(std::move(w));
+	}else{
+		for(unsigned int i = 0; i < nbufs; ++i){
+			m_Output.insert(m_Output.end(), bufs[i].base, bufs[i].base + bufs[i].len);
+		}
+		
+		m_Done.push_back(std::move(w));
+	}
+	
+	return true;
+}
+
+void MemoryTransport::Shutdown(ShutdownCallback cb, void *userData){
+	assert(!m_bShutdown);
+	
+	m_bShutdown = true;
+	m_fnShutdown = cb;
+	m_pShutdownUserData = userData;
+}
+
+void MemoryTransport::StartReading(){
+	// Held input is delivered on the next Push or RunCallbacks, since we might be inside the client right now
+	m_bReading = true;
+}
+
+void MemoryTransport::StopReading(){
+	m_bReading = false;
+}
+
+bool MemoryTransport::GetPeerAddress(struct sockaddr_storage &addr){
+	if(m_Address.ss_family == AF_UNSPEC) return false;
+	
+	addr = m_Address;
+	return true;
+}
+
+void MemoryTransport::Abort(){
+	m_bAborted = true;
+	
+	for(auto &w : m_Blocked) w.cb(w.userData, UV_ECANCELED);
+	m_Blocked.clear();
+	
+	// The shutdown callback comes on the next RunCallbacks, now that nothing's blocking it
+}
+
+void MemoryTransport::Release(){
+	m_pClient = nullptr;
+	m_bReleased = true;
+	m_fnShutdown = nullptr;
+	
+	for(auto &w : m_Done) w.cb(w.userData, 0);
+	for(auto &w : m_Blocked) w.cb(w.userData, UV_ECANCELED);
+	
+	m_Done.clear();
+	m_Blocked.clear();
+}
+
+size_t MemoryTransport::GetMemoryUsage() const {
+	size_t total = sizeof(*this) + m_Output.capacity() + m_ReadBuffer.capacity() + m_HeldInput.capacity();
+	total += (m_Blocked.capacity() + m_Done.capacity()) * sizeof(PendingWrite);
+	for(auto &w : m_Blocked) total += w.data.capacity();
+	return total;
+}
+
+size_t MemoryTransport::GetQueuedBytes() const {
+	size_t total = 0;
+	for(auto &w : m_Blocked) total += w.data.size();
+	return total;
+}
+
+}
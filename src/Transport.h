@@ -0,0 +1,234 @@
+#ifndef H_CC9C36BC86324DB695D4F6FF0A29BB8D
+#define H_CC9C36BC86324DB695D4F6FF0A29BB8D
+
+#include <memory>
+#include <vector>
+#include <uv.h>
+
+namespace ws28 {
+	class Client;
+	class Server;
+	
+	namespace detail {
+		struct SocketDeleter {
+			template<typename T>
+			void operator()(T *socket) const {
+				if(socket == nullptr) return;
+				uv_close((uv_handle_t*) socket, [](uv_handle_t *h){
+					delete (T*) h;
+				});
+			}
+		};
+	}
+	
+	typedef std::unique_ptr<uv_tcp_t, detail::SocketDeleter> SocketHandle;
+	typedef std::unique_ptr<uv_pipe_t, detail::SocketDeleter> PipeHandle;
+	
+	// Where the bytes of a Client come from and go to. Clients we accept or connect use a libuv TCP (or Unix) socket,
+	// but anything that can feed bytes to a client and take its output works, see MemoryTransport
+	class Transport {
+	public:
+		typedef void (*WriteCallback)(void *userData, int status);
+		typedef void (*ShutdownCallback)(void *userData);
+		
+		Transport(){}
+		Transport(const Transport &other) = delete;
+		Transport& operator=(const Transport &other) = delete;
+		
+		// Writes as much as it can right away. Returns how many bytes were written, or a negative libuv error
+		// (UV_EAGAIN if nothing can be written right now)
+		virtual int TryWrite(const uv_buf_t *bufs, unsigned int nbufs) = 0;
+		
+		// Queues a write, bufs must stay alive until cb is called. status is negative if the write failed
+		// Returns false if the write couldn't even be queued, in which case cb is never called
+		virtual bool Write(const uv_buf_t *bufs, unsigned int nbufs, WriteCallback cb, void *userData) = 0;
+		
+		// Closes our side once queued writes are done, then calls cb. Always asynchronous
+		virtual void Shutdown(ShutdownCallback cb, void *userData) = 0;
+		
+		// Gives up on a Shutdown that takes too long: queued writes are dropped and the connection is closed right away
+		// (with a RST on TCP). The shutdown callback still comes, asynchronously. Does nothing by default
+		virtual void Abort(){}
+		
+		virtual void StartReading() = 0;
+		virtual void StopReading() = 0;
+		
+		virtual bool GetPeerAddress(struct sockaddr_storage &addr) = 0;
+		
+		// Hints that we're about to write several things in a row (TCP_CORK)
+		virtual void Cork(bool){}
+		
+		// Socket options we want on connections we accept (TCP_NODELAY and keepalive)
+		virtual void SetDefaultOptions(){}
+		
+		// TCP_NOTSENT_LOWAT, see Server::SetNotSentLowWatermark
+		virtual void SetNotSentLowWatermark(uint32_t){}
+		
+		// What we take in memory, for Server::GetMemoryUsage. 0 if we don't know
+		virtual size_t GetMemoryUsage() const { return 0; }
+		
+		// Bytes we copied from writes and haven't written yet (libuv doesn't copy, clients count those themselves)
+		virtual size_t GetQueuedBytes() const { return 0; }
+		
+		// Called once the client is done with us, instead of delete
+		virtual void Release() = 0;
+	
+	protected:
+		virtual ~Transport(){}
+		
+		// Implementations call these when they read something. They do nothing if the client is gone
+		void NotifyData(char *data, size_t len);
+		void NotifyReadError();
+		
+		Client *m_pClient = nullptr;
+		
+		friend class Client;
+	};
+	
+	namespace detail {
+		struct TransportDeleter {
+			void operator()(Transport *transport) const {
+				if(transport != nullptr) transport->Release();
+			}
+		};
+	}
+	
+	typedef std::unique_ptr<Transport, detail::TransportDeleter> TransportHandle;
+	
+	namespace detail {
+		// Everything that works the same on any libuv stream. Subclasses embed their handle, so a connection is a single allocation
+		class StreamTransport : public Transport {
+		public:
+			int TryWrite(const uv_buf_t *bufs, unsigned int nbufs) override;
+			bool Write(const uv_buf_t *bufs, unsigned int nbufs, WriteCallback cb, void *userData) override;
+			void Shutdown(ShutdownCallback cb, void *userData) override;
+			void StartReading() override;
+			void StopReading() override;
+			void Abort() override;
+			void Release() override;
+		
+		protected:
+			StreamTransport(uv_stream_t *stream) : m_pStream(stream){}
+			
+		private:
+			// Closes the handle, we're deleted once it's closed and released
+			void Close();
+			
+			uv_stream_t *m_pStream; // Points into the subclass
+			ShutdownCallback m_fnShutdown = nullptr; // If uv_shutdown failed, called once we're closed
+			void *m_pShutdownUserData = nullptr;
+			bool m_bClosing = false;
+			bool m_bClosed = false;
+			bool m_bReleased = false;
+		};
+		
+		// libuv TCP socket
+		class TCPTransport : public StreamTransport {
+		public:
+			TCPTransport(uv_loop_t *loop);
+			
+			uv_tcp_t* GetSocket(){ return &m_Socket; }
+			
+			void SetDefaultOptions() override;
+			void SetNotSentLowWatermark(uint32_t bytes) override;
+			bool GetPeerAddress(struct sockaddr_storage &addr) override;
+			void Cork(bool v) override;
+			size_t GetMemoryUsage() const override { return sizeof(*this); }
+		
+		private:
+			uv_tcp_t m_Socket;
+		};
+		
+		// Unix domain socket (or named pipe on Windows), for clients coming from a proxy on the same machine.
+		// There's no address to get from it, so its peer looks like 127.0.0.1 until the proxy tells us who it is
+		// (see Server::SetProxyProtocol and Server::SetRealIPHeader)
+		class PipeTransport : public StreamTransport {
+		public:
+			PipeTransport(uv_loop_t *loop);
+			
+			uv_pipe_t* GetSocket(){ return &m_Socket; }
+			
+			bool GetPeerAddress(struct sockaddr_storage &addr) override;
+			size_t GetMemoryUsage() const override { return sizeof(*this); }
+		
+		private:
+			uv_pipe_t m_Socket;
+		};
+	}
+	
+	// A transport that never touches a socket: you push the bytes the client receives,
+	// and everything the client writes is collected in GetOutput().
+	// This drives the whole protocol stack (including TLS) deterministically and without syscalls.
+	// Nothing happens in the background: write and shutdown callbacks run on the next Push or RunCallbacks,
+	// which shouldn't be called from inside server callbacks.
+	// You own this object, and it must outlive the client (check IsReleased)
+	class MemoryTransport : public Transport {
+	public:
+		MemoryTransport(const char *ip = "127.0.0.1");
+		
+		// Feeds bytes to the client as if they were read from the socket. If reading is stopped,
+		// they're held until it starts again. Returns false if the client is gone
+		bool Push(const char *data, size_t len);
+		
+		// The other side closed the connection. Like with a socket, the client only notices while it's reading
+		void PushEOF();
+		
+		// The connection was reset, the client is destroyed even if it isn't reading
+		void Reset();
+		
+		// Runs write and shutdown callbacks that are due
+		void RunCallbacks();
+		
+		// While blocked, TryWrite returns UV_EAGAIN and queued writes don't complete, like a full socket buffer
+		void SetBlocked(bool v);
+		
+		std::vector<char>& GetOutput(){ return m_Output; }
+		
+		inline bool IsReading() const { return m_bReading; }
+		inline bool IsShutdown() const { return m_bShutdown; }
+		
+		// The client is gone and won't touch us anymore
+		inline bool IsReleased() const { return m_bReleased; }
+		
+		// The client gave up on shutting down gracefully (see Server::SetLingerTimeout)
+		inline bool IsAborted() const { return m_bAborted; }
+		
+		int TryWrite(const uv_buf_t *bufs, unsigned int nbufs) override;
+		bool Write(const uv_buf_t *bufs, unsigned int nbufs, WriteCallback cb, void *userData) override;
+		void Shutdown(ShutdownCallback cb, void *userData) override;
+		void StartReading() override;
+		void StopReading() override;
+		bool GetPeerAddress(struct sockaddr_storage &addr) override;
+		void Abort() override;
+		void Release() override;
+		size_t GetMemoryUsage() const override;
+		size_t GetQueuedBytes() const override;
+	
+	private:
+		struct PendingWrite {
+			std::vector<char> data;
+			WriteCallback cb;
+			void *userData;
+		};
+		
+		struct sockaddr_storage m_Address;
+		std::vector<char> m_Output;
+		std::vector<char> m_ReadBuffer;
+		std::vector<char> m_HeldInput;
+		std::vector<PendingWrite> m_Blocked; // Not written yet
+		std::vector<PendingWrite> m_Done; // Written, waiting for the callback
+		
+		ShutdownCallback m_fnShutdown = nullptr;
+		void *m_pShutdownUserData = nullptr;
+		
+		bool m_bBlocked = false;
+		bool m_bReading = false;
+		bool m_bHeldEOF = false;
+		bool m_bShutdown = false;
+		bool m_bReleased = false;
+		bool m_bAborted = false;
+	};
+
+}
+
+#endif